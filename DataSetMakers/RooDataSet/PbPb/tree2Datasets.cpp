@@ -25,6 +25,7 @@
 #include "RooDataSet.h"
 #include "RooRealVar.h"
 #include "RooCategory.h"
+#include "DimuonColumns.h"
 #include "RooPlot.h"
 
 #include <TCanvas.h>
@@ -1949,8 +1950,11 @@ int main(int argc, char* argv[]) {
     }
   }
 
-
   Out->Close();
+
+  // Column files of the samples read by the fitter, memory-mapped there instead of read from the file above
+  writeColumnStore(dataJpsi, columnFileName(namefile, "dataJpsi"));
+  if (doWeighting) writeColumnStore(dataJpsiWeight, columnFileName(namefile, "dataJpsiWeight"), Jpsi_3DEff->GetName());
   delete [] randomVar;
 
   cout << "PassingEvent: " << PassingEvent->GetEntries() << endl;
@@ -0,0 +1,237 @@
+/*****************************************************************************
+ * Columnar dimuon candidate store                                           *
+ *                                                                           *
+ * Written by the dataset makers next to the RooDataSet files, memory-mapped *
+ * by the fitter. Only the columns and rows a job touches are paged in.      *
+ *****************************************************************************/
+#ifndef DIMUON_COLUMNS
+#define DIMUON_COLUMNS
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "RooDataSet.h"
+#include "RooRealVar.h"
+#include "RooArgSet.h"
+
+// File layout, all numbers in the byte order of the writing machine:
+//   ColumnFileHeader, nColumns x ColumnFileEntry, then the columns: nRows
+//   doubles each, every column starting on a page boundary so that a column
+//   which is never read is never paged in.
+// Doubles keep the values of the RooDataSet bit for bit, the bin edges of the
+// fit (roundCut) select exactly the same candidates from both formats.
+static const char columnFileMagic[8] = {'D','M','U','C','O','L','S','1'};
+static const Long64_t columnFileAlign = 4096;
+
+struct ColumnFileHeader {
+  char magic[8];
+  Int_t nColumns;
+  Int_t weightColumn;   // column holding the event weights, -1: unweighted
+  Long64_t nRows;
+};
+
+struct ColumnFileEntry {
+  char name[32];
+  char title[64];
+  char unit[16];
+  Double_t min, max;    // range of the RooRealVar
+  Long64_t offset;      // position of the first value in the file
+};
+
+// Read-only view of a column file, valid until closeColumnStore()
+struct ColumnStore {
+  int fd;
+  char *base;
+  size_t size;
+  Long64_t nRows;
+  Int_t weightColumn;
+  std::vector<ColumnFileEntry> entries;
+
+  ColumnStore() : fd(-1), base(0), size(0), nRows(0), weightColumn(-1) { }
+
+  // Values of a column, 0 if the store has no such column
+  const Double_t* column(const char *name) const {
+    for (unsigned int i=0; i<entries.size(); i++) {
+      if (!strcmp(entries[i].name, name)) return (const Double_t*)(base + entries[i].offset);
+    }
+    return 0;
+  }
+  const Double_t* column(int i) const { return (const Double_t*)(base + entries[i].offset); }
+};
+
+// Column file of sample dsName in the RooDataSet file fileName: <file without .root>_<dsName>.cols
+std::string columnFileName(const std::string &fileName, const char *dsName) {
+  std::string base = fileName;
+  if (base.size() > 5 && !base.compare(base.size()-5, 5, ".root")) base.erase(base.size()-5);
+  return base + "_" + dsName + ".cols";
+}
+
+// Every RooRealVar of ds becomes a column, the weights of a weighted ds are
+// written as the column weightName. Returns 0 on success, -1 on failure.
+int writeColumnStore(RooDataSet *ds, const std::string &fileName, const char *weightName = 0) {
+  std::vector<RooRealVar*> vars;
+  const RooArgSet *row = ds->get();
+  TIterator *it = row->createIterator();
+  RooAbsArg *arg;
+  while ((arg = (RooAbsArg*)it->Next())) {
+    RooRealVar *var = dynamic_cast<RooRealVar*>(arg);
+    if (var) vars.push_back(var);
+    else std::cout << "writeColumnStore:: " << arg->GetName() << " is not a RooRealVar, not written" << std::endl;
+  }
+  delete it;
+  bool weighted = (weightName != 0 && ds->isWeighted());
+
+  Long64_t nRows = ds->numEntries();
+  int nCols = vars.size() + (weighted ? 1 : 0);
+  std::vector< std::vector<Double_t> > values(nCols, std::vector<Double_t>(nRows));
+  for (Long64_t iEntry=0; iEntry<nRows; iEntry++) {
+    ds->get(iEntry);
+    for (unsigned int i=0; i<vars.size(); i++) values[i][iEntry] = vars[i]->getVal();
+    if (weighted) values[nCols-1][iEntry] = ds->weight();
+  }
+
+  ColumnFileHeader header;
+  memcpy(header.magic, columnFileMagic, 8);
+  header.nColumns = nCols;
+  header.weightColumn = weighted ? nCols-1 : -1;
+  header.nRows = nRows;
+
+  std::vector<ColumnFileEntry> entries(nCols);
+  Long64_t offset = sizeof(header) + nCols*sizeof(ColumnFileEntry);
+  for (int i=0; i<nCols; i++) {
+    ColumnFileEntry &entry = entries[i];
+    memset(&entry, 0, sizeof(entry));
+    if (i < (int)vars.size()) {
+      strncpy(entry.name, vars[i]->GetName(), sizeof(entry.name)-1);
+      strncpy(entry.title, vars[i]->GetTitle(), sizeof(entry.title)-1);
+      strncpy(entry.unit, vars[i]->getUnit(), sizeof(entry.unit)-1);
+      entry.min = vars[i]->getMin();
+      entry.max = vars[i]->getMax();
+    } else {
+      strncpy(entry.name, weightName, sizeof(entry.name)-1);
+      strncpy(entry.title, "Event weight", sizeof(entry.title)-1);
+      entry.min = 0; entry.max = 0;
+      for (Long64_t iEntry=0; iEntry<nRows; iEntry++) {
+        if (iEntry == 0 || values[i][iEntry] < entry.min) entry.min = values[i][iEntry];
+        if (iEntry == 0 || values[i][iEntry] > entry.max) entry.max = values[i][iEntry];
+      }
+    }
+    offset = ((offset + columnFileAlign - 1) / columnFileAlign) * columnFileAlign;
+    entry.offset = offset;
+    offset += nRows*sizeof(Double_t);
+  }
+
+  // Written under a temporary name, so that running fits never map a partial file
+  char tmpName[4096];
+  sprintf(tmpName,"%s.%d.tmp",fileName.c_str(),(int)getpid());
+  FILE *out = fopen(tmpName, "wb");
+  if (out == 0) { std::cout << "writeColumnStore:: Fail to open " << tmpName << std::endl; return -1; }
+  bool ok = (fwrite(&header, sizeof(header), 1, out) == 1);
+  if (nCols > 0) ok = ok && (fwrite(&entries[0], sizeof(ColumnFileEntry), nCols, out) == (size_t)nCols);
+  for (int i=0; i<nCols && ok; i++) {
+    ok = (fseek(out, entries[i].offset, SEEK_SET) == 0);
+    if (nRows > 0) ok = ok && (fwrite(&values[i][0], sizeof(Double_t), nRows, out) == (size_t)nRows);
+  }
+  ok = (fclose(out) == 0) && ok;
+  if (!ok || rename(tmpName, fileName.c_str()) != 0) {
+    std::cout << "writeColumnStore:: Fail to write " << fileName << std::endl;
+    unlink(tmpName);
+    return -1;
+  }
+  std::cout << "writeColumnStore:: " << ds->GetName() << ": " << nRows << " rows, " << nCols << " columns in " << fileName << std::endl;
+  return 0;
+}
+
+// Maps fileName: 0 on success, -1 if there is no file, -2 if it is not a valid column file
+int openColumnStore(const std::string &fileName, ColumnStore &store) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ColumnFileHeader)) { close(fd); return -2; }
+  void *base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) { close(fd); return -2; }
+
+  const ColumnFileHeader *header = (const ColumnFileHeader*)base;
+  bool ok = !memcmp(header->magic, columnFileMagic, 8) && header->nColumns >= 0 && header->nRows >= 0 &&
+            header->weightColumn < header->nColumns &&
+            sizeof(ColumnFileHeader) + header->nColumns*sizeof(ColumnFileEntry) <= (size_t)st.st_size;
+  std::vector<ColumnFileEntry> entries;
+  if (ok) {
+    const ColumnFileEntry *first = (const ColumnFileEntry*)((const char*)base + sizeof(ColumnFileHeader));
+    entries.assign(first, first + header->nColumns);
+    for (unsigned int i=0; i<entries.size() && ok; i++) {
+      entries[i].name[sizeof(entries[i].name)-1] = '\0';
+      entries[i].title[sizeof(entries[i].title)-1] = '\0';
+      entries[i].unit[sizeof(entries[i].unit)-1] = '\0';
+      ok = (entries[i].offset % sizeof(Double_t) == 0) && entries[i].offset > 0 &&
+           entries[i].offset + header->nRows*(Long64_t)sizeof(Double_t) <= (Long64_t)st.st_size;
+    }
+  }
+  if (!ok) {
+    std::cout << "openColumnStore:: " << fileName << " is not a valid column file" << std::endl;
+    munmap(base, st.st_size);
+    close(fd);
+    return -2;
+  }
+
+  store.fd = fd;
+  store.base = (char*)base;
+  store.size = st.st_size;
+  store.nRows = header->nRows;
+  store.weightColumn = header->weightColumn;
+  store.entries.swap(entries);
+  return 0;
+}
+
+void closeColumnStore(ColumnStore &store) {
+  if (store.base) munmap(store.base, store.size);
+  if (store.fd >= 0) close(store.fd);
+  store.base = 0; store.fd = -1; store.size = 0; store.nRows = 0;
+  store.entries.clear();
+}
+
+// Empty RooDataSet with the variables and the weight variable of the store,
+// the shape of the sample the makers wrote
+RooDataSet* columnStoreSkeleton(const ColumnStore &store, const char *name) {
+  RooArgSet vars;
+  RooRealVar *weight = 0;
+  for (unsigned int i=0; i<store.entries.size(); i++) {
+    const ColumnFileEntry &entry = store.entries[i];
+    RooRealVar *var = new RooRealVar(entry.name, entry.title, entry.min, entry.max, entry.unit);
+    vars.addOwned(*var);
+    if ((int)i == store.weightColumn) weight = var;
+  }
+  if (weight) return new RooDataSet(name, name, vars, RooFit::WeightVar(*weight));
+  return new RooDataSet(name, name, vars);
+}
+
+// Rows index of the store, added to the empty clone of the skeleton ds, as
+// selectEntries does for a RooDataSet
+RooDataSet* columnStoreRows(const ColumnStore &store, RooDataSet *ds, const std::vector<int> &index) {
+  RooDataSet *sub = (RooDataSet*)ds->emptyClone();
+  const RooArgSet *row = sub->get();
+  std::vector<RooRealVar*> vars;
+  std::vector<const Double_t*> cols;
+  for (unsigned int i=0; i<store.entries.size(); i++) {
+    if ((int)i == store.weightColumn) continue;
+    RooRealVar *var = (RooRealVar*)row->find(store.entries[i].name);
+    if (var == 0) continue;
+    vars.push_back(var);
+    cols.push_back(store.column(i));
+  }
+  const Double_t *weight = (store.weightColumn >= 0) ? store.column(store.weightColumn) : 0;
+  for (unsigned int i=0; i<index.size(); i++) {
+    for (unsigned int j=0; j<vars.size(); j++) vars[j]->setVal(cols[j][index[i]]);
+    sub->add(*row, weight ? weight[index[i]] : 1.0);
+  }
+  return sub;
+}
+
+#endif
@@ -0,0 +1,268 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ * Package: RooFitModels                                                     *
+ *    File: RooCBGaussPdf.cpp                                                *
+ *                                                                           *
+ * Gaussian plus Crystal Ball mass model with analytic gradient              *
+ *****************************************************************************/
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// BEGIN_HTML
+// Class RooCBGaussPdf is the J/psi mass signal shape, a Gaussian and a
+// Crystal Ball (same definition as RooCBShape) of common mean. Both parts are
+// normalized analytically on the range of the observable. The derivatives of
+// the normalized density with respect to all parameters are analytic too and
+// are used by gradient based minimizations of the mass fit.
+// END_HTML
+//
+
+#include "TMath.h"
+#include <algorithm>
+#include <cassert>
+
+#include "RooFit.h"
+#include "Riostream.h"
+#include "RooCBGaussPdf.h"
+#include "RooAbsReal.h"
+#include "RooRealVar.h"
+#include "RooMsgService.h"
+
+ClassImp(RooCBGaussPdf);
+
+using namespace RooFit;
+
+static const Double_t root2(sqrt(2.));
+static const Double_t sqrtPiOver2(sqrt(TMath::Pi()/2.));
+
+//_____________________________________________________________________________
+static Double_t gaussShape(Double_t m, Double_t mean, Double_t sigma, Double_t* d)
+{
+  // exp(-v^2/2), d: derivatives in mean and sigma
+  const Double_t v = (m-mean)/sigma;
+  const Double_t g = exp(-0.5*v*v);
+  if (d) {
+    d[0] = g*v/sigma;
+    d[1] = g*v*v/sigma;
+  }
+  return g;
+}
+
+//_____________________________________________________________________________
+static Double_t gaussIntegral(Double_t lo, Double_t hi, Double_t mean, Double_t sigma, Double_t* d)
+{
+  const Double_t vlo = (lo-mean)/sigma, vhi = (hi-mean)/sigma;
+  const Double_t integral = sigma*sqrtPiOver2*(TMath::Erf(vhi/root2) - TMath::Erf(vlo/root2));
+  if (d) {
+    // Only the limits move in units of sigma
+    const Double_t gLo = exp(-0.5*vlo*vlo), gHi = exp(-0.5*vhi*vhi);
+    d[0] = gLo - gHi;
+    d[1] = integral/sigma - (vhi*gHi - vlo*gLo);
+  }
+  return integral;
+}
+
+//_____________________________________________________________________________
+static Double_t cbShape(Double_t m, Double_t mean, Double_t sigma, Double_t alpha, Double_t n, Double_t* d)
+{
+  // RooCBShape, d: derivatives in mean, sigma, alpha, n
+  const Double_t s = (alpha < 0) ? -1 : 1;
+  const Double_t absAlpha = fabs(alpha);
+  const Double_t t = s*(m-mean)/sigma;
+  Double_t k, dkdt, dkdA(0), dkdn(0);
+  if (t >= -absAlpha) {
+    k = exp(-0.5*t*t);
+    dkdt = -t*k;
+  } else {
+    // a/(b-t)^n with a = (n/|alpha|)^n exp(-alpha^2/2), b = n/|alpha| - |alpha|
+    const Double_t u = n/absAlpha - absAlpha - t;
+    k = exp(n*log(n/absAlpha) - 0.5*absAlpha*absAlpha - n*log(u));
+    dkdt = k*n/u;
+    dkdn = k*(log(n/absAlpha) + 1 - log(u) - n/(absAlpha*u));
+    dkdA = k*(-n/absAlpha - absAlpha + n*(n/(absAlpha*absAlpha) + 1)/u);
+  }
+  if (d) {
+    d[0] = -s*dkdt/sigma;
+    d[1] = -t*dkdt/sigma;
+    d[2] = s*dkdA;
+    d[3] = dkdn;
+  }
+  return k;
+}
+
+//_____________________________________________________________________________
+static Double_t cbIntegral(Double_t lo, Double_t hi, Double_t mean, Double_t sigma, Double_t alpha, Double_t n, Double_t* d)
+{
+  // Integral of cbShape on [lo,hi], d: derivatives in mean, sigma, alpha, n
+  const Double_t s = (alpha < 0) ? -1 : 1;
+  const Double_t absAlpha = fabs(alpha);
+  const Double_t tlo = (s > 0) ? (lo-mean)/sigma : (mean-hi)/sigma;
+  const Double_t thi = (s > 0) ? (hi-mean)/sigma : (mean-lo)/sigma;
+
+  Double_t J(0), dJdA(0), dJdn(0);   // integral in t and its derivatives at fixed t range
+  if (thi > -absAlpha) {
+    const Double_t c0 = std::max(tlo,-absAlpha);
+    J += sqrtPiOver2*(TMath::Erf(thi/root2) - TMath::Erf(c0/root2));
+  }
+  if (tlo < -absAlpha) {
+    // Tail: a*(u1^e - u2^e)/e with u = b-t, e = 1-n. Moving the junction at
+    // t=-|alpha| changes tail and core by opposite amounts, so only a and b
+    // are differentiated.
+    const Double_t t2 = std::min(thi,-absAlpha);
+    const Double_t b = n/absAlpha - absAlpha;
+    const Double_t lnA = n*log(n/absAlpha) - 0.5*absAlpha*absAlpha;
+    const Double_t L1 = log(b-tlo), L2 = log(b-t2);
+    const Double_t e = 1-n;
+    Double_t aD, aDe;   // a*(u1^e-u2^e)/e and its derivative in e
+    if (fabs(e)*std::max(fabs(L1),fabs(L2)) < 0.1) {
+      // Series in e, n=1 (log) included
+      Double_t p1(1), p2(1), fact(1), D(0), De(0);
+      for (Int_t k=1; k<=10; k++) {
+        p1 *= L1;  p2 *= L2;  fact *= k;
+        const Double_t term = (p1-p2)/fact;
+        D += pow(e,k-1)*term;
+        if (k >= 2) De += (k-1)*pow(e,k-2)*term;
+      }
+      aD = exp(lnA)*D;
+      aDe = exp(lnA)*De;
+    } else {
+      const Double_t e1 = exp(lnA + e*L1), e2 = exp(lnA + e*L2);
+      aD = (e1-e2)/e;
+      aDe = ((e1*L1 - e2*L2)*e - (e1-e2))/(e*e);
+    }
+    const Double_t q = exp(lnA - n*L1) - exp(lnA - n*L2);   // a*(u1^-n - u2^-n)
+    J += aD;
+    dJdn = (log(n/absAlpha) + 1)*aD - aDe + q/absAlpha;
+    dJdA = (-n/absAlpha - absAlpha)*aD + q*(-n/(absAlpha*absAlpha) - 1);
+  }
+
+  if (d) {
+    const Double_t kLo = cbShape(lo,mean,sigma,alpha,n,0), kHi = cbShape(hi,mean,sigma,alpha,n,0);
+    const Double_t vlo = (lo-mean)/sigma, vhi = (hi-mean)/sigma;
+    d[0] = kLo - kHi;
+    d[1] = J - (vhi*kHi - vlo*kLo);
+    d[2] = s*sigma*dJdA;
+    d[3] = sigma*dJdn;
+  }
+  return sigma*J;
+}
+
+
+//_____________________________________________________________________________
+RooCBGaussPdf::RooCBGaussPdf(const char *name, const char *title, RooAbsReal& m, RooAbsReal& mean,
+			     RooAbsReal& sigmaG, RooAbsReal& sigmaCB, RooAbsReal& alpha, RooAbsReal& n, RooAbsReal& frac) :
+  RooAbsPdf(name,title),
+  _m("m","Dependent",this,m),
+  _mean("mean","Mean",this,mean),
+  _sigmaG("sigmaG","Gaussian width",this,sigmaG),
+  _sigmaCB("sigmaCB","Crystal Ball width",this,sigmaCB),
+  _alpha("alpha","Crystal Ball tail start",this,alpha),
+  _n("n","Crystal Ball tail power",this,n),
+  _frac("frac","Gaussian fraction",this,frac),
+  _normValid(kFALSE)
+{
+}
+
+
+//_____________________________________________________________________________
+RooCBGaussPdf::RooCBGaussPdf(const RooCBGaussPdf& other, const char* name) :
+  RooAbsPdf(other,name),
+  _m("m",this,other._m),
+  _mean("mean",this,other._mean),
+  _sigmaG("sigmaG",this,other._sigmaG),
+  _sigmaCB("sigmaCB",this,other._sigmaCB),
+  _alpha("alpha",this,other._alpha),
+  _n("n",this,other._n),
+  _frac("frac",this,other._frac),
+  _normValid(kFALSE)
+{
+}
+
+
+//_____________________________________________________________________________
+const RooAbsReal& RooCBGaussPdf::parameter(Int_t i) const
+{
+  switch (i) {
+    case iMean:    return _mean.arg();
+    case iSigmaG:  return _sigmaG.arg();
+    case iSigmaCB: return _sigmaCB.arg();
+    case iAlpha:   return _alpha.arg();
+    case iN:       return _n.arg();
+    default:       return _frac.arg();
+  }
+}
+
+
+//_____________________________________________________________________________
+void RooCBGaussPdf::updateNorm() const
+{
+  const Double_t key[7] = {_mean, _sigmaG, _sigmaCB, _alpha, _n, _m.min(), _m.max()};
+  if (_normValid && std::equal(key, key+7, _normKey)) return;
+
+  Double_t dG[2], dCB[4];
+  _intG = gaussIntegral(key[5], key[6], _mean, _sigmaG, dG);
+  _intCB = cbIntegral(key[5], key[6], _mean, _sigmaCB, _alpha, _n, dCB);
+  std::fill(_dIntG, _dIntG+nPars, 0.);
+  std::fill(_dIntCB, _dIntCB+nPars, 0.);
+  _dIntG[iMean] = dG[0];    _dIntG[iSigmaG] = dG[1];
+  _dIntCB[iMean] = dCB[0];  _dIntCB[iSigmaCB] = dCB[1];
+  _dIntCB[iAlpha] = dCB[2]; _dIntCB[iN] = dCB[3];
+
+  std::copy(key, key+7, _normKey);
+  _normValid = kTRUE;
+}
+
+
+//_____________________________________________________________________________
+Double_t RooCBGaussPdf::evaluate() const
+{
+  updateNorm();
+  const Double_t g = gaussShape(_m, _mean, _sigmaG, 0);
+  const Double_t k = cbShape(_m, _mean, _sigmaCB, _alpha, _n, 0);
+  return _frac*g/_intG + (1-_frac)*k/_intCB;
+}
+
+
+//_____________________________________________________________________________
+Int_t RooCBGaussPdf::getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* /*rangeName*/) const
+{
+  if (matchArgs(allVars,analVars,_m)) return 1;
+  return 0;
+}
+
+
+//_____________________________________________________________________________
+Double_t RooCBGaussPdf::analyticalIntegral(Int_t code, const char* rangeName) const
+{
+  assert(code==1);
+  updateNorm();
+  const Double_t lo = _m.min(rangeName), hi = _m.max(rangeName);
+  return _frac*gaussIntegral(lo,hi,_mean,_sigmaG,0)/_intG + (1-_frac)*cbIntegral(lo,hi,_mean,_sigmaCB,_alpha,_n,0)/_intCB;
+}
+
+
+//_____________________________________________________________________________
+void RooCBGaussPdf::prepareGradient() const
+{
+  for (Int_t i=0; i<nPars; i++) _gradPars[i] = parameter(i).getVal();
+  updateNorm();
+}
+
+
+//_____________________________________________________________________________
+Double_t RooCBGaussPdf::gradient(Double_t mVal, Double_t* grad) const
+{
+  const Double_t c = _gradPars[iFrac];
+  Double_t dg[2], dk[4];
+  const Double_t g = gaussShape(mVal, _gradPars[iMean], _gradPars[iSigmaG], dg);
+  const Double_t k = cbShape(mVal, _gradPars[iMean], _gradPars[iSigmaCB], _gradPars[iAlpha], _gradPars[iN], dk);
+  const Double_t fg = g/_intG, fk = k/_intCB;
+
+  grad[iMean] = c*(dg[0] - fg*_dIntG[iMean])/_intG + (1-c)*(dk[0] - fk*_dIntCB[iMean])/_intCB;
+  grad[iSigmaG] = c*(dg[1] - fg*_dIntG[iSigmaG])/_intG;
+  grad[iSigmaCB] = (1-c)*(dk[1] - fk*_dIntCB[iSigmaCB])/_intCB;
+  grad[iAlpha] = (1-c)*(dk[2] - fk*_dIntCB[iAlpha])/_intCB;
+  grad[iN] = (1-c)*(dk[3] - fk*_dIntCB[iN])/_intCB;
+  grad[iFrac] = fg - fk;
+  return c*fg + (1-c)*fk;
+}
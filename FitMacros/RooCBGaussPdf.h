@@ -0,0 +1,68 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ * Package: RooFitModels                                                     *
+ *    File: RooCBGaussPdf.h                                                  *
+ *                                                                           *
+ * Gaussian plus Crystal Ball mass model with analytic gradient              *
+ *****************************************************************************/
+#ifndef ROO_CBGAUSSPDF
+#define ROO_CBGAUSSPDF
+
+#include "RooAbsPdf.h"
+#include "RooRealProxy.h"
+
+class RooCBGaussPdf : public RooAbsPdf {
+public:
+
+  // frac*Gauss(mean,sigmaG) + (1-frac)*CB(mean,sigmaCB,alpha,n), each part
+  // normalized on the range of m, i.e. SUM::(frac*Gaussian,CBShape) in one
+  // object. Normalization and derivatives are analytic.
+  enum { iMean=0, iSigmaG, iSigmaCB, iAlpha, iN, iFrac, nPars };
+
+  RooCBGaussPdf() : _normValid(kFALSE) { }
+  RooCBGaussPdf(const char *name, const char *title, RooAbsReal& m, RooAbsReal& mean,
+		RooAbsReal& sigmaG, RooAbsReal& sigmaCB, RooAbsReal& alpha, RooAbsReal& n, RooAbsReal& frac);
+
+  RooCBGaussPdf(const RooCBGaussPdf& other, const char* name=0);
+  virtual TObject* clone(const char* newname) const { return new RooCBGaussPdf(*this,newname) ; }
+  inline virtual ~RooCBGaussPdf() {}
+
+  virtual Int_t getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* rangeName=0) const ;
+  virtual Double_t analyticalIntegral(Int_t code, const char* rangeName) const ;
+
+  // Parameter i of the enum above and the observable
+  const RooAbsReal& parameter(Int_t i) const ;
+  const RooAbsReal& observable() const { return _m.arg(); }
+
+  // Normalized density at mVal and its derivatives with respect to the
+  // parameters (grad[nPars]), for the parameter values read by the last
+  // prepareGradient() call
+  void prepareGradient() const ;
+  Double_t gradient(Double_t mVal, Double_t* grad) const ;
+
+protected:
+
+  virtual Double_t evaluate() const ;
+  void updateNorm() const ;
+
+  RooRealProxy _m ;
+  RooRealProxy _mean ;
+  RooRealProxy _sigmaG ;
+  RooRealProxy _sigmaCB ;
+  RooRealProxy _alpha ;
+  RooRealProxy _n ;
+  RooRealProxy _frac ;
+
+  // Integrals on the range of m and their derivatives, keyed on the values
+  // they were computed with
+  mutable Bool_t _normValid;         //!
+  mutable Double_t _normKey[7];      //! mean, sigmaG, sigmaCB, alpha, n, mmin, mmax
+  mutable Double_t _intG, _intCB;    //!
+  mutable Double_t _dIntG[nPars];    //!
+  mutable Double_t _dIntCB[nPars];   //!
+  mutable Double_t _gradPars[nPars]; //! parameter values of prepareGradient()
+
+  ClassDef(RooCBGaussPdf,1) // Gaussian plus Crystal Ball with analytic gradient
+};
+
+#endif
@@ -0,0 +1,320 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ * Package: RooFitModels                                                     *
+ *    File: RooFFTKeysPdf.cpp                                                *
+ *                                                                           *
+ * Adaptive kernel estimate of RooKeysPdf, computed on a grid with FFTs      *
+ *****************************************************************************/
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// BEGIN_HTML
+// Class RooFFTKeysPdf is a binned version of RooKeysPdf. Each event adds a
+// Gaussian of width w_i = max(hmin, norm/sqrt(g(x_i))), g being a pilot
+// estimate of fixed width h*sigma, and is optionally mirrored (+) or
+// anti-mirrored (-) at the edges of the range. Events are assigned to the two
+// nearest grid nodes, nodes are grouped by kernel width on a geometric ladder
+// and every group is convolved with its Gaussian by FFT, so that the cost is
+// O(nEvents + nGroups*nGrid*log(nGrid)) instead of O(nEvents*nGrid).
+// END_HTML
+//
+
+#include "TMath.h"
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+#include "RooFit.h"
+#include "Riostream.h"
+#include "RooFFTKeysPdf.h"
+#include "RooAbsReal.h"
+#include "RooRealVar.h"
+#include "RooDataSet.h"
+#include "RooMsgService.h"
+
+ClassImp(RooFFTKeysPdf);
+
+using namespace RooFit;
+
+static const Double_t widthRatio(1.05);  // ratio of neighbouring widths of the ladder
+static const Int_t maxCells(16384);
+
+//_____________________________________________________________________________
+static void fftRadix2(std::vector<Double_t>& re, std::vector<Double_t>& im, Bool_t inverse)
+{
+  // In place complex FFT, size a power of 2. The inverse is not divided by the size.
+  const unsigned int n = re.size();
+  for (unsigned int i=1, j=0; i<n; i++) {
+    unsigned int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) { std::swap(re[i],re[j]); std::swap(im[i],im[j]); }
+  }
+  for (unsigned int len=2; len<=n; len<<=1) {
+    const Double_t ang = (inverse ? 2 : -2)*TMath::Pi()/len;
+    const unsigned int half = len/2;
+    for (unsigned int k=0; k<half; k++) {
+      const Double_t wRe = cos(ang*k), wIm = sin(ang*k);
+      for (unsigned int i=k; i<n; i+=len) {
+        const unsigned int j = i+half;
+        const Double_t tRe = re[j]*wRe - im[j]*wIm;
+        const Double_t tIm = re[j]*wIm + im[j]*wRe;
+        re[j] = re[i] - tRe;  im[j] = im[i] - tIm;
+        re[i] += tRe;         im[i] += tIm;
+      }
+    }
+  }
+}
+
+//_____________________________________________________________________________
+static void addConvolution(const std::vector<Double_t>& mass, Double_t width, Double_t step, Int_t maxOffset,
+                           std::vector<Double_t>& accRe, std::vector<Double_t>& accIm)
+{
+  // Adds FFT(mass)*FFT(kernel) to acc, kernel[d] = exp(-0.5*(d*step/width)^2)/width
+  // for |d|<=maxOffset. Both real arrays go through one complex FFT as re and im.
+  const unsigned int n = accRe.size();
+  std::vector<Double_t> re(mass), im(n, 0.);
+  re.resize(n, 0.);
+  const Double_t c = step/width;
+  for (Int_t d=0; d<=maxOffset; d++) {
+    const Double_t k = exp(-0.5*c*c*d*d)/width;
+    if (k == 0) break;
+    im[d] = k;
+    if (d > 0) im[n-d] = k;
+  }
+  fftRadix2(re, im, kFALSE);
+  for (unsigned int f=0; f<n; f++) {
+    const unsigned int g = (n-f) & (n-1);
+    // Split into the transforms of the two real arrays, then multiply
+    const Double_t mRe = 0.5*(re[f] + re[g]), mIm = 0.5*(im[f] - im[g]);
+    const Double_t kRe = 0.5*(im[f] + im[g]), kIm = -0.5*(re[f] - re[g]);
+    accRe[f] += mRe*kRe - mIm*kIm;
+    accIm[f] += mRe*kIm + mIm*kRe;
+  }
+}
+
+//_____________________________________________________________________________
+static void fillKeysTable(const std::vector<Double_t>& xs, const std::vector<Double_t>& ws,
+                          Double_t lo, Double_t hi, Double_t rho, Int_t nCells,
+                          Int_t signLeft, Int_t signRight, std::vector<Double_t>& table)
+{
+  // Density at the nCells+1 nodes of [lo,hi] from events xs (inside [lo,hi]) with
+  // weights ws. signLeft/Right: +1 mirror, -1 anti-mirror, 0 none at that edge.
+  const Int_t nEvents = xs.size();
+  Double_t x0(0), x1(0), x2(0);
+  for (Int_t i=0; i<nEvents; i++) {
+    x0 += ws[i]; x1 += ws[i]*xs[i]; x2 += ws[i]*xs[i]*xs[i];
+  }
+  const Double_t meanv = x1/x0;
+  const Double_t sigmav = sqrt(std::max(0., x2/x0-meanv*meanv));
+  const Double_t h = pow(4./3.,0.2)*pow(Double_t(nEvents),-0.2)*rho;
+  const Double_t hmin = h*sigmav*sqrt(2.)/10;
+  const Double_t norm = h*sqrt(sigmav)/(2.0*sqrt(3.0));
+  const Double_t step = (hi-lo)/nCells;
+
+  // Grid of 3*nCells cells on [2lo-hi, 2hi-lo], holds the mirrored events too.
+  // Offsets between any two nodes are <= maxOffset, FFT size is >= 2*maxOffset+1
+  // so the circular convolution does not wrap.
+  const Int_t iLo = nCells, iHi = 2*nCells, nGrid = 3*nCells+1, maxOffset = nGrid-1;
+  unsigned int nFFT = 1;
+  while (nFFT < (unsigned int)(2*maxOffset+1)) nFFT <<= 1;
+
+  // Linear binning: event mass goes to the two nearest nodes, which keeps its mean
+  std::vector<Double_t> mass(nGrid, 0.);
+  for (Int_t i=0; i<nEvents; i++) {
+    const Double_t u = (xs[i]-lo)/step;
+    Int_t k = (Int_t)u;
+    if (k >= nCells) k = nCells-1;
+    const Double_t f = u-k;
+    mass[iLo+k] += ws[i]*(1-f);
+    mass[iLo+k+1] += ws[i]*f;
+  }
+
+  // Pilot density g at the nodes, fixed width h*sigma, mirrored events not included
+  std::vector<Double_t> accRe(nFFT, 0.), accIm(nFFT, 0.);
+  addConvolution(mass, h*sigmav, step, maxOffset, accRe, accIm);
+  fftRadix2(accRe, accIm, kTRUE);
+  static const Double_t sqrt2pi(sqrt(2*TMath::Pi()));
+
+  // Adaptive width per node. Linear binning spreads an event over the two nodes,
+  // on average by step^2/6 in variance, which is taken off the kernel variance.
+  const Double_t binVar = step*step/6.;
+  std::vector<Double_t> width2(nGrid, 0.);
+  Double_t wMin(-1), wMax(-1);
+  for (Int_t k=iLo; k<=iHi; k++) {
+    if (mass[k] == 0) continue;
+    const Double_t g = std::max(accRe[k]/nFFT, 0.)/(sqrt2pi*x0);
+    Double_t w = (g > 0) ? norm/sqrt(g) : hmin;
+    if (w < hmin) w = hmin;
+    width2[k] = std::max(w*w - binVar, 0.25*w*w);
+    const Double_t we = sqrt(width2[k]);
+    if (wMin < 0 || we < wMin) wMin = we;
+    if (we > wMax) wMax = we;
+  }
+  if (wMin < 0) { table.assign(nCells+1, 0.); return; }
+
+  // Geometric ladder of widths. A node between two rungs is split among them so
+  // that the variance of its kernel is kept.
+  const Int_t nRungs = (wMax > wMin*1.000001) ? (Int_t)ceil(log(wMax/wMin)/log(widthRatio))+1 : 1;
+  const Double_t ratio = (nRungs > 1) ? pow(wMax/wMin, 1./(nRungs-1)) : 1;
+  std::vector< std::vector<Double_t> > rungMass(nRungs);
+  std::vector<Double_t> rungWidth(nRungs);
+  for (Int_t r=0; r<nRungs; r++) rungWidth[r] = wMin*pow(ratio,r);
+
+  for (Int_t k=iLo; k<=iHi; k++) {
+    if (mass[k] == 0) continue;
+    Int_t r = 0;
+    Double_t alpha = 1;
+    if (nRungs > 1) {
+      r = (Int_t)(log(sqrt(width2[k])/wMin)/log(ratio));
+      r = std::max(0, std::min(r, nRungs-2));
+      const Double_t a2 = rungWidth[r]*rungWidth[r], b2 = rungWidth[r+1]*rungWidth[r+1];
+      alpha = std::max(0., std::min(1., (b2 - width2[k])/(b2 - a2)));
+    }
+    for (Int_t side=0; side<2; side++) {
+      const Int_t rr = r + side;
+      const Double_t m = mass[k]*(side == 0 ? alpha : 1-alpha);
+      if (m == 0) continue;
+      std::vector<Double_t>& dest = rungMass[rr];
+      if (dest.empty()) dest.assign(nGrid, 0.);
+      dest[k] += m;
+      if (signLeft) dest[2*iLo-k] += signLeft*m;
+      if (signRight) dest[2*iHi-k] += signRight*m;
+    }
+  }
+
+  std::fill(accRe.begin(), accRe.end(), 0.);
+  std::fill(accIm.begin(), accIm.end(), 0.);
+  for (Int_t r=0; r<nRungs; r++) {
+    if (rungMass[r].empty()) continue;
+    addConvolution(rungMass[r], rungWidth[r], step, maxOffset, accRe, accIm);
+  }
+  fftRadix2(accRe, accIm, kTRUE);
+
+  table.resize(nCells+1);
+  for (Int_t i=0; i<=nCells; i++) {
+    table[i] = std::max(accRe[iLo+i]/nFFT/(sqrt2pi*x0), 0.);
+  }
+}
+
+
+//_____________________________________________________________________________
+RooFFTKeysPdf::RooFFTKeysPdf(const char *name, const char *title, RooAbsReal& x, RooDataSet& data,
+			     RooKeysPdf::Mirror mirror, Double_t rho, Int_t nCells) :
+  RooAbsPdf(name,title),
+  _x("x","Dependent",this,x),
+  _nCells(nCells),
+  _rho(rho),
+  _mirrorLeft(mirror==RooKeysPdf::MirrorLeft || mirror==RooKeysPdf::MirrorBoth || mirror==RooKeysPdf::MirrorLeftAsymRight),
+  _mirrorRight(mirror==RooKeysPdf::MirrorRight || mirror==RooKeysPdf::MirrorBoth || mirror==RooKeysPdf::MirrorAsymLeftRight),
+  _asymLeft(mirror==RooKeysPdf::MirrorAsymLeft || mirror==RooKeysPdf::MirrorAsymLeftRight || mirror==RooKeysPdf::MirrorAsymBoth),
+  _asymRight(mirror==RooKeysPdf::MirrorAsymRight || mirror==RooKeysPdf::MirrorLeftAsymRight || mirror==RooKeysPdf::MirrorAsymBoth)
+{
+  RooRealVar &real = (RooRealVar&)x;
+  _lo = real.getMin();
+  _hi = real.getMax();
+  LoadDataSet(data);
+}
+
+
+//_____________________________________________________________________________
+RooFFTKeysPdf::RooFFTKeysPdf(const RooFFTKeysPdf& other, const char* name) :
+  RooAbsPdf(other,name),
+  _x("x",this,other._x),
+  _lo(other._lo), _hi(other._hi), _step(other._step), _nCells(other._nCells), _rho(other._rho),
+  _mirrorLeft(other._mirrorLeft), _mirrorRight(other._mirrorRight),
+  _asymLeft(other._asymLeft), _asymRight(other._asymRight),
+  _table(other._table), _cdf(other._cdf)
+{
+}
+
+
+//_____________________________________________________________________________
+void RooFFTKeysPdf::LoadDataSet(RooDataSet& data)
+{
+  RooRealVar *real = (RooRealVar*)data.get()->find(_x.arg().GetName());
+  if (!real) {
+    coutE(InputArguments) << "RooFFTKeysPdf::LoadDataSet(" << GetName() << ") ERROR: " << _x.arg().GetName()
+                          << " is not an observable of " << data.GetName() << endl;
+    assert(0);
+  }
+
+  // Events outside of the range of x can not be tabulated and are skipped
+  std::vector<Double_t> xs, ws;
+  xs.reserve(data.numEntries());
+  ws.reserve(data.numEntries());
+  for (Int_t i=0; i<data.numEntries(); i++) {
+    data.get(i);
+    const Double_t xVal = real->getVal();
+    if (xVal < _lo || xVal > _hi || data.weight() == 0) continue;
+    xs.push_back(xVal);
+    ws.push_back(data.weight());
+  }
+  if (xs.size() < 2) {
+    coutE(InputArguments) << "RooFFTKeysPdf::LoadDataSet(" << GetName() << ") ERROR: less than 2 events in range" << endl;
+    assert(0);
+  }
+
+  if (_nCells <= 0) {
+    // Narrowest kernel covers >= 4 cells, with at least the 1000 points of RooKeysPdf
+    Double_t x0(0), x1(0), x2(0);
+    for (unsigned int i=0; i<xs.size(); i++) { x0 += ws[i]; x1 += ws[i]*xs[i]; x2 += ws[i]*xs[i]*xs[i]; }
+    const Double_t sigmav = sqrt(std::max(0., x2/x0 - (x1/x0)*(x1/x0)));
+    const Double_t hmin = pow(4./3.,0.2)*pow(Double_t(xs.size()),-0.2)*_rho*sigmav*sqrt(2.)/10;
+    _nCells = (hmin > 0) ? (Int_t)ceil(4*(_hi-_lo)/hmin) : maxCells;
+    _nCells = std::max(1000, std::min(_nCells, maxCells));
+  }
+  _step = (_hi-_lo)/_nCells;
+
+  const Int_t signLeft = _mirrorLeft ? 1 : (_asymLeft ? -1 : 0);
+  const Int_t signRight = _mirrorRight ? 1 : (_asymRight ? -1 : 0);
+  fillKeysTable(xs, ws, _lo, _hi, _rho, _nCells, signLeft, signRight, _table);
+
+  // Integral of the linear interpolation, for the analytical integral
+  _cdf.resize(_nCells+1);
+  _cdf[0] = 0;
+  for (Int_t i=0; i<_nCells; i++) _cdf[i+1] = _cdf[i] + 0.5*_step*(_table[i]+_table[i+1]);
+}
+
+
+//_____________________________________________________________________________
+Double_t RooFFTKeysPdf::evaluate() const
+{
+  const Double_t xVal = _x;
+  if (xVal < _lo || xVal > _hi || _table.empty()) return 0;
+  const Double_t u = (xVal-_lo)/_step;
+  Int_t i = (Int_t)u;
+  if (i >= _nCells) i = _nCells-1;
+  const Double_t dx = u-i;
+  return _table[i] + dx*(_table[i+1]-_table[i]);
+}
+
+
+//_____________________________________________________________________________
+Double_t RooFFTKeysPdf::cdf(Double_t xVal) const
+{
+  if (xVal <= _lo) return 0;
+  if (xVal >= _hi) return _cdf[_nCells];
+  const Double_t u = (xVal-_lo)/_step;
+  Int_t i = (Int_t)u;
+  if (i >= _nCells) i = _nCells-1;
+  const Double_t dx = u-i;
+  return _cdf[i] + _step*dx*(_table[i] + 0.5*dx*(_table[i+1]-_table[i]));
+}
+
+
+//_____________________________________________________________________________
+Int_t RooFFTKeysPdf::getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* /*rangeName*/) const
+{
+  if (matchArgs(allVars,analVars,_x)) return 1;
+  return 0;
+}
+
+
+//_____________________________________________________________________________
+Double_t RooFFTKeysPdf::analyticalIntegral(Int_t code, const char* rangeName) const
+{
+  assert(code==1);
+  if (_table.empty()) return 0;
+  return cdf(_x.max(rangeName)) - cdf(_x.min(rangeName));
+}
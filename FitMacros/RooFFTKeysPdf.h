@@ -0,0 +1,63 @@
+/*****************************************************************************
+ * Project: RooFit                                                           *
+ * Package: RooFitModels                                                     *
+ *    File: RooFFTKeysPdf.h                                                  *
+ *                                                                           *
+ * Adaptive kernel estimate of RooKeysPdf, computed on a grid with FFTs      *
+ *****************************************************************************/
+#ifndef ROO_FFTKEYSPDF
+#define ROO_FFTKEYSPDF
+
+#include <vector>
+
+#include "RooAbsPdf.h"
+#include "RooRealProxy.h"
+#include "RooKeysPdf.h"
+
+class RooDataSet;
+
+class RooFFTKeysPdf : public RooAbsPdf {
+public:
+
+  // Same estimate as RooKeysPdf (adaptive widths from a fixed-width pilot,
+  // boundary mirroring) but the data are binned on a grid of nCells cells over
+  // the range of x and the kernels are summed by FFT convolution, one per
+  // group of similar widths. nCells<=0: chosen from the narrowest kernel.
+  // Tabulated values agree with the unbinned adaptive sum to ~2e-4 of the
+  // maximum, evaluate() interpolates linearly between them.
+  RooFFTKeysPdf() : _lo(0), _hi(0), _step(0), _nCells(0), _rho(1), _mirrorLeft(kFALSE), _mirrorRight(kFALSE), _asymLeft(kFALSE), _asymRight(kFALSE) { }
+  RooFFTKeysPdf(const char *name, const char *title, RooAbsReal& x, RooDataSet& data,
+		RooKeysPdf::Mirror mirror=RooKeysPdf::NoMirror, Double_t rho=1, Int_t nCells=0);
+
+  RooFFTKeysPdf(const RooFFTKeysPdf& other, const char* name=0);
+  virtual TObject* clone(const char* newname) const { return new RooFFTKeysPdf(*this,newname) ; }
+  inline virtual ~RooFFTKeysPdf() {}
+
+  virtual Int_t getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* rangeName=0) const ;
+  virtual Double_t analyticalIntegral(Int_t code, const char* rangeName) const ;
+
+  void LoadDataSet(RooDataSet& data);
+
+  Int_t nCells() const { return _nCells; }
+
+protected:
+
+  virtual Double_t evaluate() const ;
+  Double_t cdf(Double_t xVal) const;
+
+  RooRealProxy _x ;
+
+  Double_t _lo, _hi;                 // range of x covered by the table
+  Double_t _step;                    // grid step, (_hi-_lo)/_nCells
+  Int_t _nCells;
+  Double_t _rho;                     // bandwidth scale factor, as in RooKeysPdf
+  Bool_t _mirrorLeft, _mirrorRight;
+  Bool_t _asymLeft, _asymRight;
+
+  std::vector<Double_t> _table;      // density at the _nCells+1 grid nodes
+  std::vector<Double_t> _cdf;        // integral of the interpolated density up to each node
+
+  ClassDef(RooFFTKeysPdf,1) // Adaptive kernel estimation pdf, binned and FFT convolved
+};
+
+#endif
@@ -25,6 +25,8 @@
 
 #include "TMath.h"
 #include <vector>
+#include <algorithm>
+#include <cassert>
 
 #include "RooFit.h"
 #include "Riostream.h"
@@ -33,17 +35,31 @@
 #include "RooRandom.h"
 #include "RooAbsReal.h"
 #include "RooRealVar.h"
+#include "RooAbsData.h"
+#include "RooMsgService.h"
+#include "TVirtualMutex.h"
 
-//ClassImp(RooHistPdfConv);
+ClassImp(RooHistPdfConv);
 
 using namespace RooFit;
 
 static const Double_t root2(sqrt(2.));
 static const Double_t pi2(sqrt(acos(-1.)));
-static unsigned int nbins;
-static std::vector<Double_t> halfBinWidths;
-static std::vector<Double_t> weights;
-static std::vector<Double_t> centers;
+
+//_____________________________________________________________________________
+static inline Double_t convolveBins(unsigned int nbins, const Double_t* lo, const Double_t* hi,
+                                    const Double_t* w, Double_t shift, Double_t invWidth)
+{
+  // Sum of weight*(erfc(c)-erfc(d)) over the bin table. Loop invariants are
+  // passed in so that the body only touches contiguous arrays.
+  Double_t sum(0);
+  for (unsigned int i=0; i<nbins; i++) {
+    const Double_t c = (lo[i] - shift)*invWidth;
+    const Double_t d = (hi[i] - shift)*invWidth;
+    sum += w[i]*(TMath::Erfc(c) - TMath::Erfc(d));
+  }
+  return sum;
+}
 
 //_____________________________________________________________________________
 RooHistPdfConv::RooHistPdfConv(const char *name, const char *title, RooAbsReal& _xIn, 
@@ -54,11 +70,20 @@ RooHistPdfConv::RooHistPdfConv(const char *name, const char *title, RooAbsReal&
   mean("mean","Mean",this,_mean),
   sigma("sigma","Width",this,_sigma),
   msf("msf","Mean Scale Factor",this,(RooAbsReal&)RooRealConstant::value(1)),
-  ssf("ssf","Sigma Scale Factor",this,(RooAbsReal&)RooRealConstant::value(1))
+  ssf("ssf","Sigma Scale Factor",this,(RooAbsReal&)RooRealConstant::value(1)),
+  _sigmaList("sigmaList","Widths of the other components",this),
+  _fracList("fracList","Fractions of the components",this)
 {  
-  _histpdf = new RooDataHist(datahist);
   _variableName = "Jpsi_CtTrue";
-  init();
+  _normValid = kFALSE;
+  _erfcRange = 0;
+  _erfcInvStep = 0;
+  _erfcValidate = kFALSE;
+  _erfcMaxRelErr = 0;
+  _nSigmaCut = 9.;
+  _gridNU = 0;
+  _gridNS = 0;
+  init(datahist);
 }
 
 
@@ -72,11 +97,20 @@ RooHistPdfConv::RooHistPdfConv(const char *name, const char *title, RooAbsReal&
   mean("mean","Mean",this,_mean),
   sigma("sigma","Width",this,_sigma),
   msf("msf","Mean Scale Factor",this,_msSF),
-  ssf("ssf","Sigma Scale Factor",this,_msSF)
+  ssf("ssf","Sigma Scale Factor",this,_msSF),
+  _sigmaList("sigmaList","Widths of the other components",this),
+  _fracList("fracList","Fractions of the components",this)
 {
-  _histpdf = new RooDataHist(datahist);
   _variableName = "Jpsi_CtTrue";
-  init();
+  _normValid = kFALSE;
+  _erfcRange = 0;
+  _erfcInvStep = 0;
+  _erfcValidate = kFALSE;
+  _erfcMaxRelErr = 0;
+  _nSigmaCut = 9.;
+  _gridNU = 0;
+  _gridNS = 0;
+  init(datahist);
 }
 
 
@@ -91,14 +125,75 @@ RooHistPdfConv::RooHistPdfConv(const char *name, const char *title, RooAbsReal&
   mean("mean","Mean",this,_mean),
   sigma("sigma","Width",this,_sigma),
   msf("msf","Mean Scale Factor",this,_meanSF),
-  ssf("ssf","Sigma Scale Factor",this,_sigmaSF)
+  ssf("ssf","Sigma Scale Factor",this,_sigmaSF),
+  _sigmaList("sigmaList","Widths of the other components",this),
+  _fracList("fracList","Fractions of the components",this)
+{   
+  _variableName = "Jpsi_CtTrue";
+  _normValid = kFALSE;
+  _erfcRange = 0;
+  _erfcInvStep = 0;
+  _erfcValidate = kFALSE;
+  _erfcMaxRelErr = 0;
+  _nSigmaCut = 9.;
+  _gridNU = 0;
+  _gridNS = 0;
+  init(datahist);
+}   
+
+
+//_____________________________________________________________________________
+RooHistPdfConv::RooHistPdfConv(const char *name, const char *title, RooAbsReal& _xIn, 
+			     RooAbsReal& _mean, const RooArgList& sigmas, const RooArgList& fracs,
+                             RooDataHist& datahist ) : 
+  RooAbsPdf(name,title), 
+  xIn(_xIn.GetName(),_xIn.GetTitle(),this,_xIn),
+  mean("mean","Mean",this,_mean),
+  sigma("sigma","Width",this,firstWidth(name,sigmas,fracs)),
+  msf("msf","Mean Scale Factor",this,(RooAbsReal&)RooRealConstant::value(1)),
+  ssf("ssf","Sigma Scale Factor",this,(RooAbsReal&)RooRealConstant::value(1)),
+  _sigmaList("sigmaList","Widths of the other components",this),
+  _fracList("fracList","Fractions of the components",this)
 {   
-  _histpdf = new RooDataHist(datahist); 
+  // With invalid lists firstWidth() has reported it, a single unit width is left
+  if (validComponents(sigmas,fracs)) {
+    for (Int_t k=1; k<sigmas.getSize(); k++) _sigmaList.add(*sigmas.at(k));
+    _fracList.add(fracs);
+  }
+
   _variableName = "Jpsi_CtTrue";
-  init();
+  _normValid = kFALSE;
+  _erfcRange = 0;
+  _erfcInvStep = 0;
+  _erfcValidate = kFALSE;
+  _erfcMaxRelErr = 0;
+  _nSigmaCut = 9.;
+  _gridNU = 0;
+  _gridNS = 0;
+  init(datahist);
 }   
 
 
+//_____________________________________________________________________________
+Bool_t RooHistPdfConv::validComponents(const RooArgList& sigmas, const RooArgList& fracs)
+{
+  return sigmas.getSize() >= 1 && sigmas.getSize() <= maxComponents && fracs.getSize() == sigmas.getSize()-1;
+}
+
+
+//_____________________________________________________________________________
+RooAbsReal& RooHistPdfConv::firstWidth(const char* name, const RooArgList& sigmas, const RooArgList& fracs)
+{
+  // Width of the first component, checked before the sigma proxy is made from it
+  if (validComponents(sigmas,fracs)) return *(RooAbsReal*)sigmas.at(0);
+
+  oocoutE((TObject*)0,InputArguments) << "RooHistPdfConv::ctor(" << name << ") ERROR: need 1 to " << maxComponents
+                                      << " widths and one fraction less than widths" << endl;
+  assert(0);
+  return (RooAbsReal&)RooRealConstant::value(1);
+}
+
+
 //_____________________________________________________________________________
 RooHistPdfConv::RooHistPdfConv(const RooHistPdfConv& other, const char* name) : 
   RooAbsPdf(other,name),
@@ -106,44 +201,331 @@ RooHistPdfConv::RooHistPdfConv(const RooHistPdfConv& other, const char* name) :
   mean("mean",this,other.mean),
   sigma("sigma",this,other.sigma),
   msf("msf",this,other.msf),
-  ssf("ssf",this,other.ssf)
+  ssf("ssf",this,other.ssf),
+  _sigmaList("sigmaList",this,other._sigmaList),
+  _fracList("fracList",this,other._fracList)
 {
-  _histpdf = other._histpdf;
   _variableName = other._variableName;
-  init();
+  _binLow = other._binLow;
+  _binHigh = other._binHigh;
+  _binWeight = other._binWeight;
+  _binCdf = other._binCdf;
+  _erfcRange = other._erfcRange;
+  _erfcInvStep = other._erfcInvStep;
+  _erfcVal = other._erfcVal;
+  _erfcDer = other._erfcDer;
+  _erfcValidate = other._erfcValidate;
+  _erfcMaxRelErr = 0;
+  _nSigmaCut = other._nSigmaCut;
+  _gridNU = other._gridNU;
+  _gridNS = other._gridNS;
+  _gridUMin = other._gridUMin;
+  _gridUMax = other._gridUMax;
+  _gridSMin = other._gridSMin;
+  _gridSMax = other._gridSMax;
+  _grid = other._grid;
+  _normValid = kFALSE;
 }
 
 //_____________________________________________________________________________
-void RooHistPdfConv::init() const 
+void RooHistPdfConv::init(RooDataHist& histpdf)
 { 
+  // The template is only read here: the bin table below is all that is kept
+  // (and persisted), the RooDataHist itself is not stored
   const RooArgSet* aRow;
   RooRealVar* xprime;
  
   // *** Build vectors for speed reasons ***
-  nbins = _histpdf->numEntries();
-
-  for (Int_t i=0; i<_histpdf->numEntries(); i++) {
+  // Only living, non-empty bins are kept, ordered by position so that
+  // convolve() can restrict itself to the bins around xIn
+  const Int_t nbins = histpdf.numEntries();
+  std::vector<std::pair<Double_t, std::pair<Double_t,Double_t> > > bins;
+  bins.reserve(nbins);
+
+  const Double_t sumW = histpdf.sum(false);
+  for (Int_t i=0; i<nbins; i++) {
     
-    aRow = _histpdf->get(i);
+    aRow = histpdf.get(i);
     xprime = (RooRealVar*)aRow->find(_variableName.c_str());
   
+    // remove non-living components
+    if ( xprime->getBinning().binLow(i)*xprime->getBinning().binHigh(i) < 0) continue;
+
     const Double_t halfBinSize = xprime->getBinning().binWidth(i)/2.0;
+    const Double_t center = xprime->getVal();
+    const Double_t weight = (histpdf.weight(*aRow,0,false)/sumW)*((xprime->getBinning().highBound() - xprime->getBinning().lowBound())/halfBinSize);
+    if (weight == 0) continue;
 
-    halfBinWidths.push_back(halfBinSize);
+    bins.push_back(std::make_pair(center - halfBinSize, std::make_pair(center + halfBinSize, weight)));
+  }
+  std::sort(bins.begin(), bins.end());
+
+  _binLow.resize(bins.size());
+  _binHigh.resize(bins.size());
+  _binWeight.resize(bins.size());
+  for (unsigned int i=0; i<bins.size(); i++) {
+    _binLow[i] = bins[i].first;
+    _binHigh[i] = bins[i].second.first;
+    _binWeight[i] = bins[i].second.second;
+  }
+
+  // Cumulative bin content, used by generateEvent()
+  _binCdf.resize(bins.size());
+  Double_t cumul(0);
+  for (unsigned int i=0; i<bins.size(); i++) {
+    cumul += _binWeight[i]*(_binHigh[i] - _binLow[i]);
+    _binCdf[i] = cumul;
+  }
+  
+  return;
 
-    centers.push_back(xprime->getVal());
+}
 
-    // remove non-living components
-    if ( xprime->getBinning().binLow(i)*xprime->getBinning().binHigh(i) < 0) {
-      weights.push_back(0.);
+//_____________________________________________________________________________
+void RooHistPdfConv::setErfcTable(Double_t step, Double_t range)
+{
+  // Tabulate erfc and its derivative on [-range,range] with the given step.
+  // Cubic Hermite interpolation between nodes has an absolute error below
+  // 1.2e-2*step^4, i.e. 1e-10 for step=0.01. step<=0 goes back to TMath::Erfc.
+  _erfcVal.clear();
+  _erfcDer.clear();
+  _erfcRange = 0;
+  _erfcInvStep = 0;
+  _normValid = kFALSE;
+
+  if (step > 0 && range > 0) {
+    const unsigned int nNodes = (unsigned int)ceil(2*range/step) + 1;
+    _erfcRange = range;
+    _erfcInvStep = (nNodes-1)/(2*range);
+    _erfcVal.resize(nNodes);
+    _erfcDer.resize(nNodes);
+    for (unsigned int k=0; k<nNodes; k++) {
+      const Double_t x = -range + k/_erfcInvStep;
+      _erfcVal[k] = TMath::Erfc(x);
+      _erfcDer[k] = -2.*exp(-x*x)/pi2;
+    }
+  }
+
+  // The grid was filled with the previous erfc
+  if (_gridNU > 0) setGridMode(_gridNU, _gridNS, _gridSMin, _gridSMax, _gridUMin, _gridUMax);
+}
+
+//_____________________________________________________________________________
+void RooHistPdfConv::setCutOff(Double_t nSigma)
+{
+  _nSigmaCut = nSigma;
+  // The grid was filled with the previous window
+  if (_gridNU > 0) setGridMode(_gridNU, _gridNS, _gridSMin, _gridSMax, _gridUMin, _gridUMax);
+}
+
+//_____________________________________________________________________________
+Double_t RooHistPdfConv::tabErfc(Double_t x) const
+{
+  if (x <= -_erfcRange) return 2.;
+  if (x >= _erfcRange) return 0.;
+
+  const Double_t u = (x + _erfcRange)*_erfcInvStep;
+  unsigned int k = (unsigned int)u;
+  if (k > _erfcVal.size()-2) k = _erfcVal.size()-2;
+  const Double_t t = u - k;
+  const Double_t t2 = t*t;
+  const Double_t t3 = t2*t;
+  const Double_t h = 1./_erfcInvStep;
+
+  return (2*t3 - 3*t2 + 1)*_erfcVal[k] + (t3 - 2*t2 + t)*h*_erfcDer[k]
+       + (3*t2 - 2*t3)*_erfcVal[k+1] + (t3 - t2)*h*_erfcDer[k+1];
+}
+
+//_____________________________________________________________________________
+Double_t RooHistPdfConv::erfcFn(Double_t x) const
+{
+  return _erfcVal.empty() ? TMath::Erfc(x) : tabErfc(x);
+}
+
+//_____________________________________________________________________________
+Double_t RooHistPdfConv::convolve(Double_t shift, Double_t invWidth) const
+{
+  // Bins further than _nSigmaCut resolution widths from the shift have
+  // erfc(c)-erfc(d) saturated to 0 (both 0 or both 2): only the window of
+  // bins in between is summed, found by binary search on the bin edges
+  unsigned int first(0), last(_binWeight.size());
+  if (_nSigmaCut > 0) {
+    const Double_t reach = _nSigmaCut/(root2*fabs(invWidth));
+    first = std::lower_bound(_binHigh.begin(), _binHigh.end(), shift - reach) - _binHigh.begin();
+    last = std::upper_bound(_binLow.begin(), _binLow.end(), shift + reach) - _binLow.begin();
+    if (first >= last) return 0;
+  }
+
+  const unsigned int nbins = last - first;
+  const Double_t* lo = &_binLow[first];
+  const Double_t* hi = &_binHigh[first];
+  const Double_t* w = &_binWeight[first];
+
+  if (_erfcVal.empty()) return convolveBins(nbins, lo, hi, w, shift, invWidth);
+
+  Double_t sum(0);
+  for (unsigned int i=0; i<nbins; i++) {
+    const Double_t c = (lo[i] - shift)*invWidth;
+    const Double_t d = (hi[i] - shift)*invWidth;
+    sum += w[i]*(tabErfc(c) - tabErfc(d));
+  }
+
+  if (_erfcValidate) recordErfcError(sum, convolveBins(nbins, lo, hi, w, shift, invWidth));
+
+  return sum;
+}
+
+//_____________________________________________________________________________
+void RooHistPdfConv::recordErfcError(Double_t value, Double_t exact) const
+{
+  // Validation mode: largest relative deviation of a tabulated result from
+  // the TMath::Erfc one
+  if (exact == 0) return;
+  const Double_t relErr = fabs((value - exact)/exact);
+  TLockGuard lock(&_erfcMutex);
+  if (relErr > _erfcMaxRelErr) _erfcMaxRelErr = relErr;
+}
+
+//_____________________________________________________________________________
+void RooHistPdfConv::setGridMode(Int_t nU, Int_t nS, Double_t sMin, Double_t sMax, Double_t uMin, Double_t uMax)
+{
+  // The convolution only depends on u = xIn - mean*msf and on the width
+  // s = sigma*ssf, not on the parameters separately: tabulate it once on a
+  // (u,s) grid and interpolate. u defaults to the xIn range. The u step has to
+  // be small compared to sMin for the interpolation to be accurate.
+  _grid.clear();
+  _gridNU = 0;
+  _gridNS = 0;
+  if (nU < 2 || nS < 2 || sMin <= 0 || sMax <= sMin) return;
+
+  if (uMin >= uMax) {
+    uMin = xIn.min();
+    uMax = xIn.max();
+  }
+
+  _gridUMin = uMin;
+  _gridUMax = uMax;
+  _gridSMin = sMin;
+  _gridSMax = sMax;
+  _grid.resize(nU*nS);
+
+  for (Int_t j=0; j<nS; j++) {
+    const Double_t width = sMin + j*(sMax - sMin)/(nS-1);
+    for (Int_t i=0; i<nU; i++) {
+      const Double_t u = uMin + i*(uMax - uMin)/(nU-1);
+      _grid[j*nU + i] = _binWeight.empty() ? 0 : 0.5*convolve(u, 1./(root2*width));
+    }
+  }
+
+  _gridNU = nU;
+  _gridNS = nS;
+}
+
+//_____________________________________________________________________________
+Bool_t RooHistPdfConv::gridLookup(Double_t u, Double_t width, Double_t& value) const
+{
+  // Bilinear interpolation on the (u,s) grid, kFALSE outside of it
+  if (_gridNU == 0) return kFALSE;
+  if (u < _gridUMin || u > _gridUMax || width < _gridSMin || width > _gridSMax) return kFALSE;
+
+  const Double_t fu = (u - _gridUMin)/(_gridUMax - _gridUMin)*(_gridNU-1);
+  const Double_t fs = (width - _gridSMin)/(_gridSMax - _gridSMin)*(_gridNS-1);
+  Int_t i = (Int_t)fu;
+  Int_t j = (Int_t)fs;
+  if (i > _gridNU-2) i = _gridNU-2;
+  if (j > _gridNS-2) j = _gridNS-2;
+  const Double_t tu = fu - i;
+  const Double_t ts = fs - j;
+
+  const Double_t* row0 = &_grid[j*_gridNU];
+  const Double_t* row1 = &_grid[(j+1)*_gridNU];
+  value = (1-ts)*((1-tu)*row0[i] + tu*row0[i+1]) + ts*((1-tu)*row1[i] + tu*row1[i+1]);
+  return kTRUE;
+}
+
+//_____________________________________________________________________________
+Int_t RooHistPdfConv::multiParams(Double_t* sigmaK, Double_t* frac) const
+{
+  // Widths before the ssf scaling and fractions of the K components, read
+  // from the proxies once per evaluation (or once per batch)
+  const Int_t nComp = _sigmaList.getSize() + 1;
+  Double_t fracSum(0);
+  for (Int_t k=0; k<nComp; k++) {
+    sigmaK[k] = (k==0 ? (Double_t)sigma : ((RooAbsReal*)_sigmaList.at(k-1))->getVal());
+    if (k < nComp-1) {
+      frac[k] = ((RooAbsReal*)_fracList.at(k))->getVal();
+      fracSum += frac[k];
     } else {
-      Double_t weight = (_histpdf->weight(*aRow,0,false)/_histpdf->sum(false))*((xprime->getBinning().highBound() - xprime->getBinning().lowBound())/halfBinSize);
-      weights.push_back(weight);
+      frac[k] = 1 - fracSum;
     }
   }
-  
-  return;
+  return nComp;
+}
+
+//_____________________________________________________________________________
+void RooHistPdfConv::multiNorms(Int_t nComp, const Double_t* width, Double_t* norm) const
+{
+  // Per-component normalization, recomputed only when its inputs changed
+  const Double_t meanShift = mean*msf;
+  const Double_t xmin = xIn.min();
+  const Double_t xmax = xIn.max();
 
+  TLockGuard lock(&_cacheMutex);
+  if ((Int_t)_compNorm.size() != nComp) {
+    _compNorm.assign(nComp, 0);
+    _compNormKey.assign(4*nComp, 0);
+  }
+
+  for (Int_t k=0; k<nComp; k++) {
+    Double_t* key = &_compNormKey[4*k];
+    if (_compNorm[k] == 0 || key[0] != meanShift || key[1] != width[k] || key[2] != xmin || key[3] != xmax) {
+      key[0] = meanShift; key[1] = width[k]; key[2] = xmin; key[3] = xmax;
+      _compNorm[k] = binsIntegral(meanShift, width[k]);
+    }
+    norm[k] = _compNorm[k];
+  }
+}
+
+//_____________________________________________________________________________
+Double_t RooHistPdfConv::convolveMulti(Double_t shift, Int_t nComp, const Double_t* width,
+                                       const Double_t* frac, const Double_t* norm) const
+{
+  // Normalized sum of the K components. The bin offsets are formed once per
+  // bin and all K erfc pairs are accumulated in the same pass.
+  Double_t invWidth[maxComponents], sums[maxComponents];
+  Double_t maxWidth(0);
+  for (Int_t k=0; k<nComp; k++) {
+    invWidth[k] = 1./(root2*width[k]);
+    if (fabs(width[k]) > maxWidth) maxWidth = fabs(width[k]);
+    sums[k] = 0;
+  }
+
+  unsigned int first(0), last(_binWeight.size());
+  if (_nSigmaCut > 0) {
+    const Double_t reach = _nSigmaCut*maxWidth;
+    first = std::lower_bound(_binHigh.begin(), _binHigh.end(), shift - reach) - _binHigh.begin();
+    last = std::upper_bound(_binLow.begin(), _binLow.end(), shift + reach) - _binLow.begin();
+  }
+
+  for (unsigned int i=first; i<last; i++) {
+    const Double_t a = _binLow[i] - shift;
+    const Double_t b = _binHigh[i] - shift;
+    for (Int_t k=0; k<nComp; k++) {
+      sums[k] += _binWeight[i]*(erfcFn(a*invWidth[k]) - erfcFn(b*invWidth[k]));
+    }
+  }
+
+  if (_erfcValidate && !_erfcVal.empty() && first < last) {
+    for (Int_t k=0; k<nComp; k++) {
+      recordErfcError(sums[k], convolveBins(last-first, &_binLow[first], &_binHigh[first], &_binWeight[first], shift, invWidth[k]));
+    }
+  }
+
+  Double_t result(0);
+  for (Int_t k=0; k<nComp; k++) {
+    if (norm[k] != 0) result += frac[k]*0.5*sums[k]/norm[k];
+  }
+  return result;
 }
 
 //_____________________________________________________________________________
@@ -151,23 +533,91 @@ Double_t RooHistPdfConv::evaluate() const
 {  
   // cout << "RooHistPdfConv::evaluate(" << GetName() << ")" << endl ;
  
-  Double_t result(0) ;
-  // *** Convolution with hist PDF ***
-  for (unsigned int i=0; i<nbins; i++) {
-  
-    Double_t halfBinSize = halfBinWidths[i];
-    Double_t center = centers[i];
-    Double_t weight = weights[i];
-    
-    const Double_t c = (center - halfBinSize - xIn + (mean*msf)) / (root2*sigma*ssf);
-    const Double_t d = (center + halfBinSize - xIn + (mean*msf)) / (root2*sigma*ssf);
+  if (_binWeight.empty()) return 0;
 
-    result += 0.5*weight*(TMath::Erfc(c)-TMath::Erfc(d));
+  // *** Convolution with hist PDF ***
+  const Double_t shift = xIn - mean*msf;
+  const Double_t width = sigma*ssf;
+
+  Double_t result;
+  if (isMulti()) {
+    Double_t sigmaK[maxComponents], frac[maxComponents], widthK[maxComponents], norm[maxComponents];
+    const Int_t nComp = multiParams(sigmaK, frac);
+    for (Int_t k=0; k<nComp; k++) widthK[k] = sigmaK[k]*ssf;
+    multiNorms(nComp, widthK, norm);
+    result = convolveMulti(shift, nComp, widthK, frac, norm);
+  } else if (!gridLookup(shift, width, result)) {
+    result = 0.5*convolve(shift, 1./(root2*width));
   }
 
   return fabs(result);
 }
 
+//_____________________________________________________________________________
+void RooHistPdfConv::evaluateBatch(const Double_t* ct, const Double_t* ctErr, Double_t* out, unsigned int n, const Double_t* meanSF) const
+{
+  // Batched version of evaluate(): proxies are read once, then every event
+  // runs the bin kernel with its own shift and width.
+  if (_binWeight.empty()) {
+    for (unsigned int j=0; j<n; j++) out[j] = 0;
+    return;
+  }
+
+  const Double_t meanVal = mean;
+  const Double_t meanShift = mean*msf;
+  const Double_t sigmaVal = sigma;
+
+  if (isMulti()) {
+    // msf is the constant 1 of the multi-Gaussian constructor, meanSF does not apply
+    // Widths, fractions and norms are read once; norms only change with the
+    // scale of the widths, i.e. when ctErr differs from the previous event
+    Double_t sigmaK[maxComponents], frac[maxComponents], widthK[maxComponents], norm[maxComponents];
+    const Int_t nComp = multiParams(sigmaK, frac);
+    Double_t lastScale(0);
+    for (unsigned int j=0; j<n; j++) {
+      if (j == 0 || ctErr[j] != lastScale) {
+        lastScale = ctErr[j];
+        for (Int_t k=0; k<nComp; k++) widthK[k] = sigmaK[k]*lastScale;
+        multiNorms(nComp, widthK, norm);
+      }
+      out[j] = fabs(convolveMulti(ct[j] - meanShift, nComp, widthK, frac, norm));
+    }
+    return;
+  }
+
+  for (unsigned int j=0; j<n; j++) {
+    const Double_t shift = ct[j] - (meanSF ? meanVal*meanSF[j] : meanShift);
+    const Double_t width = sigmaVal*ctErr[j];
+    Double_t result;
+    if (!gridLookup(shift, width, result)) result = 0.5*convolve(shift, 1./(root2*width));
+    out[j] = fabs(result);
+  }
+}
+
+//_____________________________________________________________________________
+void RooHistPdfConv::evaluateBatch(const RooAbsData& data, std::vector<Double_t>& out) const
+{
+  // Unpack xIn (and ssf when it is an observable, i.e. per-event error) into
+  // contiguous arrays and evaluate them in one pass.
+  const Int_t nEntries = data.numEntries();
+  std::vector<Double_t> ct(nEntries), ctErr(nEntries), meanSF(nEntries);
+  Bool_t msfColumn(kFALSE);
+
+  for (Int_t i=0; i<nEntries; i++) {
+    const RooArgSet* aRow = data.get(i);
+    const RooAbsReal* x = (const RooAbsReal*)aRow->find(xIn.arg().GetName());
+    const RooAbsReal* e = (const RooAbsReal*)aRow->find(ssf.arg().GetName());
+    const RooAbsReal* m = (const RooAbsReal*)aRow->find(msf.arg().GetName());
+    ct[i] = x ? x->getVal() : (Double_t)xIn;
+    ctErr[i] = e ? e->getVal() : (Double_t)ssf;
+    meanSF[i] = m ? m->getVal() : (Double_t)msf;
+    if (m) msfColumn = kTRUE;
+  }
+
+  out.resize(nEntries);
+  if (nEntries > 0) evaluateBatch(&ct[0], &ctErr[0], &out[0], nEntries, msfColumn ? &meanSF[0] : 0);
+}
+
 //_____________________________________________________________________________
 Int_t RooHistPdfConv::getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* /*rangeName*/) const 
 {
@@ -179,38 +629,82 @@ Int_t RooHistPdfConv::getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analV
 //_____________________________________________________________________________
 Double_t RooHistPdfConv::analyticalIntegral(Int_t code, const char* rangeName) const 
 {
+  // Multi-Gaussian components are normalized one by one in evaluate()
+  if (isMulti()) return 1.;
+
+  // Normalization only depends on the parameters and the xIn range: reuse the
+  // last result when none of them moved
+  const Double_t key[6] = { mean, sigma, msf, ssf, xIn.min(), xIn.max() };
+
+  TLockGuard lock(&_cacheMutex);
+  if (_normValid) {
+    Bool_t same(kTRUE);
+    for (int k=0; k<6; k++) {
+      if (key[k] != _normKey[k]) { same = kFALSE; break; }
+    }
+    if (same) return _normValue;
+  }
+
+  const Double_t result = binsIntegral(mean*msf, sigma*ssf);
+
+  for (int k=0; k<6; k++) _normKey[k] = key[k];
+  _normValue = result;
+  _normValid = kTRUE;
 
+  return result;
+}
+
+
+//_____________________________________________________________________________
+Double_t RooHistPdfConv::binsIntegral(Double_t meanShift, Double_t width) const
+{
+  // Integral over the xIn range of the template convolved with one Gaussian
   Double_t result(0.);
-  for (unsigned int i=0; i<nbins; i++) {
-    
-    Double_t halfBinSize = halfBinWidths[i];
-    Double_t center = centers[i];
-    Double_t weight = weights[i];
+  for (unsigned int i=0; i<_binWeight.size(); i++) {
+    result += 0.5*_binWeight[i]*(cerfInt(_binLow[i],meanShift,width) - cerfInt(_binHigh[i],meanShift,width) );
+  }
 
-    result += 0.5*weight*(cerfInt(center - halfBinSize) - cerfInt(center + halfBinSize) );
+  if (_erfcValidate && !_erfcVal.empty()) {
+    Double_t exact(0.);
+    for (unsigned int i=0; i<_binWeight.size(); i++) {
+      exact += 0.5*_binWeight[i]*(cerfInt(_binLow[i],meanShift,width,kTRUE) - cerfInt(_binHigh[i],meanShift,width,kTRUE) );
+    }
+    recordErfcError(result, exact);
   }
-  
   return result;
 }
 
 
+//_____________________________________________________________________________
 Double_t RooHistPdfConv::cerfInt(Double_t xi) const
+{
+  // Same shift as evaluate(): the mean is scaled by msf, not ssf
+  return cerfInt(xi, mean*msf, sigma*ssf);
+}
+
+
+//_____________________________________________________________________________
+Double_t RooHistPdfConv::cerfInt(Double_t xi, Double_t meanShift, Double_t width, Bool_t exactErfc) const
 {
   const Double_t xmin = xIn.min();
   const Double_t xmax = xIn.max();
 
-  const Double_t a = -1./(root2*sigma*ssf);
-  const Double_t b = (xi + mean*ssf)/(root2*sigma*ssf);
+  const Double_t a = -1./(root2*width);
+  const Double_t b = (xi + meanShift)/(root2*width);
+
+  // exactErfc: TMath::Erfc whether or not the table is on, for validation
+  const Double_t erfcMax = exactErfc ? TMath::Erfc(b+a*xmax) : erfcFn(b+a*xmax);
+  const Double_t erfcMin = exactErfc ? TMath::Erfc(b+a*xmin) : erfcFn(b+a*xmin);
 
-  const Double_t maxInt = -b/a*TMath::Erf(b+a*xmax) + xmax*TMath::Erfc(b+a*xmax) - exp(-b*b-2*a*b*xmax-a*a*xmax*xmax)/(pi2*a);
-  const Double_t minInt = -b/a*TMath::Erf(b+a*xmin) + xmin*TMath::Erfc(b+a*xmin) - exp(-b*b-2*a*b*xmin-a*a*xmin*xmin)/(pi2*a);
+  const Double_t maxInt = -b/a*(1-erfcMax) + xmax*erfcMax - exp(-b*b-2*a*b*xmax-a*a*xmax*xmax)/(pi2*a);
+  const Double_t minInt = -b/a*(1-erfcMin) + xmin*erfcMin - exp(-b*b-2*a*b*xmin-a*a*xmin*xmin)/(pi2*a);
 
   return maxInt - minInt;
 }
 
 
 //_____________________________________________________________________________
-/* Int_t RooHistPdfConv::getGenerator(const RooArgSet& directVars, RooArgSet &generateVars, Bool_t staticInitOK) const
+Int_t RooHistPdfConv::getGenerator(const RooArgSet& directVars, RooArgSet &generateVars, Bool_t /*staticInitOK*/) const
 {
   if (matchArgs(directVars,generateVars,xIn)) return 1 ;  
   return 0 ;
@@ -221,17 +715,38 @@ Double_t RooHistPdfConv::cerfInt(Double_t xi) const
 //_____________________________________________________________________________
 void RooHistPdfConv::generateEvent(Int_t code)
 {
+  // Pick a true-lifetime bin from the cumulative content, a point uniformly
+  // inside it, then smear with the resolution of this event (ssf is the
+  // per-event error when it is a conditional observable)
   assert(code==1) ;
+  if (_binCdf.empty()) return;
+
+  // Component of the multi-Gaussian mode, picked once by its fraction. Each
+  // component is normalized to the xIn range on its own in evaluate(), so
+  // out-of-range draws are rejected within the component: re-picking it would
+  // favour the components with the larger in-range acceptance
+  Double_t width = sigma;
+  if (isMulti()) {
+    Double_t sigmaK[maxComponents], frac[maxComponents];
+    const Int_t nComp = multiParams(sigmaK, frac);
+    Double_t u = RooRandom::uniform();
+    Int_t k = 0;
+    while (k < nComp-1 && u >= frac[k]) u -= frac[k++];
+    width = sigmaK[k];
+  }
+
+  const Double_t total = _binCdf.back();
   Double_t xgen ;
   while(1) {
-    xgen = RooRandom::randomGenerator()->Gaus((mean*msf),(sigma*ssf));
+    const Double_t r = RooRandom::uniform()*total;
+    unsigned int i = std::upper_bound(_binCdf.begin(), _binCdf.end(), r) - _binCdf.begin();
+    if (i >= _binCdf.size()) i = _binCdf.size()-1;
+
+    const Double_t xtrue = _binLow[i] + RooRandom::uniform()*(_binHigh[i] - _binLow[i]);
+    xgen = xtrue + RooRandom::randomGenerator()->Gaus((mean*msf),(width*ssf));
     if (xgen < xIn.max() && xgen > xIn.min()) {
       xIn = xgen ;
       return ;
     }
   }
-}*/
-
-
-
-
+}
@@ -17,10 +17,14 @@
 #define ROO_HISTPDFCONV
 
 #include <string>
+#include <vector>
 
 #include "RooAbsPdf.h"
 #include "RooRealProxy.h"
+#include "RooListProxy.h"
+#include "RooArgList.h"
 #include "RooDataHist.h"
+#include "TMutex.h"
 
 class RooHistPdfConv : public RooAbsPdf {
 public:
@@ -28,7 +32,7 @@ public:
   // enum RooGaussBasis { histBasis=1 };
 
   // Constructors, assignment etc
-  RooHistPdfConv() { }
+  RooHistPdfConv() : _nSigmaCut(9.), _normValid(kFALSE), _erfcRange(0), _erfcInvStep(0), _erfcValidate(kFALSE), _erfcMaxRelErr(0), _gridNU(0), _gridNS(0) { }
   RooHistPdfConv(const char *name, const char *title, RooAbsReal& x, 
 		RooAbsReal& mean, RooAbsReal& sigma, RooDataHist& datahist) ; 
 
@@ -38,6 +42,12 @@ public:
   RooHistPdfConv(const char *name, const char *title, RooAbsReal& x, 
 		RooAbsReal& mean, RooAbsReal& sigma, RooAbsReal& meanSF, RooAbsReal& sigmaSF, RooDataHist& datahist) ; 
 
+  // Template convolved with a sum of K Gaussians of common mean: sigmas holds
+  // the K widths and fracs the fractions of the first K-1 components, as in
+  // RooAddPdf. Each component is normalized separately.
+  RooHistPdfConv(const char *name, const char *title, RooAbsReal& x, 
+		RooAbsReal& mean, const RooArgList& sigmas, const RooArgList& fracs, RooDataHist& datahist) ; 
+
   RooHistPdfConv(const RooHistPdfConv& other, const char* name=0);
   virtual TObject* clone(const char* newname) const { return new RooHistPdfConv(*this,newname) ; }
   inline virtual ~RooHistPdfConv() {}
@@ -45,26 +55,110 @@ public:
   virtual Int_t getAnalyticalIntegral(RooArgSet& allVars, RooArgSet& analVars, const char* rangeName=0) const ;
   virtual Double_t analyticalIntegral(Int_t code, const char* rangeName) const ;
 
-  void init() const;
+  void init(RooDataHist& histpdf);
   Double_t cerfInt(Double_t xi) const;
 
-  // Int_t getGenerator(const RooArgSet& directVars, RooArgSet &generateVars, Bool_t staticInitOK=kTRUE) const;
-  // void generateEvent(Int_t code);
+  Bool_t isMulti() const { return _sigmaList.getSize() > 0; }
+
+  // Unnormalized densities for n events at once, ct[i], ctErr[i] and meanSF[i]
+  // taking the place of xIn, ssf and msf (meanSF=0: msf of the proxy).
+  // Parameter products are evaluated once per call.
+  void evaluateBatch(const Double_t* ct, const Double_t* ctErr, Double_t* out, unsigned int n, const Double_t* meanSF=0) const;
+  // Same over all rows of a dataset; ssf and msf are read per row when they are columns of data
+  void evaluateBatch(const RooAbsData& data, std::vector<Double_t>& out) const;
+
+  // Tabulated erfc: step of the grid (<=0 switches back to TMath::Erfc) and
+  // half-width of the tabulated interval, erfc is saturated outside of it
+  void setErfcTable(Double_t step=0.01, Double_t range=6.);
+  // Compare every tabulated convolution and normalization with the TMath::Erfc
+  // one. Cached normalizations are dropped, so they are validated when next used.
+  void setErfcValidation(Bool_t flag=kTRUE) { _erfcValidate = flag; _erfcMaxRelErr = 0; _normValid = kFALSE; _compNorm.clear(); }
+  Double_t maxErfcRelError() const { return _erfcMaxRelErr; }
+
+  // Skip bins further than nSigma resolution widths from xIn-mean (<=0: sum all bins)
+  void setCutOff(Double_t nSigma);
+
+  // Precomputed grid of the convolution in (xIn-mean*msf, sigma*ssf), nU x nS
+  // points, answered by bilinear interpolation. Points off the grid fall back
+  // to the direct sum. nU<2 switches the grid off. setCutOff and setErfcTable
+  // refill an active grid with the new settings.
+  void setGridMode(Int_t nU, Int_t nS, Double_t sMin, Double_t sMax, Double_t uMin=0, Double_t uMax=0);
+  Bool_t gridMode() const { return _gridNU > 0; }
+
+  Int_t getGenerator(const RooArgSet& directVars, RooArgSet &generateVars, Bool_t staticInitOK=kTRUE) const;
+  void generateEvent(Int_t code);
 
 protected:
 
   virtual Double_t evaluate() const ;
+  Double_t convolve(Double_t shift, Double_t invWidth) const;
+  Double_t erfcFn(Double_t x) const;
+  Double_t tabErfc(Double_t x) const;
+  Bool_t gridLookup(Double_t u, Double_t width, Double_t& value) const;
+  Int_t multiParams(Double_t* sigmaK, Double_t* frac) const;
+  void multiNorms(Int_t nComp, const Double_t* width, Double_t* norm) const;
+  Double_t convolveMulti(Double_t shift, Int_t nComp, const Double_t* width, const Double_t* frac, const Double_t* norm) const;
+  Double_t binsIntegral(Double_t meanShift, Double_t width) const;
+  Double_t cerfInt(Double_t xi, Double_t meanShift, Double_t width, Bool_t exactErfc=kFALSE) const;
+  void recordErfcError(Double_t value, Double_t exact) const;
+
+  enum { maxComponents = 8 };
+  static Bool_t validComponents(const RooArgList& sigmas, const RooArgList& fracs);
+  static RooAbsReal& firstWidth(const char* name, const RooArgList& sigmas, const RooArgList& fracs);
 
   RooRealProxy xIn ;
   RooRealProxy mean ;
   RooRealProxy sigma ;
   RooRealProxy msf ;
   RooRealProxy ssf ;
+  RooListProxy _sigmaList ;  // widths of components 2..K in multi-Gaussian mode, sigma is the first
+  RooListProxy _fracList ;   // fractions of components 1..K-1
 
-  RooDataHist* _histpdf;
   std::string _variableName;
 
-  //ClassDef(RooHistPdfConv,1) // Gaussian Resolution Model
+  // Bin table of the template (structure of arrays), only non-zero living
+  // bins, sorted by position
+  std::vector<Double_t> _binLow;     // lower edge of the bin
+  std::vector<Double_t> _binHigh;    // upper edge of the bin
+  std::vector<Double_t> _binWeight;  // normalized bin content
+  std::vector<Double_t> _binCdf;     // cumulative weight*width, for generation
+
+  Double_t _nSigmaCut;               // convolution window half-width in resolution widths
+
+  // Everything below is transient (//!): the erfc table and the grid have to
+  // be switched on again with their setters after reading from a file
+
+  // Caches below are the only state written during evaluation. They are keyed
+  // on the values they depend on, so a cache hit returns the same bits as a
+  // recomputation, and guarded by _cacheMutex for concurrent evaluation.
+  // Setters (setErfcTable, setGridMode, setCutOff) must not run concurrently.
+  mutable TMutex _cacheMutex;        //!
+
+  // Normalization cache, keyed on the values it was computed with
+  mutable Bool_t _normValid;        //!
+  mutable Double_t _normKey[6];      //! mean, sigma, msf, ssf, xmin, xmax
+  mutable Double_t _normValue;       //!
+
+  // erfc table: values and derivatives at equidistant nodes on [-range,range]
+  Double_t _erfcRange;               //!
+  Double_t _erfcInvStep;             //!
+  std::vector<Double_t> _erfcVal;    //!
+  std::vector<Double_t> _erfcDer;    //!
+  Bool_t _erfcValidate;              //!
+  mutable Double_t _erfcMaxRelErr;   //! largest relative deviation seen in validation mode
+  mutable TMutex _erfcMutex;         //! guards _erfcMaxRelErr, normalizations are validated under _cacheMutex
+
+  // Convolution grid, _grid[j*_gridNU+i] at u_i, s_j; empty when switched off
+  Int_t _gridNU, _gridNS;            //!
+  Double_t _gridUMin, _gridUMax;     //!
+  Double_t _gridSMin, _gridSMax;     //!
+  std::vector<Double_t> _grid;       //!
+
+  // Per-component normalization cache of the multi-Gaussian mode
+  mutable std::vector<Double_t> _compNormKey;   //! mean*msf, width, xmin, xmax per component
+  mutable std::vector<Double_t> _compNorm;      //!
+
+  ClassDef(RooHistPdfConv,1) // Histogram template convolved with a Gaussian resolution
 };
 
 #endif
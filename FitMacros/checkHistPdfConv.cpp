@@ -0,0 +1,241 @@
+// Standalone checks of RooHistPdfConv and RooFFTKeysPdf on toy samples, no input files needed.
+// Build with "make CheckHistPdfConv" after "make", run ./CheckHistPdfConv.
+// Every check prints one PASS/FAIL line, the exit code is the number of failures.
+#include <iostream>
+#include <stdio.h>
+#include <math.h>
+
+#include "TRandom3.h"
+
+#include "RooFit.h"
+#include "RooGlobalFunc.h"
+#include "RooRealVar.h"
+#include "RooArgList.h"
+#include "RooDataSet.h"
+#include "RooDataHist.h"
+#include "RooFitResult.h"
+#include "RooKeysPdf.h"
+#include "RooHistPdfConv.h"
+#include "RooFFTKeysPdf.h"
+
+using namespace std;
+using namespace RooFit;
+
+// Non-prompt like true lifetime template: exponential of 0.4 mm, 200 bins
+RooDataHist* makeTemplate(RooRealVar &ctTrue) {
+  TRandom3 rnd(1234);
+  RooDataSet trueSet("trueSet","True lifetimes",RooArgSet(ctTrue));
+  for (int i=0; i<20000; i++) {
+    double val = rnd.Exp(0.4);
+    if (val >= ctTrue.getMax()) continue;
+    ctTrue.setVal(val);
+    trueSet.add(RooArgSet(ctTrue));
+  }
+  return new RooDataHist("binTrue","True lifetime template",RooArgSet(ctTrue),trueSet);
+}
+
+int report(const char *name, bool ok, double a, double b) {
+  cout << (ok ? "PASS " : "FAIL ") << name << " : " << a << " " << b << endl;
+  return ok ? 0 : 1;
+}
+
+// The normalization cache has to return what a fresh object computes, for
+// parameter walks that revisit values and change the ct range
+int checkNormCache(RooHistPdfConv &pdf, const char *name, RooRealVar &ct, RooRealVar &mean, RooRealVar &sigma, RooRealVar &ctErr) {
+  const double means[] = {0.0, 0.01, 0.01, 0.0, -0.02, 0.0};
+  const double sigmas[] = {1.0, 1.0, 1.3, 1.0, 0.9, 1.0};
+  const double errs[] = {0.05, 0.05, 0.03, 0.05, 0.08, 0.05};
+  const int nSteps = sizeof(means)/sizeof(means[0]);
+
+  int nFail = 0;
+  for (int pass=0; pass<2; pass++) {
+    // Second pass on a narrower ct range, the range is part of the cache key
+    if (pass == 1) ct.setRange(-1.0,2.0);
+    for (int i=0; i<nSteps; i++) {
+      mean.setVal(means[i]);
+      sigma.setVal(sigmas[i]);
+      ctErr.setVal(errs[i]);
+      ct.setVal(0.1);
+      const double cachedNorm = pdf.getNorm(RooArgSet(ct));
+      const double cachedVal = pdf.getVal(RooArgSet(ct));
+      RooHistPdfConv fresh(pdf,"fresh");
+      const double freshNorm = fresh.getNorm(RooArgSet(ct));
+      const double freshVal = fresh.getVal(RooArgSet(ct));
+      char title[256];
+      sprintf(title,"%s norm cache, range %d step %d",name,pass,i);
+      nFail += report(title, cachedNorm == freshNorm && cachedVal == freshVal, cachedNorm, freshNorm);
+    }
+  }
+  ct.setRange(-3.0,5.0);
+  return nFail;
+}
+
+// Normalization against a Simpson integral of the unnormalized density, with
+// mean != 0, ssf (Jpsi_CtErr) != msf and a ct range cutting into the template:
+// a normalization computed with a wrong mean shift moves the template against
+// the range edges and misses the integral by percents
+int checkNormIntegral(RooHistPdfConv &pdf, const char *name, RooRealVar &ct, RooRealVar &mean, RooRealVar &sigma, RooRealVar &ctErr) {
+  ct.setRange(0.1,1.0);
+  mean.setVal(0.05);
+  sigma.setVal(1.1);
+  ctErr.setVal(0.03);
+
+  RooArgSet allVars(ct), analVars;
+  const Int_t code = pdf.getAnalyticalIntegral(allVars, analVars);
+  const double analytic = pdf.analyticalIntegral(code, 0);
+
+  const int nSteps = 4000;
+  const double h = (ct.getMax() - ct.getMin())/nSteps;
+  double numeric = 0;
+  for (int i=0; i<=nSteps; i++) {
+    ct.setVal(ct.getMin() + i*h);
+    const double w = (i == 0 || i == nSteps) ? 1 : ((i%2) ? 4 : 2);
+    numeric += w*pdf.getVal();
+  }
+  numeric *= h/3;
+
+  char title[256];
+  sprintf(title,"%s analytical against numerical integral",name);
+  const int nFail = report(title, fabs(analytic - numeric) < 1e-6*fabs(numeric), analytic, numeric);
+  ct.setRange(-3.0,5.0);
+  return nFail;
+}
+
+// Mean of generated events against the mean of the normalized density, on a
+// range that cuts the wide component much more than the narrow one: picking
+// the component again after an out-of-range draw shifts the sample mean
+int checkGenerate(RooHistPdfConv &pdf, const char *name, RooRealVar &ct, RooRealVar &mean, RooRealVar &sigma) {
+  ct.setRange(-0.2,1.0);
+  mean.setVal(0.0);
+  // Widths 1.0 and 0.2 (ssf is 1 in the multi-Gaussian mode)
+  sigma.setVal(1.0);
+
+  const int nSteps = 4000;
+  const double h = (ct.getMax() - ct.getMin())/nSteps;
+  double sum0 = 0, sum1 = 0, sum2 = 0;
+  for (int i=0; i<=nSteps; i++) {
+    const double x = ct.getMin() + i*h;
+    ct.setVal(x);
+    const double w = ((i == 0 || i == nSteps) ? 1 : ((i%2) ? 4 : 2))*pdf.getVal(RooArgSet(ct));
+    sum0 += w;
+    sum1 += w*x;
+    sum2 += w*x*x;
+  }
+  const double expected = sum1/sum0;
+  const double rms = sqrt(sum2/sum0 - expected*expected);
+
+  const int nGen = 20000;
+  RooDataSet *toy = pdf.generate(RooArgSet(ct),nGen);
+  const double generated = toy->mean(ct);
+  delete toy;
+
+  char title[256];
+  sprintf(title,"%s generated mean against density mean",name);
+  const int nFail = report(title, fabs(generated - expected) < 4*rms/sqrt((double)nGen), generated, expected);
+  ct.setRange(-3.0,5.0);
+  return nFail;
+}
+
+// Fits of one toy sample with NumCPU(1) and NumCPU(8). The workers return
+// partial NLL sums that are added in another order than the serial sum, so
+// the minima are compared within 1e-6 in the NLL and 1e-3 of the parameter errors
+int checkNumCPU(RooHistPdfConv &pdf, RooRealVar &ct, RooRealVar &mean, RooRealVar &sigma, RooRealVar &ctErr) {
+  // Per-event errors drawn flat, lifetimes generated at each error
+  TRandom3 rnd(4321);
+  RooDataSet errSet("errSet","Per-event errors",RooArgSet(ctErr));
+  for (int i=0; i<5000; i++) {
+    ctErr.setVal(rnd.Uniform(0.02,0.08));
+    errSet.add(RooArgSet(ctErr));
+  }
+  mean.setVal(0.0);
+  sigma.setVal(1.0);
+  RooDataSet *toy = pdf.generate(RooArgSet(ct),ProtoData(errSet));
+
+  const int nCPU[2] = {1, 8};
+  RooFitResult *res[2];
+  for (int j=0; j<2; j++) {
+    mean.setVal(0.005);
+    sigma.setVal(1.2);
+    res[j] = pdf.fitTo(*toy,ConditionalObservables(RooArgSet(ctErr)),NumCPU(nCPU[j]),Save(1),PrintLevel(-1));
+  }
+
+  int nFail = 0;
+  nFail += report("NumCPU(1) vs NumCPU(8) status", res[0]->status() == 0 && res[1]->status() == 0, res[0]->status(), res[1]->status());
+  nFail += report("NumCPU(1) vs NumCPU(8) minimum NLL", fabs(res[0]->minNll() - res[1]->minNll()) < 1e-6, res[0]->minNll(), res[1]->minNll());
+  bool identical = res[0]->minNll() == res[1]->minNll();
+  const RooArgList &pars = res[0]->floatParsFinal();
+  for (int i=0; i<pars.getSize(); i++) {
+    const RooRealVar *par1 = (const RooRealVar*)pars.at(i);
+    const RooRealVar *par8 = (const RooRealVar*)res[1]->floatParsFinal().find(par1->GetName());
+    const bool ok = par8 && fabs(par1->getVal() - par8->getVal()) < 1e-3*par1->getError();
+    char title[256];
+    sprintf(title,"NumCPU(1) vs NumCPU(8) %s",par1->GetName());
+    nFail += report(title, ok, par1->getVal(), par8 ? par8->getVal() : 0);
+    if (par8 && par1->getVal() != par8->getVal()) identical = false;
+  }
+  cout << "NumCPU(1) vs NumCPU(8) minima bit-identical: " << (identical ? "yes" : "no") << endl;
+
+  delete res[0];
+  delete res[1];
+  delete toy;
+  return nFail;
+}
+
+// RooFFTKeysPdf against RooKeysPdf, MirrorLeftAsymRight as in defineCTSig, on
+// an exponential lifetime smeared by the resolution: the normalized densities
+// have to agree to 2e-4 of the peak, the tolerance RooFFTKeysPdf states
+int checkFFTKeys() {
+  RooRealVar x("Jpsi_Ct","c#tau",-1.5,3.0,"mm");
+  TRandom3 rnd(2468);
+  RooDataSet sample("keysSample","Smeared lifetimes",RooArgSet(x));
+  while (sample.numEntries() < 5000) {
+    const double val = rnd.Exp(0.3) + rnd.Gaus(0.0,0.05);
+    if (val <= x.getMin() || val >= x.getMax()) continue;
+    x.setVal(val);
+    sample.add(RooArgSet(x));
+  }
+
+  RooKeysPdf keys("keys","RooKeysPdf",x,sample,RooKeysPdf::MirrorLeftAsymRight);
+  RooFFTKeysPdf fftKeys("fftKeys","RooFFTKeysPdf",x,sample,RooKeysPdf::MirrorLeftAsymRight);
+
+  const int nPoints = 901;
+  double peak = 0, maxDiff = 0;
+  for (int i=0; i<nPoints; i++) {
+    x.setVal(x.getMin() + (x.getMax() - x.getMin())*i/(nPoints-1));
+    const double ref = keys.getVal(RooArgSet(x));
+    const double val = fftKeys.getVal(RooArgSet(x));
+    if (ref > peak) peak = ref;
+    if (fabs(val - ref) > maxDiff) maxDiff = fabs(val - ref);
+  }
+  return report("RooFFTKeysPdf vs RooKeysPdf, max deviation / peak", maxDiff < 2e-4*peak, maxDiff/peak, 2e-4);
+}
+
+int main(int argc, char* argv[]) {
+  RooRealVar ct("Jpsi_Ct","c#tau",-3.0,5.0,"mm");
+  RooRealVar ctTrue("Jpsi_CtTrue","true c#tau",0.0,5.0,"mm");
+  ctTrue.setBins(200);
+  RooRealVar ctErr("Jpsi_CtErr","c#tau error",0.05,0.005,0.5,"mm");
+  RooRealVar one("one","one",1.0);
+  RooRealVar mean("mean","mean",0.0,-0.1,0.1);
+  RooRealVar sigma("sigma","width scale",1.0,0.5,2.0);
+  RooRealVar sigma2("sigma2","second width",0.2,0.01,1.0);
+  RooRealVar frac("frac","first fraction",0.8,0.0,1.0);
+  RooDataHist *binTrue = makeTemplate(ctTrue);
+
+  // Per-event error model as in fitBin, and the multi-Gaussian model of isPEE==0
+  RooHistPdfConv pee("pee","Per-event error model",ct,mean,sigma,one,ctErr,*binTrue);
+  RooHistPdfConv multi("multi","Two Gaussian model",ct,mean,RooArgList(sigma,sigma2),RooArgList(frac),*binTrue);
+
+  int nFail = 0;
+  nFail += checkNormCache(pee, "pee", ct, mean, sigma, ctErr);
+  nFail += checkNormCache(multi, "multi", ct, mean, sigma, ctErr);
+  nFail += checkNormIntegral(pee, "pee", ct, mean, sigma, ctErr);
+  nFail += checkNormIntegral(multi, "multi", ct, mean, sigma, ctErr);
+  nFail += checkGenerate(multi, "multi", ct, mean, sigma);
+  nFail += checkNumCPU(pee, ct, mean, sigma, ctErr);
+  nFail += checkFFTKeys();
+
+  cout << "checkHistPdfConv: " << nFail << " failed checks" << endl;
+  delete binTrue;
+  return nFail;
+}
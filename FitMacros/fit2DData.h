@@ -2,6 +2,13 @@
 #include <fstream>
 #include <string>
 #include <math.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "TROOT.h"
 #include "TFile.h"
@@ -15,11 +22,16 @@
 #include "TStyle.h"
 #include "TRandom.h"
 #include "TLine.h"
+#include "TStopwatch.h"
+#include "TSystem.h"
 
 #include "RooFit.h"
 #include "RooGlobalFunc.h"
 #include "RooCategory.h"
+#include "RooSimultaneous.h"
 #include "RooHistPdfConv.h"
+#include "RooFFTKeysPdf.h"
+#include "RooCBGaussPdf.h"
 #include "RooGenericPdf.h"
 #include "RooFFTConvPdf.h"
 #include "RooWorkspace.h"
@@ -33,9 +45,20 @@
 #include "RooFitResult.h"
 #include "RooPlot.h"
 #include "RooConstVar.h"
+#include "RooRealConstant.h"
 #include "RooKeysPdf.h"
 #include "RooNLLVar.h"
 #include "RooMinuit.h"
+#include "RooCmdArg.h"
+#include "RooLinkedList.h"
+#include "RooExponential.h"
+#include "RooChebychev.h"
+#include "RooRandom.h"
+#include "RooGaussian.h"
+#include "DimuonColumns.h"
+#include "Math/IFunction.h"
+#include "Math/Minimizer.h"
+#include "Math/Factory.h"
 //#include "RooStats/ModelConfig.h"
 //#include "RooStats/ProfileLikelihoodCalculator.h"
 //#include "RooStats/LikelihoodInterval.h"
@@ -81,8 +104,134 @@ struct InputOpt {
 
   double combinedWidth, combinedWidthErr; //CB + Gaus combined width/width error
   double PcombinedWidth, PcombinedWidthErr; //CB + Gaus combined width/width error, scaling for presentation
+
+  string binList;   // multi-bin driver: list of bins fitted in one process
+  int nWorkers;     // number of bins fitted in parallel by the driver
+
+  int binnedFit;    // 0: unbinned fits, 1: binned fast mode, 2: binned fast mode + unbinned reference
+  int nMassBins, nCtBins, nCtErrBins; // binnings of the fast mode
+  string binnedCheck; // binned vs unbinned results of each fit stage (binnedFit == 2)
+
+  string fitCacheDir; // fit result cache, empty: no cache
+  bool warmStart;     // start fits from the nearest bin in the cache
+  string templateCacheDir; // non-prompt MC template cache, empty: no cache
+  bool gradMass;      // compiled mass signal model, mass fits pre-minimized with analytic gradients
+  int plotMode;       // 0: fit and plot, 1: fit and write plot inputs, 2: plot from those inputs only
+  int profilePoints;  // profile likelihood scan points per parameter, 0: no scan
+  int profileWorkers; // scan points fitted in parallel
+  string profileScan; // profile likelihood intervals and scan points of the mass and final fits
+  int nToys;          // pseudo-experiments per fit stage, 0: no toy study
+  int toyWorkers;     // toys generated and fitted in parallel
+  int toySeed;        // seeds of the toys are derived from it, the bin, the stage and the toy number
+  string toyStudy;    // pull summaries and toy fit results of the mass and final fits
+  int simFit;         // driver: 0: bins fitted alone, 1: centrality groups, 2: dPhi groups also fitted simultaneously
+  int useColumns;     // 1: map the column files of the dataset makers instead of reading the RooDataSets, 2: check them
+  double erfcStep;    // step of the tabulated erfc of the RooHistPdfConv model, 0: TMath::Erfc
+  bool erfcValidate;  // largest deviation of the tabulated erfc from TMath::Erfc printed after the final fit
+  int gridNU, gridNS; // (ct shift, width) grid of the RooHistPdfConv model, gridNU < 2: no grid
+  double gridSMin, gridSMax; // width range of the grid, outside of it the convolution is summed directly
+  bool fftKeys;       // MLAR non-prompt template: 1: RooFFTKeysPdf, 0: RooKeysPdf
 } inOpt;
 
+// One entry of the multi-bin driver list
+struct BinOpt {
+  string yrange, prange, crange, phirange;
+  int lifetimeOpt;  // same as the 1st argument of -a, -1: use the command line value
+};
+
+// Entries of the input samples inside one bin, before the ctau error cut
+struct BinIndex {
+  vector<int> data, dataMC, dataMC2;
+};
+
+// Sorted edges of all bins along one variable, bin i covers the cells [lo[i],hi[i])
+struct BinAxis {
+  vector<double> edges;
+  vector<int> lo, hi;
+
+  void build(const vector<double> &mins, const vector<double> &maxs) {
+    edges = mins;
+    edges.insert(edges.end(), maxs.begin(), maxs.end());
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+    lo.clear(); hi.clear();
+    for (unsigned int i=0; i<mins.size(); i++) {
+      lo.push_back(lower_bound(edges.begin(), edges.end(), mins[i]) - edges.begin());
+      hi.push_back(lower_bound(edges.begin(), edges.end(), maxs[i]) - edges.begin());
+    }
+  }
+  // Cell [edges[k],edges[k+1]) holding val, -1 if it is outside of all bins
+  int cell(double val) const {
+    int k = (upper_bound(edges.begin(), edges.end(), val) - edges.begin()) - 1;
+    if (k < 0 || k >= (int)edges.size()-1) return -1;
+    return k;
+  }
+  bool contains(unsigned int bin, int k) const { return k >= lo[bin] && k < hi[bin]; }
+};
+
+// Jobs of the forked worker pool runWorkers: run() is called in the worker and
+// fills the record sent back to the parent, done() in the parent once the
+// worker has exited, with ok false and a zero record if it failed
+struct WorkerJobs {
+  virtual ~WorkerJobs() {}
+  virtual int run(int iJob, double *rec) = 0;
+  virtual void started(int iJob, pid_t pid) {}
+  virtual void done(int iJob, const double *rec, bool ok) = 0;
+};
+
+// NLL of the mass model NSig*RooCBGaussPdf + NBkg*(exponential or 1st order Chebychev),
+// or frac*sig + (1-frac)*bkg, with Gaussian constraints, and its analytic gradient
+class MassNLLGrad : public ROOT::Math::IMultiGradFunction {
+public:
+  MassNLLGrad(RooCBGaussPdf *sig, RooAbsPdf *bkg, RooAbsReal *nSig, RooAbsReal *nBkg, RooAbsData *data, const RooArgSet *cons);
+
+  bool isValid() const { return valid; }
+  unsigned int NDim() const { return pars.size(); }
+  ROOT::Math::IMultiGenFunction* Clone() const { return new MassNLLGrad(*this); }
+  void Gradient(const double *x, double *grad) const { double f; FdF(x,f,grad); }
+  void FdF(const double *x, double &f, double *grad) const;
+
+  vector<RooRealVar*> pars;  // free parameters, in the order of x
+  mutable int nCalls;
+
+private:
+  double DoEval(const double *x) const;
+  double DoDerivative(const double *x, unsigned int icoord) const;
+  int slot(const RooAbsReal &par);
+
+  bool valid;
+  RooCBGaussPdf *sig;
+  RooAbsPdf *bkg;
+  bool bkgExp;                 // RooExponential, otherwise RooChebychev
+  RooAbsReal *nSig, *nBkg;     // nBkg = 0: nSig is the signal fraction
+  vector<double> mass, weight;
+  double sumW, mmin, mmax;
+  int sigSlot[RooCBGaussPdf::nPars], bkgSlot, nSigSlot, nBkgSlot;
+  RooAbsReal *bkgCoef;
+  vector<int> conSlot;         // Gaussian constraints on free parameters
+  vector<double> conMean, conSigma;
+  mutable vector<double> lastX, lastGrad;
+};
+
+// Data and expected counts of a fitted pdf in the bins of one observable, with
+// the pulls and residuals that RooPlot::pullHist/residHist would give
+struct BinnedGOF {
+  vector<double> lo, hi;        // bin edges
+  vector<double> data, err2;    // sum of weights and of squared weights
+  vector<double> expected;      // expected counts
+  vector<double> pull, resid;   // (data-expected)/sqrt(err2) and data-expected, 0 in empty bins
+  double chi2;                  // sum of squared pulls of the non-empty bins
+  int nFullBins;
+};
+
+// Ctau error ranges of -x, keyed by "rap pT cent dPhi" as given to -y -p -t -s
+typedef map< string, pair<double,double> > CtErrTable;
+CtErrTable ctErrTable;    // table of ctErrTableFile, loaded once per process
+string ctErrTableFile;
+
+// Column files behind the input samples read by loadColumnSample; those samples
+// are empty and only carry the variables, their rows are read from the columns
+map<const RooAbsData*, ColumnStore> sampleColumns;
 
 // Global objects for drawing
 TGraphErrors *gfake1;
@@ -90,13 +239,30 @@ TH1F hfake11, hfake21, hfake31, hfake311, hfake41;
 
 // Input arguments, text parsing, formatting functions
 void parseInputArg(int argc, char* argv[], InputOpt &opt);
+void setLifetimeOpt(InputOpt &opt, int mode);
 void getOptRange(string &ran,double *min,double *max);
+
+// Fit of a single bin, and the multi-bin driver running it over a bin list
+int fitBin(InputOpt &inOpt, RooDataSet *data, RooDataSet *dataMC, RooDataSet *dataMC2, const BinIndex *binIndex = 0);
+int readBinList(InputOpt &opt, vector< vector<BinOpt> > &stages);
+int runBinList(InputOpt &opt, RooDataSet *data, RooDataSet *dataMC, RooDataSet *dataMC2);
+int plotBin(InputOpt &opt);
+int runSimFits(InputOpt &opt, const vector<BinOpt> &bins);
+int simFitGroup(InputOpt &opt, const vector<BinOpt> &group, const string &groupName);
+void addPlotBundle(RooWorkspace *ws, RooDataSet *redDataCut, RooDataSet *redMCCutPR, RooDataHist *binDataCtErr, RooDataHist *binDataCtErrSB, RooFitResult *fitM, RooFitResult *fit2D, double NSigNP_fin, double NBkg_fin, InputOpt &opt);
+
+void setBinOpt(InputOpt &opt);
+
 void formTitle(InputOpt &opt, double cmin, double cmax) ;
 void formRapidity(InputOpt &opt, double ymin, double ymax) ;
 void formPt(InputOpt &opt, double pmin, double pmax) ;
 void formPhi(InputOpt &opt, double psmin, double psmax) ;
-void getCtauErrRange(RooDataSet *data, InputOpt &opt, const char *reduceDSOrig, double lmin, double lmax, double *errmin, double *errmax);
+void getCtauErrRange(RooDataSet *redDataCut, InputOpt &opt, const char *reduceDSOrig, double lmin, double lmax, double *errmin, double *errmax);
 int readCtauErrRange(InputOpt &opt, double *errmin, double *errmax) ;
+string ctErrKey(const InputOpt &opt);
+int loadCtauErrTable(const string &fileName, CtErrTable &table);
+int writeCtauErrTable(const string &fileName, const CtErrTable &table);
+int fillCtauErrTable(InputOpt &opt, RooDataSet *data, const vector<BinOpt> &bins, const BinIndex *index);
 
 // Define essential fit functions
 void setWSRange(RooWorkspace *ws, double lmin, double lmax, double errmin, double errmax);
@@ -107,7 +273,52 @@ void getMCTrueLifetime(RooWorkspace *ws, RooDataSet *redMCCutNP, string titlestr
 void defineCTResol(RooWorkspace *ws, InputOpt &opt);
 void defineCTBkg(RooWorkspace *ws, InputOpt &opt);
 void defineCTSig(RooWorkspace *ws, RooDataSet *redMCCut, RooDataSet *redMCCutNP, string titlestr, double lmax, InputOpt &opt);
-RooDataHist* subtractSidebands(RooWorkspace* ws, RooDataHist* subtrData, RooDataHist* all, RooDataHist* side, double scalefactor, string varName);
+// Largest relative error of the tabulated erfc of sigNP on a sample, -1 if sigNP is not a RooHistPdfConv
+double erfcTableError(RooWorkspace *ws, RooDataSet *ds);
+RooDataHist* subtractSidebands(RooWorkspace* ws, RooDataHist* subtrData, RooDataHist* all, RooDataHist* side, double scalefactor, string varName, double minWeight);
+void histWeights(RooDataHist *hist, vector<double> &w);
+void setHistWeights(RooDataHist *hist, const vector<double> &w);
+RooDataHist* makeFitHist(RooWorkspace *ws, RooDataSet *ds, const char *name, const char *varNames, InputOpt &opt);
+RooFitResult* fitStage(RooAbsPdf *pdf, RooDataSet *ds, RooDataHist *hist, const char *stage, InputOpt &opt,
+                       const RooCmdArg& arg1=RooCmdArg::none(), const RooCmdArg& arg2=RooCmdArg::none(),
+                       const RooCmdArg& arg3=RooCmdArg::none(), const RooCmdArg& arg4=RooCmdArg::none(),
+                       const RooCmdArg& arg5=RooCmdArg::none(), const RooCmdArg& arg6=RooCmdArg::none(),
+                       const RooCmdArg& arg7=RooCmdArg::none());
+RooFitResult* runFitStage(RooAbsPdf *pdf, RooDataSet *ds, RooDataHist *hist, const char *stage, InputOpt &opt, RooLinkedList &cmdList);
+bool gradientPreFit(RooAbsPdf *pdf, RooAbsData *data, RooLinkedList &cmdList);
+int runWorkers(WorkerJobs &jobs, int nJobs, int nWorkers, int recSize);
+void redirectLog(const string &logName);
+void workerFitArgs(RooLinkedList &cmdList, RooLinkedList &workerList);
+void profileScan(RooAbsPdf *pdf, RooAbsData *data, const char *stage, RooFitResult *best, InputOpt &opt, RooLinkedList &cmdList);
+void toyStudy(RooAbsPdf *pdf, RooDataSet *ds, RooDataHist *hist, const char *stage, RooFitResult *best, InputOpt &opt, RooLinkedList &cmdList);
+
+// Fit result cache: one file per fit, keyed by dataset, bin, options, stage and starting parameters
+ULong64_t hashBytes(const void *buf, size_t len, ULong64_t h);
+ULong64_t hashString(const string &str, ULong64_t h);
+ULong64_t hashDataset(RooAbsData *ds, ULong64_t h);
+ULong64_t hashArgs(const RooAbsCollection &args, ULong64_t h);
+string optionTag(InputOpt &opt);
+string fitCacheName(RooAbsPdf *pdf, RooDataSet *ds, RooArgSet *pars, const char *stage, InputOpt &opt, RooLinkedList &cmdList);
+TObject* readCacheObject(const string &fileName, const char *objName);
+void writeCacheObject(const string &fileName, TObject *obj, const char *objName);
+RooFitResult* readFitCache(const string &fileName);
+void writeFitCache(const string &fileName, RooFitResult *res);
+string npTemplateName(RooWorkspace *ws, RooDataSet *redMCCutNP, const char *type, InputOpt &opt);
+void restoreFitResult(RooArgSet *pars, RooFitResult *res);
+bool warmStartFit(RooArgSet *pars, const char *stage, InputOpt &opt);
+
+// Bin partitioning of the input samples, replacing reduce() with cut strings
+RooDataSet* loadColumnSample(const string &fileName, const char *dsName, const char *name);
+int checkColumnSample(RooDataSet *colSample, RooDataSet *ds, InputOpt &opt, bool cutCent);
+double roundCut(double val, int digits);
+void partitionDataset(RooDataSet *ds, const vector<BinOpt> &bins, InputOpt &opt, bool cutCent, vector< vector<int> > &index);
+void partitionSamples(RooDataSet *data, RooDataSet *dataMC, RooDataSet *dataMC2, const vector<BinOpt> &bins, InputOpt &opt, vector<BinIndex> &index);
+RooDataSet* selectEntries(RooDataSet *ds, const vector<int> &index);
+RooDataSet* selectCtErr(RooDataSet *ds, double errmin, double errmax);
+
+// Goodness of fit from binned projections, without plotting
+void binnedGOF(RooAbsPdf *pdf, RooRealVar *x, const RooAbsBinning &bins, RooDataSet *data, RooDataHist *projData, double norm, BinnedGOF &gof, int nSub = 4);
+RooHist* gofHist(const BinnedGOF &gof, bool resid = false);
 
 // Drawing functions: Plotting
 void ctauErrCutCheck(RooWorkspace *ws, RooDataSet *redData, RooDataSet *redData_2, RooDataSet *redMC, RooDataSet *redMC_2, RooDataSet *redMC2, RooDataSet *redMC2_2, InputOpt &opt) ;
@@ -151,9 +362,28 @@ void defineMassSig(RooWorkspace *ws, InputOpt &opt) {
   ws->factory("CBShape::signalCB2(Jpsi_Mass,meanSig1,sigmaSig2[0.03,0.0001,0.6],alpha,enne)");
   ws->factory("CBShape::signalCBWN(Jpsi_Mass,meanSig1,sigmaSig1,alpha,enneW[5.,1.,50.])");
   ws->factory("CBShape::signalCB2WN(Jpsi_Mass,meanSig1,sigmaSig2,alpha,enneW)");
-  ws->factory("CBShape::signalCB3WN(Jpsi_Mass,meanSig1,sigmaSig3[0.03,0.01,0.2],alpha,enneW)");
+  if (!opt.gradMass) {
+    ws->factory("CBShape::signalCB3WN(Jpsi_Mass,meanSig1,sigmaSig3[0.03,0.01,0.2],alpha,enneW)");
+  } else {
+    // Compiled with analytic gradient, Gaussian fraction fixed to 0
+    ws->factory("sigmaSig3[0.03,0.01,0.2]");
+    RooCBGaussPdf signalCB3WN("signalCB3WN","Crystal Ball 3 wide n",*(ws->var("Jpsi_Mass")),*(ws->var("meanSig1")),*(ws->var("sigmaSig3")),*(ws->var("sigmaSig3")),*(ws->var("alpha")),*(ws->var("enneW")),RooRealConstant::value(0));  ws->import(signalCB3WN);
+  }
 
   //////// Sum of signal functions
+  if (opt.gradMass) {
+    // Same sums as below in single compiled objects with analytic gradients
+    if (opt.is2Widths == 1) ws->factory("coeffGaus[0.1,0.0,1.0]");
+    else if (opt.is2Widths == 0) ws->factory("coeffGaus[0.1,0.05,1.]");
+    RooRealVar *m = ws->var("Jpsi_Mass"), *mean = ws->var("meanSig1"), *coeff = ws->var("coeffGaus");
+    RooRealVar *sigma1 = ws->var("sigmaSig1"), *sigma2 = ws->var("sigmaSig2");
+    RooRealVar *alpha = ws->var("alpha"), *enne = ws->var("enne"), *enneW = ws->var("enneW");
+    RooCBGaussPdf sigCBG1("sigCBG1","Gaussian + Crystal Ball",*m,*mean,*sigma1,*sigma1,*alpha,*enne,*coeff);  ws->import(sigCBG1);
+    RooCBGaussPdf sigCB2G1("sigCB2G1","Gaussian + Crystal Ball 2",*m,*mean,*sigma1,*sigma2,*alpha,*enne,*coeff);  ws->import(sigCB2G1);
+    RooCBGaussPdf sigCBWNG1("sigCBWNG1","Gaussian + Crystal Ball wide n",*m,*mean,*sigma1,*sigma1,*alpha,*enneW,*coeff);  ws->import(sigCBWNG1);
+    RooCBGaussPdf sigCB2WNG1("sigCB2WNG1","Gaussian + Crystal Ball 2 wide n",*m,*mean,*sigma1,*sigma2,*alpha,*enneW,*coeff);  ws->import(sigCB2WNG1);
+    return;
+  }
   // Sum of gaussian 1 and a crystall ball
   if (opt.is2Widths == 1) {
     ws->factory("SUM::sigCBG1(coeffGaus[0.1,0.0,1.0]*signalG1,signalCB)");
@@ -169,37 +399,1251 @@ void defineMassSig(RooWorkspace *ws, InputOpt &opt) {
   return;
 }
 
-RooDataHist* subtractSidebands(RooWorkspace* ws, RooDataHist* subtrData, RooDataHist* all, RooDataHist* side, double scalefactor, string varName = "Jpsi_CtErr") {
-  const RooArgSet* aRow;
-  const RooArgSet* aRowS;
- 
-  if (all->numEntries() != side->numEntries()) {
+// Histogram arithmetic on the bin contents of RooDataHists with the same
+// variables and binnings, which then have the same internal bin order. This
+// holds for 1D Jpsi_CtErr as well as for 2D Jpsi_Ct x Jpsi_CtErr histograms.
+void histWeights(RooDataHist *hist, vector<double> &w) {
+  w.resize(hist->numEntries());
+  for (Int_t i=0; i<hist->numEntries(); i++) {
+    hist->get(i);
+    w[i] = hist->weight();
+  }
+}
+
+void setHistWeights(RooDataHist *hist, const vector<double> &w) {
+  // Same sum of squared weights as a single add() of w[i] to an empty bin
+  for (Int_t i=0; i<hist->numEntries(); i++) {
+    hist->get(i);
+    hist->set(w[i], w[i]);
+  }
+}
+
+// subtrData = all - scalefactor*side and the returned histogram = side, both
+// clamped bin by bin to minWeight so that the error PDFs made from them have
+// no empty or negative bins. varName may list several variables ("Jpsi_Ct,Jpsi_CtErr"),
+// subtrData must be booked on them with the binning of all and side.
+RooDataHist* subtractSidebands(RooWorkspace* ws, RooDataHist* subtrData, RooDataHist* all, RooDataHist* side, double scalefactor, string varName = "Jpsi_CtErr", double minWeight = 0.1) {
+  if (all->numEntries() != side->numEntries() || all->numEntries() != subtrData->numEntries()) {
     cout << "ERROR subtractSidebands : different binning!" << endl;
     return 0;
   }
 
-  RooDataHist* scaledBkg = new RooDataHist("scaledBkg","Scale applied sideband data",RooArgSet(*(ws->var(varName.c_str())))); 
-  RooDataHist* weightedBkg = new RooDataHist("weightedBkg","weighting applied sideband data",RooArgSet(*(ws->var(varName.c_str())))); 
+  vector<double> wAll, wSide;
+  histWeights(all, wAll);
+  histWeights(side, wSide);
 
-  for (Int_t i=0; i<all->numEntries(); i++) {
-    aRow = all->get(i);
-    aRowS = side->get(i);
-    RooRealVar* thisVar = (RooRealVar*)aRow->find(varName.c_str());
-    ws->var(varName.c_str())->setVal(thisVar->getVal());
-    double wBkg = side->weight(*aRowS,0,false);
-    if (wBkg <= 0.1) wBkg = 0.1;
-    double sfBkg = scalefactor*side->weight(*aRowS,0,false);
-    double newWeight = all->weight(*aRow,0,false) - scalefactor*side->weight(*aRowS,0,false);
-    if (newWeight <= 0.1) newWeight = 0.1;
-    subtrData->add(RooArgSet(*(ws->var(varName.c_str()))),newWeight);
-    scaledBkg->add(RooArgSet(*(ws->var(varName.c_str()))),sfBkg);
-    weightedBkg->add(RooArgSet(*(ws->var(varName.c_str()))),wBkg);
+  vector<double> wSig(wAll.size()), wBkg(wAll.size());
+  for (unsigned int i=0; i<wAll.size(); i++) {
+    wSig[i] = std::max(wAll[i] - scalefactor*wSide[i], minWeight);
+    wBkg[i] = std::max(wSide[i], minWeight);
   }
 
-//  return scaledBkg;
+  RooDataHist* weightedBkg = new RooDataHist("weightedBkg","weighting applied sideband data",ws->argSet(varName.c_str()));
+  setHistWeights(subtrData, wSig);
+  setHistWeights(weightedBkg, wBkg);
+
   return weightedBkg;
 }
 
+RooDataHist* makeFitHist(RooWorkspace *ws, RooDataSet *ds, const char *name, const char *varNames, InputOpt &opt) {
+  // Binned copy of ds for the fast fit mode, 0 if fits are unbinned
+  if (opt.binnedFit == 0) return 0;
+
+  ws->var("Jpsi_Mass")->setBins(opt.nMassBins,"binnedFit");
+  ws->var("Jpsi_Ct")->setBins(opt.nCtBins,"binnedFit");
+  ws->var("Jpsi_CtErr")->setBins(opt.nCtErrBins,"binnedFit");
+
+  RooDataHist *hist = new RooDataHist(name,"Binned sample for fast fit",ws->argSet(varNames),"binnedFit");
+  hist->add(*ds);
+  cout << "makeFitHist:: " << name << " : " << ds->numEntries() << " entries in " << hist->numEntries() << " bins" << endl;
+  return hist;
+}
+
+RooFitResult* fitStage(RooAbsPdf *pdf, RooDataSet *ds, RooDataHist *hist, const char *stage, InputOpt &opt,
+                       const RooCmdArg& arg1, const RooCmdArg& arg2, const RooCmdArg& arg3, const RooCmdArg& arg4,
+                       const RooCmdArg& arg5, const RooCmdArg& arg6, const RooCmdArg& arg7) {
+  // Same fit command list for the unbinned and binned samples
+  RooLinkedList cmdList;
+  cmdList.Add((TObject*)&arg1);  cmdList.Add((TObject*)&arg2);
+  cmdList.Add((TObject*)&arg3);  cmdList.Add((TObject*)&arg4);
+  cmdList.Add((TObject*)&arg5);  cmdList.Add((TObject*)&arg6);
+  cmdList.Add((TObject*)&arg7);
+
+  RooFitResult *res = 0;
+  if (opt.fitCacheDir.empty()) {
+    res = runFitStage(pdf,ds,hist,stage,opt,cmdList);
+  } else {
+    // Key is taken before the warm start, from the starting point the fit would have without cache
+    RooArgSet *pars = pdf->getParameters(*ds);
+    string cacheName = fitCacheName(pdf,ds,pars,stage,opt,cmdList);
+    res = readFitCache(cacheName);
+    if (res) {
+      cout << "fitStage:: " << stage << " : result taken from " << cacheName << endl;
+      restoreFitResult(pars,res);
+    } else {
+      if (opt.warmStart) warmStartFit(pars,stage,opt);
+      res = runFitStage(pdf,ds,hist,stage,opt,cmdList);
+      if (res && res->status() == 0) writeFitCache(cacheName,res);
+    }
+    delete pars;
+  }
+
+  // Yields and Bfrac are only measured by these two fits, on the sample the result comes from
+  if (res && opt.profilePoints > 0 && (!strcmp(stage,"mass") || !strcmp(stage,"final"))) {
+    RooAbsData *scanData = (hist && opt.binnedFit == 1) ? (RooAbsData*)hist : (RooAbsData*)ds;
+    profileScan(pdf,scanData,stage,res,opt,cmdList);
+  }
+  if (res && opt.nToys > 0 && (!strcmp(stage,"mass") || !strcmp(stage,"final"))) {
+    toyStudy(pdf,ds,(opt.binnedFit == 1) ? hist : 0,stage,res,opt,cmdList);
+  }
+
+  return res;
+}
+
+RooFitResult* runFitStage(RooAbsPdf *pdf, RooDataSet *ds, RooDataHist *hist, const char *stage, InputOpt &opt, RooLinkedList &cmdList) {
+  // Minuit then starts from the minimum found with analytic gradients, and mostly runs HESSE
+  if (opt.gradMass && !strcmp(stage,"mass")) {
+    if (hist) gradientPreFit(pdf,hist,cmdList);
+    else gradientPreFit(pdf,ds,cmdList);
+  }
+  if (hist == 0) return pdf->fitTo(*ds,cmdList);
+
+  TStopwatch timer;
+  timer.Start();
+  RooFitResult *resBinned = pdf->fitTo(*hist,cmdList);
+  timer.Stop();
+  double timeBinned = timer.CpuTime();
+  cout << "fitStage:: " << stage << " : binned fit CPU time " << timeBinned << " s" << endl;
+  if (opt.binnedFit != 2 || resBinned == 0) return resBinned;
+
+  // Unbinned reference, started from the binned minimum
+  timer.Start();
+  RooFitResult *resUnbinned = pdf->fitTo(*ds,cmdList);
+  timer.Stop();
+  double timeUnbinned = timer.CpuTime();
+  cout << "fitStage:: " << stage << " : unbinned fit CPU time " << timeUnbinned << " s" << endl;
+  if (resUnbinned == 0) return resBinned;
+
+  const char *checkPars[] = {"NSig","NBkg","Bfrac","NSigPR","NSigNP"};
+  char line[512];
+  for (unsigned int i=0; i<sizeof(checkPars)/sizeof(checkPars[0]); i++) {
+    RooRealVar *parB = (RooRealVar*)resBinned->floatParsFinal().find(checkPars[i]);
+    RooRealVar *parU = (RooRealVar*)resUnbinned->floatParsFinal().find(checkPars[i]);
+    if (parB == 0 || parU == 0) continue;
+    double pull = (parU->getError() > 0) ? (parB->getVal()-parU->getVal())/parU->getError() : 0;
+    sprintf(line,"%s %s %g %g %g %g %g\n",stage,checkPars[i],parB->getVal(),parB->getError(),parU->getVal(),parU->getError(),pull);
+    cout << "fitStage:: binned vs unbinned: " << line;
+    opt.binnedCheck += line;
+  }
+  sprintf(line,"%s CPUTime %g 0 %g 0 0\n",stage,timeBinned,timeUnbinned);
+  opt.binnedCheck += line;
+
+  return resUnbinned;
+}
+
+MassNLLGrad::MassNLLGrad(RooCBGaussPdf *sig_, RooAbsPdf *bkg_, RooAbsReal *nSig_, RooAbsReal *nBkg_, RooAbsData *data, const RooArgSet *cons) :
+  nCalls(0), valid(false), sig(sig_), bkg(bkg_), nSig(nSig_), nBkg(nBkg_), bkgSlot(-1), nSigSlot(-1), nBkgSlot(-1), bkgCoef(0) {
+  RooRealVar *m = (RooRealVar*)data->get()->find(sig->observable().GetName());
+  if (m == 0) return;
+  mmin = ((RooRealVar&)sig->observable()).getMin();
+  mmax = ((RooRealVar&)sig->observable()).getMax();
+
+  bkgExp = (dynamic_cast<RooExponential*>(bkg) != 0);
+  if (!bkgExp && dynamic_cast<RooChebychev*>(bkg) == 0) return;
+  RooArgSet *bkgPars = bkg->getParameters(*data);
+  if (bkgPars->getSize() != 1) { delete bkgPars; return; }
+  bkgCoef = (RooAbsReal*)bkgPars->first();
+  delete bkgPars;
+
+  for (int i=0; i<RooCBGaussPdf::nPars; i++) sigSlot[i] = slot(sig->parameter(i));
+  bkgSlot = slot(*bkgCoef);
+  nSigSlot = slot(*nSig);
+  if (nBkg) nBkgSlot = slot(*nBkg);
+
+  // Constraints as made by the factory: Gaussian::xCon(x,RooConstVar(mean),RooConstVar(sigma))
+  if (cons) {
+    TIterator *it = cons->createIterator();
+    RooAbsArg *con;
+    while ((con = (RooAbsArg*)it->Next())) {
+      vector<RooAbsReal*> servers;
+      TIterator *its = con->serverIterator();
+      RooAbsArg *server;
+      while ((server = (RooAbsArg*)its->Next())) servers.push_back((RooAbsReal*)server);
+      delete its;
+      if (dynamic_cast<RooGaussian*>(con) == 0 || servers.size() < 2) { delete it; return; }
+      int k = -1;
+      for (unsigned int j=0; j<pars.size(); j++) if (pars[j] == servers[0]) k = j;
+      if (k < 0) continue;  // constrained parameter is fixed in this fit
+      conSlot.push_back(k);
+      conMean.push_back(servers[1]->getVal());
+      conSigma.push_back(servers[servers.size()-1]->getVal());  // same constant as the mean: one server
+    }
+    delete it;
+  }
+
+  sumW = 0;
+  for (int i=0; i<data->numEntries(); i++) {
+    data->get(i);
+    if (data->weight() == 0) continue;
+    mass.push_back(m->getVal());
+    weight.push_back(data->weight());
+    sumW += data->weight();
+  }
+  valid = !pars.empty();
+}
+
+int MassNLLGrad::slot(const RooAbsReal &par) {
+  RooRealVar *var = dynamic_cast<RooRealVar*>((RooAbsReal*)&par);
+  if (var == 0 || var->isConstant()) return -1;
+  for (unsigned int j=0; j<pars.size(); j++) if (pars[j] == var) return j;
+  pars.push_back(var);
+  return pars.size()-1;
+}
+
+double MassNLLGrad::DoEval(const double *x) const {
+  double f;
+  vector<double> grad(pars.size());
+  FdF(x,f,&grad[0]);
+  return f;
+}
+
+double MassNLLGrad::DoDerivative(const double *x, unsigned int icoord) const {
+  // Minuit asks the components one by one at the same point, all are computed at the first call
+  if (lastX.size() != pars.size() || !equal(lastX.begin(), lastX.end(), x)) {
+    double f;
+    lastGrad.resize(pars.size());
+    FdF(x,f,&lastGrad[0]);
+    lastX.assign(x, x+pars.size());
+  }
+  return lastGrad[icoord];
+}
+
+void MassNLLGrad::FdF(const double *x, double &f, double *grad) const {
+  nCalls++;
+  for (unsigned int j=0; j<pars.size(); j++) pars[j]->setVal(x[j]);
+  for (unsigned int j=0; j<pars.size(); j++) grad[j] = 0;
+
+  sig->prepareGradient();
+  const double ns = nSig->getVal(), nb = nBkg ? nBkg->getVal() : 1-ns;
+  const double c = bkgCoef->getVal();
+  const double width = mmax-mmin;
+
+  // Background normalization and its derivative in the coefficient
+  double bkgNorm = width, dBkgNorm = 0;
+  if (bkgExp) {
+    if (fabs(c) > 1e-8) {
+      bkgNorm = (exp(c*mmax)-exp(c*mmin))/c;
+      dBkgNorm = (mmax*exp(c*mmax)-mmin*exp(c*mmin))/c - bkgNorm/c;
+    } else {
+      dBkgNorm = 0.5*(mmax*mmax-mmin*mmin);
+    }
+  }
+
+  double gs[RooCBGaussPdf::nPars];
+  double nll = 0, dNs = 0, dNb = 0, dCoef = 0;
+  vector<double> dSig(RooCBGaussPdf::nPars, 0.);
+  for (unsigned int i=0; i<mass.size(); i++) {
+    const double fs = sig->gradient(mass[i], gs);
+    double fb, dfb;
+    if (bkgExp) {
+      fb = exp(c*mass[i])/bkgNorm;
+      dfb = fb*(mass[i] - dBkgNorm/bkgNorm);
+    } else {
+      const double xc = (2*mass[i]-mmin-mmax)/width;
+      fb = (1+c*xc)/width;
+      dfb = xc/width;
+    }
+    const double mu = ns*fs + nb*fb;
+    if (!(mu > 0)) { f = 1e30; return; }  // negative density, Minuit steps back
+    const double r = weight[i]/mu;
+    nll -= weight[i]*log(mu);
+    for (int k=0; k<RooCBGaussPdf::nPars; k++) dSig[k] -= r*ns*gs[k];
+    dNs -= r*fs;
+    dNb -= r*fb;
+    dCoef -= r*nb*dfb;
+  }
+
+  if (nBkg) {
+    // Extended term, N(sig+bkg) - sumW*log(N) with the log taken into the sum above
+    nll += ns + nb;
+    dNs += 1;
+    dNb += 1;
+  } else {
+    dNs -= dNb;  // nb = 1-ns
+  }
+
+  for (int k=0; k<RooCBGaussPdf::nPars; k++) if (sigSlot[k] >= 0) grad[sigSlot[k]] += dSig[k];
+  if (bkgSlot >= 0) grad[bkgSlot] += dCoef;
+  if (nSigSlot >= 0) grad[nSigSlot] += dNs;
+  if (nBkgSlot >= 0) grad[nBkgSlot] += dNb;
+
+  for (unsigned int k=0; k<conSlot.size(); k++) {
+    const double pull = (x[conSlot[k]]-conMean[k])/conSigma[k];
+    nll += 0.5*pull*pull;
+    grad[conSlot[k]] += pull/conSigma[k];
+  }
+  f = nll;
+}
+
+bool gradientPreFit(RooAbsPdf *pdf, RooAbsData *data, RooLinkedList &cmdList) {
+  // Mass model SUM::(NSig*sig,NBkg*bkg) or SUM::(NSig*sig,bkg) with a RooCBGaussPdf signal
+  RooAddPdf *sum = dynamic_cast<RooAddPdf*>(pdf);
+  RooCBGaussPdf *sig = sum ? dynamic_cast<RooCBGaussPdf*>(sum->pdfList().at(0)) : 0;
+  if (sig == 0 || sum->pdfList().getSize() != 2) {
+    cout << "gradientPreFit:: " << pdf->GetName() << " is not a RooCBGaussPdf mass model, skipped" << endl;
+    return false;
+  }
+  RooAbsReal *nSig = (RooAbsReal*)sum->coefList().at(0);
+  RooAbsReal *nBkg = (sum->coefList().getSize() == 2) ? (RooAbsReal*)sum->coefList().at(1) : 0;
+
+  const RooArgSet *cons = 0;
+  bool extended = (nBkg != 0);
+  TIterator *it = cmdList.MakeIterator();
+  RooCmdArg *arg;
+  while ((arg = (RooCmdArg*)it->Next())) {
+    if (!strcmp(arg->GetName(),"ExternalConstraints")) cons = arg->getSet(0);
+    if (!strcmp(arg->GetName(),"Extended") && arg->getInt(0) == 0) extended = false;
+  }
+  delete it;
+  if (nBkg && !extended) {
+    cout << "gradientPreFit:: yields without extended term are not supported, skipped" << endl;
+    return false;
+  }
+
+  MassNLLGrad nll(sig, (RooAbsPdf*)sum->pdfList().at(1), nSig, nBkg, data, cons);
+  if (!nll.isValid()) {
+    cout << "gradientPreFit:: background or constraints of " << pdf->GetName() << " not supported, skipped" << endl;
+    return false;
+  }
+
+  ROOT::Math::Minimizer *minimizer = ROOT::Math::Factory::CreateMinimizer("Minuit2","Migrad");
+  if (minimizer == 0) minimizer = ROOT::Math::Factory::CreateMinimizer("Minuit","Migrad");
+  if (minimizer == 0) return false;
+  minimizer->SetFunction(nll);
+  minimizer->SetPrintLevel(0);
+  minimizer->SetErrorDef(0.5);
+  for (unsigned int j=0; j<nll.pars.size(); j++) {
+    RooRealVar *var = nll.pars[j];
+    double step = (var->getError() > 0) ? var->getError() : 0.01*(var->getMax()-var->getMin());
+    if (var->hasMin() && var->hasMax())
+      minimizer->SetLimitedVariable(j, var->GetName(), var->getVal(), step, var->getMin(), var->getMax());
+    else
+      minimizer->SetVariable(j, var->GetName(), var->getVal(), step);
+  }
+
+  vector<double> start;
+  for (unsigned int j=0; j<nll.pars.size(); j++) start.push_back(nll.pars[j]->getVal());
+
+  TStopwatch timer;
+  timer.Start();
+  bool ok = minimizer->Minimize();
+  timer.Stop();
+  cout << "gradientPreFit:: status " << minimizer->Status() << ", " << nll.nCalls << " NLL+gradient calls, CPU time "
+       << timer.CpuTime() << " s" << endl;
+
+  // Parameters are left at the minimum with Minuit's errors as step sizes for the RooFit fit,
+  // or back at the starting point if the minimization failed
+  const double *xMin = minimizer->X();
+  const double *errMin = minimizer->Errors();
+  for (unsigned int j=0; j<nll.pars.size(); j++) {
+    nll.pars[j]->setVal(ok ? xMin[j] : start[j]);
+    if (ok && errMin && errMin[j] > 0) nll.pars[j]->setError(errMin[j]);
+  }
+  delete minimizer;
+  return ok;
+}
+
+// Forked worker pool of the multi-bin driver, the ctau error table, the
+// simultaneous fits, the profile scans and the toy studies: jobs 0..nJobs-1
+// run in their own process, at most nWorkers at a time. The record of a job,
+// recSize doubles, comes back through a pipe. Returns the number of failed jobs.
+int runWorkers(WorkerJobs &jobs, int nJobs, int nWorkers, int recSize) {
+  if (nWorkers < 1) nWorkers = 1;
+  vector<double> rec(recSize+1, 0);
+  const ssize_t recBytes = recSize*sizeof(double);
+  map< pid_t, pair<int,int> > running;  // job and read end of its pipe
+  int nFailed = 0;
+  for (int i=0; i<=nJobs; i++) {
+    // Wait for a free worker, or for all of them after the last job
+    while ( (i<nJobs && (int)running.size() >= nWorkers) ||
+            (i==nJobs && !running.empty()) ) {
+      int status = 0;
+      pid_t pid = wait(&status);
+      if (pid < 0) { running.clear(); break; }
+      if (running.find(pid) == running.end()) continue;
+      const int iJob = running[pid].first, fd = running[pid].second;
+      running.erase(pid);
+      bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      if (ok && recSize > 0) ok = (read(fd, &rec[0], recBytes) == recBytes);
+      if (!ok) std::fill(rec.begin(), rec.end(), 0.0);
+      close(fd);
+      if (!ok) nFailed++;
+      jobs.done(iJob, &rec[0], ok);
+    }
+    if (i == nJobs) break;
+
+    int fd[2];
+    pid_t pid = -1;
+    if (pipe(fd) < 0) {
+      cout << "runWorkers:: Failed to open a pipe" << endl;
+    } else {
+      cout.flush();
+      pid = fork();
+      if (pid < 0) {
+        cout << "runWorkers:: Failed to fork" << endl;
+        close(fd[0]); close(fd[1]);
+      }
+    }
+    if (pid < 0) {
+      std::fill(rec.begin(), rec.end(), 0.0);
+      nFailed++;
+      jobs.done(i, &rec[0], false);
+    } else if (pid == 0) {
+      close(fd[0]);
+      bool ok = (jobs.run(i, &rec[0]) == 0);
+      if (ok && recSize > 0) ok = (write(fd[1], &rec[0], recBytes) == recBytes);
+      close(fd[1]);
+      cout.flush();
+      _exit(ok ? 0 : 1);
+    } else {
+      close(fd[1]);
+      running[pid] = make_pair(i, fd[0]);
+      jobs.started(i, pid);
+    }
+  }
+  return nFailed;
+}
+
+// Output of a forked worker goes to its own log file
+void redirectLog(const string &logName) {
+  int fd = open(logName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd >= 0) { dup2(fd,1); dup2(fd,2); close(fd); }
+}
+
+void workerFitArgs(RooLinkedList &cmdList, RooLinkedList &workerList) {
+  // Same likelihood as the fit of a stage, without the error analysis and the
+  // parallel likelihood evaluation: forked workers are already running in parallel
+  TIterator *it = cmdList.MakeIterator();
+  RooCmdArg *arg;
+  while ((arg = (RooCmdArg*)it->Next())) {
+    const char *name = arg->GetName();
+    if (!strcmp(name,"NumCPU") || !strcmp(name,"Save") || !strcmp(name,"SumW2Error") || !strcmp(name,"Minos") ||
+        !strcmp(name,"Hesse") || !strcmp(name,"PrintLevel") || !strcmp(name,"PrintEvalErrors")) continue;
+    workerList.Add(arg);
+  }
+  delete it;
+}
+
+// One point of a profile scan per job: minimum NLL and fit status
+struct ProfileJobs : public WorkerJobs {
+  RooAbsPdf *pdf;
+  RooAbsData *data;
+  RooArgSet *pars;
+  RooFitResult *best;
+  RooRealVar *par;        // scanned parameter
+  RooLinkedList *fitArgs;
+  vector<double> x, nll;
+  vector<int> status;
+
+  int run(int i, double *rec) {
+    restoreFitResult(pars, best);
+    par->setVal(x[i]);
+    par->setConstant(kTRUE);
+    RooFitResult *res = pdf->fitTo(*data, *fitArgs);
+    if (res == 0) return 1;
+    rec[0] = res->minNll();
+    rec[1] = res->status();
+    delete res;
+    return 0;
+  }
+  void done(int i, const double *rec, bool ok) {
+    nll[i] = rec[0];
+    status[i] = ok ? (int)rec[1] : -1;
+  }
+};
+
+// Profile likelihood of Bfrac, NSig and NBkg, those floating in the fit of best:
+// the fit is repeated with the parameter fixed at opt.profilePoints values within
+// 3 Hesse errors of the minimum, each one started from the minimum. Points are
+// fitted by opt.profileWorkers forked processes, which send back the minimum NLL
+// of each point. The intervals at deltaNLL = 0.5 and the scan curves are added
+// to opt.profileScan. On weighted samples the deltaNLL is rescaled by sum(w)/sum(w^2).
+void profileScan(RooAbsPdf *pdf, RooAbsData *data, const char *stage, RooFitResult *best, InputOpt &opt, RooLinkedList &cmdList) {
+  RooCmdArg saveArg = Save(kTRUE), hesseArg = Hesse(kFALSE), printArg = PrintLevel(-1), evalArg = PrintEvalErrors(-1);
+  RooLinkedList scanList;
+  workerFitArgs(cmdList, scanList);
+  scanList.Add(&saveArg);  scanList.Add(&hesseArg);
+  scanList.Add(&printArg); scanList.Add(&evalArg);
+
+  RooArgSet *pars = pdf->getParameters(*data);
+  const char *scanPars[] = {"Bfrac","NSig","NBkg"};
+  char line[512];
+
+  // The scan fits run without SumW2Error: on weighted samples the deltaNLL is
+  // rescaled by sum(w)/sum(w^2), so its 0.5 crossings match the SumW2 corrected errors
+  double nllScale = 1;
+  if (data->isWeighted()) {
+    double sumW2 = 0;
+    for (int i=0; i<data->numEntries(); i++) {
+      data->get(i);
+      sumW2 += data->weightSquared();
+    }
+    if (sumW2 > 0) nllScale = data->sumEntries()/sumW2;
+    cout << "profileScan:: " << stage << " : weighted sample, deltaNLL scaled by sum(w)/sum(w^2) = " << nllScale << endl;
+  }
+  sprintf(line,"nllScale %s %d %g\n",stage,(int)data->isWeighted(),nllScale);
+  opt.profileScan += line;
+  for (unsigned int ip=0; ip<sizeof(scanPars)/sizeof(scanPars[0]); ip++) {
+    RooRealVar *fitPar = (RooRealVar*)best->floatParsFinal().find(scanPars[ip]);
+    RooRealVar *par = (RooRealVar*)pars->find(scanPars[ip]);
+    if (fitPar == 0 || par == 0 || fitPar->getError() <= 0) continue;
+
+    const double val = fitPar->getVal(), err = fitPar->getError();
+    const double lo = std::max(val - 3*err, par->getMin()), hi = std::min(val + 3*err, par->getMax());
+    const int nPoints = opt.profilePoints;
+    ProfileJobs jobs;
+    jobs.pdf = pdf;
+    jobs.data = data;
+    jobs.pars = pars;
+    jobs.best = best;
+    jobs.par = par;
+    jobs.fitArgs = &scanList;
+    jobs.x.resize(nPoints);
+    jobs.nll.assign(nPoints, 0);
+    jobs.status.assign(nPoints, -1);
+    vector<double> &x = jobs.x, &nll = jobs.nll;
+    vector<int> &status = jobs.status;
+    for (int i=0; i<nPoints; i++) x[i] = (nPoints > 1) ? lo + (hi-lo)*i/(nPoints-1) : val;
+
+    TStopwatch timer;
+    timer.Start(kTRUE);
+    const int nWorkers = std::max(1, std::min(opt.profileWorkers, nPoints));
+    runWorkers(jobs, nPoints, nWorkers, 2);
+    timer.Stop();
+
+    // deltaNLL from the lowest minimum, the scan may find one slightly below the fit
+    double ref = best->minNll();
+    for (int i=0; i<nPoints; i++) if (status[i] == 0 && nll[i] < ref) ref = nll[i];
+    for (int i=0; i<nPoints; i++) nll[i] = ref + nllScale*(nll[i] - ref);
+    const double bestDelta = nllScale*(best->minNll() - ref);
+
+    // Crossings of 0.5 on both sides of the minimum, interpolated linearly; the
+    // scan edge is given if it is not reached there
+    double xLo = lo, xHi = hi;
+    double xPrev = val, dPrev = bestDelta;
+    for (int i=nPoints-1; i>=0; i--) {
+      if (x[i] >= val || status[i] != 0) continue;
+      double d = nll[i] - ref;
+      if (d >= 0.5) { xLo = x[i] + (xPrev-x[i])*(d-0.5)/(d-dPrev); break; }
+      xPrev = x[i]; dPrev = d;
+    }
+    xPrev = val; dPrev = bestDelta;
+    for (int i=0; i<nPoints; i++) {
+      if (x[i] <= val || status[i] != 0) continue;
+      double d = nll[i] - ref;
+      if (d >= 0.5) { xHi = xPrev + (x[i]-xPrev)*(0.5-dPrev)/(d-dPrev); break; }
+      xPrev = x[i]; dPrev = d;
+    }
+
+    cout << "profileScan:: " << stage << " " << scanPars[ip] << " : " << val << " -" << val-xLo << " +" << xHi-val
+         << " (Hesse " << err << "), " << nPoints << " points with " << nWorkers << " workers, real time " << timer.RealTime() << " s" << endl;
+    sprintf(line,"interval %s %s %g %g %g %g\n",stage,scanPars[ip],val,xLo,xHi,err);
+    opt.profileScan += line;
+    for (int i=0; i<nPoints; i++) {
+      sprintf(line,"point %s %s %g %g %d\n",stage,scanPars[ip],x[i],nll[i]-ref,status[i]);
+      opt.profileScan += line;
+    }
+  }
+
+  // Parameters of the parent are untouched, the fits ran in the workers
+  delete pars;
+}
+
+// One pseudo-experiment per job: fit status, then value and error of each parameter
+struct ToyJobs : public WorkerJobs {
+  RooAbsPdf *pdf;
+  RooDataHist *hist;      // binning of the stage, 0: unbinned fits
+  RooDataSet *proto;      // conditional observables, 0: none
+  RooArgSet *genVars;
+  RooArgSet *pars;
+  RooFitResult *best;
+  RooLinkedList *fitArgs;
+  double expected;
+  ULong64_t seedHash;
+  const char **toyPars;
+  int nToyPars;
+  vector<double> toyVal, toyErr;
+  vector<int> status;
+
+  int run(int i, double *rec) {
+    ULong64_t h = hashBytes(&i, sizeof(i), seedHash);
+    UInt_t seed = (UInt_t)(h ^ (h >> 32));
+    RooRandom::randomGenerator()->SetSeed(seed ? seed : 1);
+
+    restoreFitResult(pars, best);
+    int nEvents = RooRandom::randomGenerator()->Poisson(expected);
+    RooDataSet *toy = 0;
+    if (proto) toy = pdf->generate(*genVars, ProtoData(*proto, kTRUE, kTRUE), NumEvents(nEvents));
+    else toy = pdf->generate(*genVars, NumEvents(nEvents));
+    if (toy == 0) return 1;
+
+    RooAbsData *toyData = toy;
+    if (hist) {
+      // Binned as the sample of the stage
+      RooDataHist *toyHist = (RooDataHist*)hist->Clone("toyHist");
+      toyHist->reset();
+      toyHist->add(*toy);
+      toyData = toyHist;
+    }
+    RooFitResult *res = pdf->fitTo(*toyData, *fitArgs);
+    if (res) {
+      rec[0] = res->status();
+      for (int ip=0; ip<nToyPars; ip++) {
+        RooRealVar *fitPar = (RooRealVar*)res->floatParsFinal().find(toyPars[ip]);
+        if (fitPar == 0) continue;
+        rec[1+2*ip] = fitPar->getVal();
+        rec[2+2*ip] = fitPar->getError();
+      }
+      delete res;
+    }
+    if (toyData != toy) delete toyData;
+    delete toy;
+    return res ? 0 : 1;
+  }
+  void done(int i, const double *rec, bool ok) {
+    status[i] = ok ? (int)rec[0] : -1;
+    for (int ip=0; ip<nToyPars; ip++) {
+      toyVal[i*nToyPars+ip] = rec[1+2*ip];
+      toyErr[i*nToyPars+ip] = rec[2+2*ip];
+    }
+  }
+};
+
+// Pseudo-experiments of one fit stage: opt.nToys samples are generated from the
+// fitted pdf, with a Poisson number of events around the fitted yield (or the
+// sample size if the fit is not extended) and the conditional observables of
+// the fit (Jpsi_CtErr in PEE fits) resampled from the data. Each one is fitted
+// with the arguments of the stage, from the generating values. Toys are fitted
+// by opt.toyWorkers forked processes; the seed of a toy depends only on
+// opt.toySeed, the bin, the stage and its number, so results do not depend on
+// the number of workers. Pulls of Bfrac, NSig and NBkg, those floating in the
+// fit, are added to opt.toyStudy.
+void toyStudy(RooAbsPdf *pdf, RooDataSet *ds, RooDataHist *hist, const char *stage, RooFitResult *best, InputOpt &opt, RooLinkedList &cmdList) {
+  // Unweighted toys: the SumW2 correction of the stage is dropped, Hesse errors are kept for the pulls
+  RooCmdArg saveArg = Save(kTRUE), hesseArg = Hesse(kTRUE), printArg = PrintLevel(-1), evalArg = PrintEvalErrors(-1);
+  RooLinkedList toyList;
+  workerFitArgs(cmdList, toyList);
+  toyList.Add(&saveArg);  toyList.Add(&hesseArg);
+  toyList.Add(&printArg); toyList.Add(&evalArg);
+
+  // Generated observables, and conditional ones taken from the data
+  RooArgSet *obs = pdf->getObservables(*ds);
+  RooArgSet genVars(*obs), condVars;
+  bool extended = pdf->canBeExtended();
+  TIterator *it = cmdList.MakeIterator();
+  RooCmdArg *arg;
+  while ((arg = (RooCmdArg*)it->Next())) {
+    if (!strcmp(arg->GetName(),"ConditionalObservables") && arg->getSet(0)) condVars.add(*arg->getSet(0));
+    if (!strcmp(arg->GetName(),"Extended") && arg->getInt(0) == 0) extended = false;
+  }
+  delete it;
+  genVars.remove(condVars, kTRUE, kTRUE);
+  RooDataSet *proto = 0;
+  if (condVars.getSize() > 0) proto = (RooDataSet*)ds->reduce(SelectVars(condVars), Name("toyProto"));
+  const double expected = extended ? pdf->expectedEvents(&genVars) : ds->sumEntries();
+
+  RooArgSet *pars = pdf->getParameters(*ds);
+  const char *toyPars[] = {"Bfrac","NSig","NBkg"};
+  const int nToyPars = sizeof(toyPars)/sizeof(toyPars[0]);
+  RooRealVar *genPar[nToyPars];
+  for (int ip=0; ip<nToyPars; ip++) genPar[ip] = (RooRealVar*)best->floatParsFinal().find(toyPars[ip]);
+
+  ULong64_t seedHash = hashBytes(&opt.toySeed, sizeof(opt.toySeed), 14695981039346656037ULL);
+  seedHash = hashString("rap" + opt.yrange + "_pT" + opt.prange + "_cent" + opt.crange + "_dPhi" + opt.phirange, seedHash);
+  seedHash = hashString(stage, seedHash);
+
+  const int nToys = opt.nToys;
+  ToyJobs jobs;
+  jobs.pdf = pdf;
+  jobs.hist = hist;
+  jobs.proto = proto;
+  jobs.genVars = &genVars;
+  jobs.pars = pars;
+  jobs.best = best;
+  jobs.fitArgs = &toyList;
+  jobs.expected = expected;
+  jobs.seedHash = seedHash;
+  jobs.toyPars = toyPars;
+  jobs.nToyPars = nToyPars;
+  jobs.toyVal.assign(nToys*nToyPars, 0);
+  jobs.toyErr.assign(nToys*nToyPars, 0);
+  jobs.status.assign(nToys, -1);
+  const vector<double> &toyVal = jobs.toyVal, &toyErr = jobs.toyErr;
+  const vector<int> &status = jobs.status;
+
+  TStopwatch timer;
+  timer.Start(kTRUE);
+  const int nWorkers = std::max(1, std::min(opt.toyWorkers, nToys));
+  runWorkers(jobs, nToys, nWorkers, 1 + 2*nToyPars);
+  timer.Stop();
+
+  // Pull mean and width over the converged toys, with their statistical errors
+  char line[512];
+  int nConverged = 0;
+  for (int i=0; i<nToys; i++) if (status[i] == 0) nConverged++;
+  cout << "toyStudy:: " << stage << " : " << nConverged << "/" << nToys << " converged toys with " << nWorkers
+       << " workers, real time " << timer.RealTime() << " s" << endl;
+  for (int ip=0; ip<nToyPars; ip++) {
+    if (genPar[ip] == 0) continue;
+    const double gen = genPar[ip]->getVal();
+    double sum = 0, sum2 = 0;
+    int n = 0;
+    for (int i=0; i<nToys; i++) {
+      double err = toyErr[i*nToyPars+ip];
+      if (status[i] != 0 || err <= 0) continue;
+      double pull = (toyVal[i*nToyPars+ip] - gen)/err;
+      sum += pull; sum2 += pull*pull; n++;
+    }
+    double mean = (n > 0) ? sum/n : 0;
+    double width = (n > 1) ? sqrt(std::max(0.0, (sum2 - n*mean*mean)/(n-1))) : 0;
+    double meanErr = (n > 0) ? width/sqrt((double)n) : 0;
+    double widthErr = (n > 1) ? width/sqrt(2.0*(n-1)) : 0;
+    cout << "toyStudy:: " << stage << " " << toyPars[ip] << " : pull mean " << mean << " +/- " << meanErr
+         << ", width " << width << " +/- " << widthErr << " (" << n << " toys)" << endl;
+    sprintf(line,"summary %s %s %g %d %d %g %g %g %g\n",stage,toyPars[ip],gen,nToys,n,mean,meanErr,width,widthErr);
+    opt.toyStudy += line;
+  }
+  for (int i=0; i<nToys; i++) {
+    for (int ip=0; ip<nToyPars; ip++) {
+      if (genPar[ip] == 0) continue;
+      double err = toyErr[i*nToyPars+ip];
+      double pull = (err > 0) ? (toyVal[i*nToyPars+ip] - genPar[ip]->getVal())/err : 0;
+      sprintf(line,"toy %s %d %d %s %g %g %g\n",stage,i,status[i],toyPars[ip],toyVal[i*nToyPars+ip],err,pull);
+      opt.toyStudy += line;
+    }
+  }
+
+  delete pars;
+  delete proto;
+  delete obs;
+}
+
+ULong64_t hashBytes(const void *buf, size_t len, ULong64_t h) {
+  // FNV-1a
+  const unsigned char *bytes = (const unsigned char*)buf;
+  for (size_t i=0; i<len; i++) {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+ULong64_t hashString(const string &str, ULong64_t h) {
+  return hashBytes(str.c_str(), str.size(), h);
+}
+
+ULong64_t hashDataset(RooAbsData *ds, ULong64_t h) {
+  // Every value and weight of every entry, in order
+  Int_t nEntries = ds->numEntries();
+  h = hashBytes(&nEntries, sizeof(nEntries), h);
+  if (nEntries == 0) return h;
+
+  const RooArgSet *row = ds->get(0);
+  TIterator *it = row->createIterator();
+  for (Int_t iEntry=0; iEntry<nEntries; iEntry++) {
+    ds->get(iEntry);
+    it->Reset();
+    RooAbsArg *arg;
+    while ((arg = (RooAbsArg*)it->Next())) {
+      RooAbsReal *var = dynamic_cast<RooAbsReal*>(arg);
+      if (var == 0) continue;
+      double val = var->getVal();
+      h = hashBytes(&val, sizeof(val), h);
+    }
+    double wgt = ds->weight();
+    h = hashBytes(&wgt, sizeof(wgt), h);
+  }
+  delete it;
+  return h;
+}
+
+ULong64_t hashArgs(const RooAbsCollection &args, ULong64_t h) {
+  // Names, values, limits and constant flags
+  TIterator *it = args.createIterator();
+  RooAbsArg *arg;
+  while ((arg = (RooAbsArg*)it->Next())) {
+    h = hashString(arg->GetName(), h);
+    RooAbsReal *real = dynamic_cast<RooAbsReal*>(arg);
+    if (real == 0) continue;
+    double val = real->getVal();
+    h = hashBytes(&val, sizeof(val), h);
+    RooRealVar *var = dynamic_cast<RooRealVar*>(arg);
+    if (var == 0) continue;
+    double lim[2] = {var->getMin(), var->getMax()};
+    bool isConst = var->isConstant();
+    h = hashBytes(lim, sizeof(lim), h);
+    h = hashBytes(&isConst, sizeof(isConst), h);
+  }
+  delete it;
+  return h;
+}
+
+string optionTag(InputOpt &opt) {
+  // Model choices only: samples, constant flags and starting values enter the key through their hashes,
+  // so systematic variations sharing a stage also share its cached result
+  char tag[1024];
+  sprintf(tag,"%s %s %d %d %d %d %d %d %d %d %d %d %d",
+      opt.mSigFunct.c_str(), opt.mBkgFunct.c_str(), opt.isPbPb, opt.isPEE, opt.is2Widths, opt.ctauBackground,
+      (int)opt.analyticBlifetime, (int)opt.useWeightedNP, (int)opt.oneGaussianResol,
+      opt.binnedFit, opt.nMassBins, opt.nCtBins, opt.nCtErrBins);
+  // Approximations of the non-prompt convolution change the results, the default tag stays as it was
+  if (opt.erfcStep > 0) sprintf(tag+strlen(tag)," erfc %g",opt.erfcStep);
+  if (opt.gridNU > 1) sprintf(tag+strlen(tag)," grid %d %d %g %g",opt.gridNU,opt.gridNS,opt.gridSMin,opt.gridSMax);
+  if (!opt.fftKeys) strcat(tag," rooKeys");
+  char hex[32];
+  sprintf(hex,"%016llx",(unsigned long long)hashString(tag,14695981039346656037ULL));
+  return hex;
+}
+
+string fitCacheName(RooAbsPdf *pdf, RooDataSet *ds, RooArgSet *pars, const char *stage, InputOpt &opt, RooLinkedList &cmdList) {
+  string optTag = optionTag(opt);
+  string binTag = "rap" + opt.yrange + "_pT" + opt.prange + "_cent" + opt.crange + "_dPhi" + opt.phirange;
+
+  ULong64_t h = 14695981039346656037ULL;
+  h = hashString(optTag, h);
+  h = hashString(binTag, h);
+  h = hashString(stage, h);
+  h = hashDataset(ds, h);
+  h = hashArgs(*pars, h);
+  // The MC samples shape the templates and resolution of the model without entering ds or pars
+  h = hashString(opt.FileNameMC1, h);
+  h = hashString(opt.FileNameMC2, h);
+
+  // Fit arguments: constraint values and named fit ranges are part of the key
+  RooArgSet *obs = pdf->getObservables(*ds);
+  TIterator *it = cmdList.MakeIterator();
+  RooCmdArg *cmd;
+  while ((cmd = (RooCmdArg*)it->Next())) {
+    h = hashString(cmd->GetName(), h);
+    int ints[2] = {cmd->getInt(0), cmd->getInt(1)};
+    h = hashBytes(ints, sizeof(ints), h);
+    if (cmd->getString(0) && cmd->getString(0)[0]) {
+      h = hashString(cmd->getString(0), h);
+      TIterator *itObs = obs->createIterator();
+      RooAbsArg *arg;
+      while ((arg = (RooAbsArg*)itObs->Next())) {
+        RooRealVar *var = dynamic_cast<RooRealVar*>(arg);
+        if (var == 0 || !var->hasRange(cmd->getString(0))) continue;
+        double lim[2] = {var->getMin(cmd->getString(0)), var->getMax(cmd->getString(0))};
+        h = hashBytes(lim, sizeof(lim), h);
+      }
+      delete itObs;
+    }
+    const RooArgSet *cons = cmd->getSet(0);
+    if (cons && (!strcmp(cmd->GetName(),"ConditionalObservables") || !strcmp(cmd->GetName(),"ProjectedObservables"))) {
+      // Observables: their names only, the current value of an observable says nothing about the fit
+      TIterator *itCons = cons->createIterator();
+      RooAbsArg *con;
+      while ((con = (RooAbsArg*)itCons->Next())) h = hashString(con->GetName(), h);
+      delete itCons;
+    } else if (cons) {
+      TIterator *itCons = cons->createIterator();
+      RooAbsArg *con;
+      while ((con = (RooAbsArg*)itCons->Next())) {
+        RooArgSet leaves;
+        con->leafNodeServerList(&leaves);
+        h = hashArgs(leaves, h);
+      }
+      delete itCons;
+    }
+  }
+  delete it;
+  delete obs;
+
+  char key[32];
+  sprintf(key,"%016llx",(unsigned long long)h);
+  return opt.fitCacheDir + "/" + stage + "_" + optTag + "_" + binTag + "_" + key + ".root";
+}
+
+TObject* readCacheObject(const string &fileName, const char *objName) {
+  if (gSystem->AccessPathName(fileName.c_str())) return 0;  // no such file
+  TFile fIn(fileName.c_str());
+  if (fIn.IsZombie()) return 0;
+  TObject *obj = fIn.Get(objName);
+  if (obj) obj = obj->Clone();
+  fIn.Close();
+  return obj;
+}
+
+void writeCacheObject(const string &fileName, TObject *obj, const char *objName) {
+  // Written under a temporary name, so that parallel workers never read a partial file
+  char tmpName[4096];
+  sprintf(tmpName,"%s.%d.tmp",fileName.c_str(),(int)getpid());
+  TFile fOut(tmpName,"RECREATE");
+  if (fOut.IsZombie()) { cout << "writeCacheObject:: Fail to open " << tmpName << endl; return; }
+  obj->Write(objName);
+  fOut.Close();
+  gSystem->Rename(tmpName,fileName.c_str());
+}
+
+RooFitResult* readFitCache(const string &fileName) {
+  return (RooFitResult*)readCacheObject(fileName,"fitResult");
+}
+
+void writeFitCache(const string &fileName, RooFitResult *res) {
+  writeCacheObject(fileName,res,"fitResult");
+}
+
+string npTemplateName(RooWorkspace *ws, RooDataSet *redMCCutNP, const char *type, InputOpt &opt) {
+  // The NP MC is not cut on centrality, so all centrality bins of a rap/pT/dPhi bin share one template
+  if (opt.templateCacheDir.empty()) return "";
+
+  ULong64_t h = hashDataset(redMCCutNP, 14695981039346656037ULL);
+  h = hashString(type, h);
+  h = hashString(opt.rpmethod, h);
+  RooRealVar *ct = ws->var("Jpsi_Ct"), *ctTrue = ws->var("Jpsi_CtTrue");
+  double lim[4] = {ct->getMin(), ct->getMax(), ctTrue->getMin(), ctTrue->getMax()};
+  int nbins[2] = {ct->getBins(), ctTrue->getBins()};
+  h = hashBytes(lim, sizeof(lim), h);
+  h = hashBytes(nbins, sizeof(nbins), h);
+
+  char name[4096];
+  sprintf(name,"%s/npTemplate_%s_rap%s_pT%s_dPhi%s_err%.3f-%.3f_%016llx.root",
+      opt.templateCacheDir.c_str(), type, opt.yrange.c_str(), opt.prange.c_str(), opt.phirange.c_str(),
+      ws->var("Jpsi_CtErr")->getMin(), ws->var("Jpsi_CtErr")->getMax(), (unsigned long long)h);
+  return name;
+}
+
+void restoreFitResult(RooArgSet *pars, RooFitResult *res) {
+  const RooArgList &fin = res->floatParsFinal();
+  for (Int_t i=0; i<fin.getSize(); i++) {
+    RooRealVar *src = (RooRealVar*)fin.at(i);
+    RooRealVar *dst = (RooRealVar*)pars->find(src->GetName());
+    if (dst == 0) continue;
+    dst->setVal(src->getVal());
+    dst->setError(src->getError());
+    if (src->hasAsymError()) dst->setAsymError(src->getAsymErrorLo(),src->getAsymErrorHi());
+  }
+}
+
+bool warmStartFit(RooArgSet *pars, const char *stage, InputOpt &opt) {
+  // Same stage and options, nearest bin centre (pT, y, centrality, dPhi scaled to their full ranges)
+  string prefix = string(stage) + "_" + optionTag(opt) + "_";
+  double ymin=0, ymax=0, pmin=0, pmax=0, cmin=0, cmax=0, psmin=0, psmax=0;
+  getOptRange(opt.yrange,&ymin,&ymax);
+  getOptRange(opt.prange,&pmin,&pmax);
+  getOptRange(opt.crange,&cmin,&cmax);
+  getOptRange(opt.phirange,&psmin,&psmax);
+
+  void *dir = gSystem->OpenDirectory(opt.fitCacheDir.c_str());
+  if (dir == 0) return false;
+  string bestName;
+  double bestDist = 1e30;
+  const char *entry;
+  while ((entry = gSystem->GetDirEntry(dir))) {
+    string name = entry;
+    if (name.compare(0,prefix.size(),prefix) || name.size() < 5 || name.compare(name.size()-5,5,".root")) continue;
+    double y0=0, y1=0, p0=0, p1=0, c0=0, c1=0, s0=0, s1=0;
+    if (sscanf(name.c_str()+prefix.size(),"rap%lf-%lf_pT%lf-%lf_cent%lf-%lf_dPhi%lf-%lf",&y0,&y1,&p0,&p1,&c0,&c1,&s0,&s1) != 8) continue;
+    double dist = TMath::Abs(0.5*(y0+y1-ymin-ymax))/2.4 + TMath::Abs(0.5*(p0+p1-pmin-pmax))/30. +
+                  TMath::Abs(0.5*(c0+c1-cmin-cmax))/100. + TMath::Abs(0.5*(s0+s1-psmin-psmax))/1.571;
+    if (dist < bestDist) { bestDist = dist; bestName = name; }
+  }
+  gSystem->FreeDirectory(dir);
+  if (bestName.empty()) return false;
+
+  RooFitResult *res = readFitCache(opt.fitCacheDir + "/" + bestName);
+  if (res == 0) return false;
+  // Only floating parameters are moved, and only inside their current limits
+  const RooArgList &fin = res->floatParsFinal();
+  for (Int_t i=0; i<fin.getSize(); i++) {
+    RooRealVar *src = (RooRealVar*)fin.at(i);
+    RooRealVar *dst = (RooRealVar*)pars->find(src->GetName());
+    if (dst == 0 || dst->isConstant()) continue;
+    if (src->getVal() > dst->getMin() && src->getVal() < dst->getMax()) dst->setVal(src->getVal());
+  }
+  cout << "warmStartFit:: " << stage << " : starting values from " << bestName << endl;
+  delete res;
+  return true;
+}
+
+RooDataSet* loadColumnSample(const string &fileName, const char *dsName, const char *name) {
+  // 0 if the dataset makers wrote no column file for this sample
+  string colsName = columnFileName(fileName, dsName);
+  ColumnStore store;
+  if (openColumnStore(colsName, store) != 0) return 0;
+  RooDataSet *ds = columnStoreSkeleton(store, name);
+  sampleColumns[ds] = store;
+  cout << "## " << name << ": " << store.nRows << " candidates mapped from " << colsName << endl;
+  return ds;
+}
+
+int checkColumnSample(RooDataSet *colSample, RooDataSet *ds, InputOpt &opt, bool cutCent) {
+  // Number of bins of -n (or the -p -y -t -s bin) whose rows differ between
+  // the column file and the RooDataSet, in entry numbers, values or weights
+  if (ds == 0 || !sampleColumns.count(colSample)) {
+    cout << "checkColumnSample:: " << colSample->GetName() << " has no column file and RooDataSet to compare" << endl;
+    return 1;
+  }
+  vector<BinOpt> bins;
+  if (!opt.binList.empty()) {
+    vector< vector<BinOpt> > stages;
+    if (readBinList(opt, stages) < 0) return 1;
+    for (unsigned int i=0; i<stages.size(); i++) bins.insert(bins.end(), stages[i].begin(), stages[i].end());
+  } else {
+    BinOpt bin;
+    bin.yrange = opt.yrange; bin.prange = opt.prange; bin.crange = opt.crange; bin.phirange = opt.phirange;
+    bins.push_back(bin);
+  }
+
+  vector< vector<int> > idxCols, idxDs;
+  partitionDataset(colSample, bins, opt, cutCent, idxCols);
+  partitionDataset(ds, bins, opt, cutCent, idxDs);
+  int nBad = 0;
+  for (unsigned int i=0; i<bins.size(); i++) {
+    string work = "_rap" + bins[i].yrange + "_pT" + bins[i].prange + "_cent" + bins[i].crange + "_dPhi" + bins[i].phirange;
+    bool same = (idxCols[i] == idxDs[i]);
+    if (same) {
+      RooDataSet *subCols = selectEntries(colSample, idxCols[i]);
+      RooDataSet *subDs = selectEntries(ds, idxDs[i]);
+      for (Int_t iEntry=0; iEntry<subDs->numEntries() && same; iEntry++) {
+        const RooArgSet *rowDs = subDs->get(iEntry);
+        const RooArgSet *rowCols = subCols->get(iEntry);
+        same = (subDs->weight() == subCols->weight());
+        TIterator *it = rowDs->createIterator();
+        RooAbsArg *arg;
+        while (same && (arg = (RooAbsArg*)it->Next())) {
+          RooRealVar *var = dynamic_cast<RooRealVar*>(arg);
+          RooRealVar *varCols = (RooRealVar*)rowCols->find(arg->GetName());
+          if (var) same = (varCols != 0 && varCols->getVal() == var->getVal());
+        }
+        delete it;
+      }
+      delete subCols;
+      delete subDs;
+    }
+    cout << "checkColumnSample:: " << colSample->GetName() << work << " : " << idxCols[i].size() << " / " << idxDs[i].size()
+         << " entries " << (same ? "identical" : "DIFFER") << endl;
+    if (!same) nBad++;
+  }
+  return nBad;
+}
+
+double roundCut(double val, int digits) {
+  // Same rounding as the %.Nf of the cut strings printed in the logs
+  char tmp[64];
+  sprintf(tmp,"%.*f",digits,val);
+  return atof(tmp);
+}
+
+void partitionDataset(RooDataSet *ds, const vector<BinOpt> &bins, InputOpt &opt, bool cutCent, vector< vector<int> > &index) {
+  // Same ranges as the reduceDS strings, one pass over ds for all bins
+  double lmin=0, lmax=0;
+  getOptRange(opt.lrange,&lmin,&lmax);
+  double ctmin = roundCut(-lmin,2), ctmax = roundCut(lmax,2);
+
+  vector<double> pmins, pmaxs, ymins, ymaxs, cmins, cmaxs, psmins, psmaxs;
+  for (unsigned int i=0; i<bins.size(); i++) {
+    double pmin=0, pmax=0, ymin=0, ymax=0, cmin=0, cmax=0, psmin=0, psmax=0;
+    string prange = bins[i].prange, yrange = bins[i].yrange, crange = bins[i].crange, phirange = bins[i].phirange;
+    getOptRange(prange,&pmin,&pmax);
+    getOptRange(yrange,&ymin,&ymax);
+    getOptRange(crange,&cmin,&cmax);
+    getOptRange(phirange,&psmin,&psmax);
+    if (!opt.rpmethod.compare("etHFp")) {
+      double tmp = ymin;
+      ymin = -ymax; ymax = -tmp;
+    }
+    pmins.push_back(roundCut(pmin,2));   pmaxs.push_back(roundCut(pmax,2));
+    ymins.push_back(roundCut(ymin,2));   ymaxs.push_back(roundCut(ymax,2));
+    cmins.push_back(roundCut(cmin,1));   cmaxs.push_back(roundCut(cmax,1));
+    psmins.push_back(roundCut(psmin,3)); psmaxs.push_back(roundCut(psmax,3));
+  }
+  BinAxis ptAxis, yAxis, centAxis, phiAxis;
+  ptAxis.build(pmins,pmaxs);
+  yAxis.build(ymins,ymaxs);
+  centAxis.build(cmins,cmaxs);
+  phiAxis.build(psmins,psmaxs);
+  bool absY = opt.rpmethod.compare("etHFm") && opt.rpmethod.compare("etHFp");
+
+  index.assign(bins.size(), vector<int>());
+  // Column file: only the five columns of the cuts are paged in
+  map<const RooAbsData*, ColumnStore>::const_iterator itCols = sampleColumns.find(ds);
+  const ColumnStore *cols = (itCols != sampleColumns.end()) ? &(itCols->second) : 0;
+  Int_t nEntries = cols ? (Int_t)cols->nRows : ds->numEntries();
+  if (nEntries == 0) return;
+
+  RooRealVar *pt = 0, *y = 0, *ct = 0, *dphi = 0, *cent = 0;
+  const Double_t *ptCol = 0, *yCol = 0, *ctCol = 0, *dphiCol = 0, *centCol = 0;
+  if (cols) {
+    ptCol = cols->column("Jpsi_Pt");
+    yCol = cols->column("Jpsi_Y");
+    ctCol = cols->column("Jpsi_Ct");
+    dphiCol = cols->column("Jpsi_dPhi");
+    centCol = cols->column("Centrality");
+    if (ptCol == 0 || yCol == 0 || ctCol == 0 || dphiCol == 0) {
+      cout << "partitionDataset:: column file of " << ds->GetName() << " misses a bin variable" << endl;
+      return;
+    }
+  } else {
+    // The row returned by get(i) is the same object for every entry
+    const RooArgSet *row = ds->get(0);
+    pt = (RooRealVar*)row->find("Jpsi_Pt");
+    y = (RooRealVar*)row->find("Jpsi_Y");
+    ct = (RooRealVar*)row->find("Jpsi_Ct");
+    dphi = (RooRealVar*)row->find("Jpsi_dPhi");
+    cent = (RooRealVar*)row->find("Centrality");
+  }
+  if (cutCent && cent == 0 && centCol == 0) {
+    cout << "partitionDataset:: " << ds->GetName() << " has no Centrality" << endl;
+    return;
+  }
+
+  for (Int_t iEntry=0; iEntry<nEntries; iEntry++) {
+    if (!cols) ds->get(iEntry);
+    double ctVal = cols ? ctCol[iEntry] : ct->getVal();
+    if (ctVal < ctmin || ctVal >= ctmax) continue;
+    int kp = ptAxis.cell(cols ? ptCol[iEntry] : pt->getVal());
+    if (kp < 0) continue;
+    double yVal = cols ? yCol[iEntry] : y->getVal();
+    int ky = yAxis.cell(absY ? TMath::Abs(yVal) : yVal);
+    if (ky < 0) continue;
+    int kphi = phiAxis.cell(cols ? dphiCol[iEntry] : dphi->getVal());
+    if (kphi < 0) continue;
+    int kc = cutCent ? centAxis.cell(cols ? centCol[iEntry] : cent->getVal()) : 0;
+    if (kc < 0) continue;
+
+    for (unsigned int i=0; i<bins.size(); i++) {
+      if (ptAxis.contains(i,kp) && yAxis.contains(i,ky) && phiAxis.contains(i,kphi) &&
+          (!cutCent || centAxis.contains(i,kc)))
+        index[i].push_back(iEntry);
+    }
+  }
+}
+
+void partitionSamples(RooDataSet *data, RooDataSet *dataMC, RooDataSet *dataMC2, const vector<BinOpt> &bins, InputOpt &opt, vector<BinIndex> &index) {
+  // MC samples are not cut on centrality
+  vector< vector<int> > idxData, idxMC, idxMC2;
+  partitionDataset(data, bins, opt, true, idxData);
+  partitionDataset(dataMC, bins, opt, false, idxMC);
+  partitionDataset(dataMC2, bins, opt, false, idxMC2);
+
+  index.assign(bins.size(), BinIndex());
+  for (unsigned int i=0; i<bins.size(); i++) {
+    index[i].data.swap(idxData[i]);
+    index[i].dataMC.swap(idxMC[i]);
+    index[i].dataMC2.swap(idxMC2[i]);
+  }
+}
+
+RooDataSet* selectEntries(RooDataSet *ds, const vector<int> &index) {
+  // Rows of a column file sample are copied from the columns, nothing else is touched
+  map<const RooAbsData*, ColumnStore>::const_iterator itCols = sampleColumns.find(ds);
+  if (itCols != sampleColumns.end()) return columnStoreRows(itCols->second, ds, index);
+
+  // Keeps the name, variables and weights of ds, as reduce() does
+  RooDataSet *sub = (RooDataSet*)ds->emptyClone();
+  for (unsigned int i=0; i<index.size(); i++) {
+    const RooArgSet *row = ds->get(index[i]);
+    sub->add(*row, ds->weight());
+  }
+  return sub;
+}
+
+RooDataSet* selectCtErr(RooDataSet *ds, double errmin, double errmax) {
+  double emin = roundCut(errmin,3), emax = roundCut(errmax,3);
+  vector<int> index;
+  if (ds->numEntries() > 0) {
+    RooRealVar *ctErr = (RooRealVar*)ds->get(0)->find("Jpsi_CtErr");
+    for (Int_t iEntry=0; iEntry<ds->numEntries(); iEntry++) {
+      ds->get(iEntry);
+      if (ctErr->getVal() >= emin && ctErr->getVal() < emax) index.push_back(iEntry);
+    }
+  }
+  return selectEntries(ds, index);
+}
+
+// Expected counts: the pdf is integrated over its observables other than x and
+// the columns of projData, and averaged over the entries of projData (the
+// ctau error distribution for the per-event error models), as ProjWData does
+// for the curves. The density is integrated over each bin with nSub midpoints
+// and scaled to norm events in the range of x.
+void binnedGOF(RooAbsPdf *pdf, RooRealVar *x, const RooAbsBinning &bins, RooDataSet *data, RooDataHist *projData, double norm, BinnedGOF &gof, int nSub) {
+  const int nBins = bins.numBins();
+  gof.lo.resize(nBins); gof.hi.resize(nBins);
+  gof.data.assign(nBins,0); gof.err2.assign(nBins,0); gof.expected.assign(nBins,0);
+  gof.pull.assign(nBins,0); gof.resid.assign(nBins,0);
+  gof.chi2 = 0; gof.nFullBins = 0;
+  for (int i=0; i<nBins; i++) { gof.lo[i] = bins.binLow(i); gof.hi[i] = bins.binHigh(i); }
+
+  RooRealVar *xData = (RooRealVar*)data->get()->find(x->GetName());
+  for (Int_t iEntry=0; iEntry<data->numEntries(); iEntry++) {
+    data->get(iEntry);
+    double val = xData->getVal();
+    if (val < bins.lowBound() || val >= bins.highBound()) continue;
+    int i = bins.binNumber(val);
+    double w = data->weight();
+    gof.data[i] += w;
+    gof.err2[i] += w*w;
+  }
+
+  RooArgSet *obs = pdf->getObservables(*data);
+  RooArgSet *saved = (RooArgSet*)obs->snapshot();
+  x = (RooRealVar*)obs->find(x->GetName());  // the pdf's own copy
+  RooArgSet intObs(*obs);
+  intObs.remove(*x,kTRUE,kTRUE);
+  if (projData) intObs.remove(*(projData->get()),kTRUE,kTRUE);
+  RooAbsPdf *marg = (intObs.getSize() > 0) ? pdf->createProjection(intObs) : pdf;
+  RooArgSet normSet(*x);
+
+  double sumW = 0;
+  const int nProj = projData ? projData->numEntries() : 1;
+  for (int j=0; j<nProj; j++) {
+    double w = 1;
+    if (projData) {
+      obs->assignValueOnly(*(projData->get(j)));
+      w = projData->weight();
+      if (w <= 0) continue;
+    }
+    sumW += w;
+    for (int i=0; i<nBins; i++) {
+      double step = (gof.hi[i]-gof.lo[i])/nSub;
+      double sum = 0;
+      for (int k=0; k<nSub; k++) {
+        x->setVal(gof.lo[i] + (k+0.5)*step);
+        sum += marg->getVal(&normSet);
+      }
+      gof.expected[i] += w*sum*step;
+    }
+  }
+
+  for (int i=0; i<nBins; i++) {
+    if (sumW > 0) gof.expected[i] *= norm/sumW;
+    if (gof.data[i] == 0) continue;
+    gof.resid[i] = gof.data[i] - gof.expected[i];
+    gof.pull[i] = gof.resid[i]/sqrt(gof.err2[i]);
+    gof.chi2 += gof.pull[i]*gof.pull[i];
+    gof.nFullBins++;
+  }
+
+  obs->assignValueOnly(*saved);
+  if (marg != pdf) delete marg;
+  delete saved;
+  delete obs;
+}
+
+// Pulls (or residuals) of the non-empty bins, to be added to a RooPlot
+RooHist* gofHist(const BinnedGOF &gof, bool resid) {
+  RooHist *hist = new RooHist();
+  for (unsigned int i=0; i<gof.data.size(); i++) {
+    if (gof.data[i] == 0) continue;
+    double xc = 0.5*(gof.lo[i]+gof.hi[i]), dx = 0.5*(gof.hi[i]-gof.lo[i]);
+    if (resid) hist->addBinWithXYError(xc, gof.resid[i], dx, dx, sqrt(gof.err2[i]), sqrt(gof.err2[i]));
+    else hist->addBinWithXYError(xc, gof.pull[i], dx, dx, 1, 1);
+  }
+  return hist;
+}
+
 void defineCTResol(RooWorkspace *ws, InputOpt &opt) {
   if (opt.isPEE == 1) {
     if (opt.oneGaussianResol) {
@@ -262,7 +1706,20 @@ void defineCTBkg(RooWorkspace *ws, InputOpt &opt) {
 }
 
 void getMCTrueLifetime(RooWorkspace *ws, RooDataSet *redMCCutNP, string titlestr, double lmax, InputOpt &opt) {
-  ws->pdf("bMCTrue")->fitTo(*redMCCutNP,Minos(0),SumW2Error(kTRUE),NumCPU(8));
+  // MC true lifetime fit is read from the template cache (-w) if it was done for this NP MC sample
+  string templateName = npTemplateName(ws, redMCCutNP, "mcTrue", opt);
+  RooFitResult *fitMCTrue = templateName.empty() ? 0 : readFitCache(templateName);
+  if (fitMCTrue) {
+    cout << "getMCTrueLifetime:: MC true lifetime fit taken from " << templateName << endl;
+    RooArgSet *pars = ws->pdf("bMCTrue")->getParameters(*redMCCutNP);
+    restoreFitResult(pars, fitMCTrue);
+    delete pars;
+    ws->var("Gmc")->setConstant(kTRUE);
+    return ;
+  }
+
+  fitMCTrue = ws->pdf("bMCTrue")->fitTo(*redMCCutNP,Minos(0),SumW2Error(kTRUE),NumCPU(8),Save(1));
+  if (!templateName.empty() && fitMCTrue && fitMCTrue->status() == 0) writeFitCache(templateName, fitMCTrue);
 
   if (opt.isPbPb == 1) {
     // *** Draw MC true Lifetime fit
@@ -422,15 +1879,16 @@ void getMCTrueLifetime(RooWorkspace *ws, RooDataSet *redMCCutNP, string titlestr
 }
 
 void defineCTSig(RooWorkspace *ws, RooDataSet *redMCCut, RooDataSet *redMCCutNP, string titlestr, double lmax, InputOpt &opt) {
-  RooDataHist* binMCCutNP = new RooDataHist("binMCCutNP","MC distribution for NP signal",RooArgSet(*(ws->var("Jpsi_CtTrue"))),*redMCCutNP);
+  // Histogram template is only filled for the RooHistPdfConv cases
+  RooDataHist* binMCCutNP = 0;
+  if (opt.isPEE == 0 || (!opt.analyticBlifetime && opt.oneGaussianResol))
+    binMCCutNP = new RooDataHist("binMCCutNP","MC distribution for NP signal",RooArgSet(*(ws->var("Jpsi_CtTrue"))),*redMCCutNP);
   
   if (opt.isPEE == 0) {
-    RooHistPdfConv sigNPW("sigNPW","Non-prompt signal with wide gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW")),*(ws->var("sigmaResSigW")),*binMCCutNP ); ws->import(sigNPW);
-    RooHistPdfConv sigNPO("sigNPO","Non-prompt signal with outstanding gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW")),*(ws->var("sigmaResSigO")),*binMCCutNP ); ws->import(sigNPO);
-    RooHistPdfConv sigNPM("sigNPM","Non-prompt signal with mastodontic gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW")),*(ws->var("sigmaResSigM")),*binMCCutNP ); ws->import(sigNPM);
-    RooHistPdfConv sigNPN("sigNPN","Non-prompt signal with narrow gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW")),*(ws->var("sigmaResSigN")),*binMCCutNP ); ws->import(sigNPN);
-
-    RooAddPdf sigNP("sigNP","Non-prompt signal",RooArgSet(*(ws->pdf("sigNPW")),*(ws->pdf("sigNPO")),*(ws->pdf("sigNPM")),*(ws->pdf("sigNPN"))),RooArgSet(*(ws->var("fracRes")),*(ws->var("fracRes2")),*(ws->var("fracRes3")))); ws->import(sigNP);
+    // Wide, outstanding, mastodontic and narrow gaussians on the same template, in one pass
+    RooHistPdfConv sigNP("sigNP","Non-prompt signal",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW")),
+        RooArgList(*(ws->var("sigmaResSigW")),*(ws->var("sigmaResSigO")),*(ws->var("sigmaResSigM")),*(ws->var("sigmaResSigN"))),
+        RooArgList(*(ws->var("fracRes")),*(ws->var("fracRes2")),*(ws->var("fracRes3"))),*binMCCutNP); ws->import(sigNP);
 
   } else if (opt.isPEE == 1) {  
     if (opt.analyticBlifetime) {
@@ -526,7 +1984,26 @@ void defineCTSig(RooWorkspace *ws, RooDataSet *redMCCut, RooDataSet *redMCCutNP,
 //        RooFFTConvPdf sigNP("sigNP","Non-prompt signal",*(ws->var("Jpsi_Ct")),*(ws->pdf("sigNPHist")),*(ws->pdf("sigPR")));  ws->import(sigNP);
 
 //        RooKeysPdf sigNP("sigNP","Non-prompt signal",*(ws->var("Jpsi_Ct")),*redMCCutNP,RooKeysPdf::MirrorBoth);  ws->import(sigNP);
-        RooKeysPdf sigNP("sigNP","Non-prompt signal",*(ws->var("Jpsi_Ct")),*redMCCutNP,RooKeysPdf::MirrorLeftAsymRight);  ws->import(sigNP);
+        // The kernel estimate keeps its lookup table when stored, so it is built once per NP MC sample
+        string templateName = npTemplateName(ws, redMCCutNP, opt.fftKeys ? "fftKeys" : "keys", opt);
+        RooWorkspace *templateWS = templateName.empty() ? 0 : (RooWorkspace*)readCacheObject(templateName, "npTemplate");
+        if (templateWS && templateWS->pdf("sigNP")) {
+          cout << "defineCTSig:: Keys pdf taken from " << templateName << endl;
+          ws->import(*(templateWS->pdf("sigNP")));
+        } else {
+          // Binned and FFT convolved RooKeysPdf, same estimate at a fraction of the cost (-K 0: RooKeysPdf itself)
+          RooAbsPdf *sigNP = 0;
+          if (opt.fftKeys) sigNP = new RooFFTKeysPdf("sigNP","Non-prompt signal",*(ws->var("Jpsi_Ct")),*redMCCutNP,RooKeysPdf::MirrorLeftAsymRight);
+          else sigNP = new RooKeysPdf("sigNP","Non-prompt signal",*(ws->var("Jpsi_Ct")),*redMCCutNP,RooKeysPdf::MirrorLeftAsymRight);
+          ws->import(*sigNP);
+          if (!templateName.empty()) {
+            RooWorkspace newTemplateWS("npTemplate");
+            newTemplateWS.import(*sigNP);
+            writeCacheObject(templateName, &newTemplateWS, "npTemplate");
+          }
+          delete sigNP;
+        }
+        delete templateWS;
 
         RooPlot *trueframef = ws->var("Jpsi_Ct")->frame(Bins(150));
         redMCCutNP->plotOn(trueframef);
@@ -551,7 +2028,42 @@ void defineCTSig(RooWorkspace *ws, RooDataSet *redMCCut, RooDataSet *redMCCutNP,
     }
 
   }// end of isPEE == 1
+
+  // Tabulated erfc (-E) and interpolation grid (-G) of the template convolution
+  RooHistPdfConv *sigNPConv = dynamic_cast<RooHistPdfConv*>(ws->pdf("sigNP"));
+  if (sigNPConv && opt.erfcStep > 0) sigNPConv->setErfcTable(opt.erfcStep);
+  if (sigNPConv && opt.gridNU > 1) {
+    sigNPConv->setGridMode(opt.gridNU, opt.gridNS, opt.gridSMin, opt.gridSMax);
+    if (!sigNPConv->gridMode()) cout << "defineCTSig:: invalid -G grid, convolution summed directly" << endl;
+  }
   
   return;
 }
 
+double erfcTableError(RooWorkspace *ws, RooDataSet *ds) {
+  // The fits run in NumCPU clones of sigNP, so the sample is evaluated once more
+  // at the current parameters with every tabulated convolution and normalization
+  // compared to TMath::Erfc. Multi-Gaussian norms are computed by evaluateBatch,
+  // the per-event error norms at the Jpsi_CtErr of each entry.
+  RooHistPdfConv *sigNPConv = dynamic_cast<RooHistPdfConv*>(ws->pdf("sigNP"));
+  if (!sigNPConv) return -1;
+
+  sigNPConv->setErfcValidation(kTRUE);
+  vector<Double_t> vals;
+  sigNPConv->evaluateBatch(*ds, vals);
+  RooRealVar *ctErr = ws->var("Jpsi_CtErr");
+  if (!sigNPConv->isMulti() && ctErr && sigNPConv->dependsOn(*ctErr)) {
+    const double ctErrVal = ctErr->getVal();
+    RooArgSet allVars(*(ws->var("Jpsi_Ct"))), analVars;
+    const Int_t code = sigNPConv->getAnalyticalIntegral(allVars, analVars);
+    for (int i=0; i<ds->numEntries(); i++) {
+      ctErr->setVal(ds->get(i)->getRealValue("Jpsi_CtErr"));
+      sigNPConv->analyticalIntegral(code, 0);
+    }
+    ctErr->setVal(ctErrVal);
+  }
+  const double maxRelErr = sigNPConv->maxErfcRelError();
+  sigNPConv->setErfcValidation(kFALSE);
+  return maxRelErr;
+}
+
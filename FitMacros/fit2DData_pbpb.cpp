@@ -17,23 +17,8 @@ int main (int argc, char* argv[]) {
   
   // *** Check options
   parseInputArg(argc, argv, inOpt);
-
-  double pmin=0, pmax=0, ymin=0, ymax=0, lmin=0, lmax=0, cmin=0, cmax=0, psmax=0, psmin=0, errmin=0, errmax=0;
-  getOptRange(inOpt.prange,&pmin,&pmax);
-  getOptRange(inOpt.lrange,&lmin,&lmax);
-  getOptRange(inOpt.errrange,&errmin,&errmax);
-  getOptRange(inOpt.crange,&cmin,&cmax);
-  getOptRange(inOpt.yrange,&ymin,&ymax);
-  getOptRange(inOpt.phirange,&psmin,&psmax);
-  inOpt.pmin=pmin; inOpt.pmax=pmax; inOpt.ymin=ymin; inOpt.ymax=ymax; inOpt.lmin=lmin; inOpt.lmax=lmax; inOpt.cmin=cmin; inOpt.cmax=cmax; inOpt.psmax=psmax; inOpt.psmin=psmin; inOpt.errmin=errmin; inOpt.errmax=errmax;
-
-  // *** Strings for plot formatting
-  formTitle(inOpt, cmin, cmax);
-  formRapidity(inOpt, ymin, ymax);
-  formPt(inOpt, pmin, pmax);
-  formPhi(inOpt, psmin, psmax);
-
-  TLatex *t = new TLatex();  t->SetNDC();  t->SetTextAlign(12);
+  if (!inOpt.fitCacheDir.empty()) gSystem->mkdir(inOpt.fitCacheDir.c_str(), kTRUE);
+  if (!inOpt.templateCacheDir.empty()) gSystem->mkdir(inOpt.templateCacheDir.c_str(), kTRUE);
 
   // Global objects for drawing
   Double_t fx[2], fy[2], fex[2], fey[2];
@@ -50,42 +35,105 @@ int main (int argc, char* argv[]) {
   hfake41 = TH1F("hfake41","hfake4",100,200,300);
   hfake41.SetLineColor(kGreen); hfake41.SetMarkerStyle(kCircle); hfake41.SetLineWidth(4); hfake41.SetMarkerColor(kGreen); hfake41.SetLineStyle(kDashDotted); hfake41.SetFillColor(kGreen-7); hfake41.SetFillStyle(3444);
 
+  if (inOpt.plotMode == 2) {
+    // Plotting stage: everything is drawn from the bundles of a -q 1 run, samples are not read
+    if (!inOpt.binList.empty()) return runBinList(inOpt, 0, 0, 0);
+    return plotBin(inOpt);
+  }
+
   // *** Read MC and Data files
   TFile fInMC(inOpt.FileNameMC1.c_str());   //Non-prompt J/psi MC
   cout << inOpt.FileNameMC1.c_str() << endl;
   if (fInMC.IsZombie()) { cout << "CANNOT open MC1 root file\n"; return 1; }
   fInMC.cd();
-  RooDataSet *dataMC;
-  if (inOpt.useWeightedNP)
-    dataMC = (RooDataSet*)fInMC.Get("dataJpsiWeight");
-  else
-    dataMC = (RooDataSet*)fInMC.Get("dataJpsi");
+  RooDataSet *dataMC = 0;
+  const char *nameMC = inOpt.useWeightedNP ? "dataJpsiWeight" : "dataJpsi";
+  if (inOpt.useColumns) dataMC = loadColumnSample(inOpt.FileNameMC1, nameMC, "dataMC");
+  if (dataMC == 0) dataMC = (RooDataSet*)fInMC.Get(nameMC);
   dataMC->SetName("dataMC");
 
   TFile fInMC2(inOpt.FileNameMC2.c_str());  //Prompt J/psi MC
   cout << inOpt.FileNameMC2.c_str() << endl;
   if (fInMC2.IsZombie()) { cout << "CANNOT open MC2 root file\n"; return 1; }
   fInMC2.cd();
-  RooDataSet *dataMC2 = (RooDataSet*)fInMC2.Get("dataJpsi");
+  RooDataSet *dataMC2 = 0;
+  if (inOpt.useColumns) dataMC2 = loadColumnSample(inOpt.FileNameMC2, "dataJpsi", "dataMC2");
+  if (dataMC2 == 0) dataMC2 = (RooDataSet*)fInMC2.Get("dataJpsi");
   dataMC2->SetName("dataMC2");
 
   TFile fInData(inOpt.FileName.c_str());
   cout << inOpt.FileName.c_str() << endl;
   if (fInData.IsZombie()) { cout << "CANNOT open data root file\n"; return 1; }
   fInData.cd();
-  RooDataSet *data;
+  RooDataSet *data = 0;
+  const char *nameData = (inOpt.doWeight >= 1) ? "dataJpsiWeight" : "dataJpsi";
+  if (inOpt.useColumns) data = loadColumnSample(inOpt.FileName, nameData, "data");
+  if (data == 0) data = (RooDataSet*)fInData.Get(nameData);
   if (inOpt.doWeight >= 1) {
-    data = (RooDataSet*)fInData.Get("dataJpsiWeight");  //Weighted
-    cout << "## WEIGHTED dataset is used\n";
+    cout << "## WEIGHTED dataset is used\n";  //Weighted
   } else {
-    data = (RooDataSet*)fInData.Get("dataJpsi");  //Unweighted
-    cout << "## UN-WEIGHTED dataset is used!\n";
+    cout << "## UN-WEIGHTED dataset is used!\n";  //Unweighted
   }
   data->SetName("data");
 
+  if (inOpt.useColumns == 2) {
+    // Column files against the RooDataSets they were written from, no fit
+    int nBad = checkColumnSample(data, (RooDataSet*)fInData.Get(nameData), inOpt, true)
+             + checkColumnSample(dataMC, (RooDataSet*)fInMC.Get(nameMC), inOpt, false)
+             + checkColumnSample(dataMC2, (RooDataSet*)fInMC2.Get("dataJpsi"), inOpt, false);
+    cout << "## Column file check: " << (nBad == 0 ? "all bins identical" : "MISMATCH") << endl;
+    fInMC.Close();
+    fInMC2.Close();
+    fInData.Close();
+    return (nBad == 0) ? 0 : 1;
+  }
+
+  if (!inOpt.binList.empty()) {
+    // Driver mode: every bin of the list is fitted from the samples loaded above
+    int ret = runBinList(inOpt, data, dataMC, dataMC2);
+    fInMC.Close();
+    fInMC2.Close();
+    fInData.Close();
+    return ret;
+  }
+
+  int ret = fitBin(inOpt, data, dataMC, dataMC2);
+
+  fInMC.Close();
+  fInMC2.Close();
+  fInData.Close();
+
+  return ret;
+}
+
+int fitBin(InputOpt &inOpt, RooDataSet *data, RooDataSet *dataMC, RooDataSet *dataMC2, const BinIndex *binIndex) {
+  setBinOpt(inOpt);
+  double pmin=inOpt.pmin, pmax=inOpt.pmax, ymin=inOpt.ymin, ymax=inOpt.ymax, lmin=inOpt.lmin, lmax=inOpt.lmax;
+  double cmin=inOpt.cmin, cmax=inOpt.cmax, psmax=inOpt.psmax, psmin=inOpt.psmin, errmin=inOpt.errmin, errmax=inOpt.errmax;
+
+  TLatex *t = new TLatex();  t->SetNDC();  t->SetTextAlign(12);
+
   // Create workspace to play with
   RooWorkspace *ws = new RooWorkspace("workspace");
 
+  // Entries of this bin without ctau error cut, from the driver's partition or from a single scan
+  BinIndex thisBin;
+  if (binIndex == 0) {
+    BinOpt bin;
+    bin.yrange = inOpt.yrange; bin.prange = inOpt.prange; bin.crange = inOpt.crange; bin.phirange = inOpt.phirange;
+    vector<BinIndex> index;
+    partitionSamples(data, dataMC, dataMC2, vector<BinOpt>(1,bin), inOpt, index);
+    thisBin = index[0];
+    binIndex = &thisBin;
+  }
+
+  RooDataSet *redMC, *redMC2, *redData;
+  RooDataSet *redMC_2, *redMC2_2, *redData_2;
+
+  redMC_2 = selectEntries(dataMC, binIndex->dataMC);
+  redMC2_2 = selectEntries(dataMC2, binIndex->dataMC2);
+  redData_2 = selectEntries(data, binIndex->data);
+
   // Reduce "dataMC" with given ranges/cuts
   char reduceDS[3000], reduceDS2[3000], reduceDSMC[3000], reduceDS2MC[3000];
   if (!inOpt.rpmethod.compare("etHFm")) {
@@ -100,8 +148,8 @@ int main (int argc, char* argv[]) {
       if (readCtauErrRange(inOpt, &errmin, &errmax)<0) return -1;
     } else if (inOpt.ctErrRange == 2) {
       errmin = 0.008; errmax = 1.0;
-    } else {
-      getCtauErrRange(data, inOpt, reduceDS2, lmin, lmax, &errmin, &errmax);
+    } else if (inOpt.ctErrRange != 3 || readCtauErrRange(inOpt, &errmin, &errmax)<0) {
+      getCtauErrRange(redData_2, inOpt, reduceDS2, lmin, lmax, &errmin, &errmax);
     }
  
     sprintf(reduceDS,
@@ -122,8 +170,8 @@ int main (int argc, char* argv[]) {
       if (readCtauErrRange(inOpt, &errmin, &errmax)<0) return -1;
     } else if (inOpt.ctErrRange == 2) {
       errmin = 0.008; errmax = 1.0;
-    } else {
-      getCtauErrRange(data, inOpt, reduceDS2, lmin, lmax, &errmin, &errmax);
+    } else if (inOpt.ctErrRange != 3 || readCtauErrRange(inOpt, &errmin, &errmax)<0) {
+      getCtauErrRange(redData_2, inOpt, reduceDS2, lmin, lmax, &errmin, &errmax);
     }
 
     sprintf(reduceDS,
@@ -144,8 +192,8 @@ int main (int argc, char* argv[]) {
       if (readCtauErrRange(inOpt, &errmin, &errmax)<0) return -1;
     } else if (inOpt.ctErrRange == 2) {
       errmin = 0.008; errmax = 1.0;
-    } else {
-      getCtauErrRange(data, inOpt, reduceDS2, lmin, lmax, &errmin, &errmax);
+    } else if (inOpt.ctErrRange != 3 || readCtauErrRange(inOpt, &errmin, &errmax)<0) {
+      getCtauErrRange(redData_2, inOpt, reduceDS2, lmin, lmax, &errmin, &errmax);
     }
  
     sprintf(reduceDS,
@@ -156,16 +204,10 @@ int main (int argc, char* argv[]) {
         pmin,pmax,ymin,ymax,-lmin,lmax,errmin,errmax,psmin,psmax);
   }
   
-  RooDataSet *redMC, *redMC2, *redData;
-  RooDataSet *redMC_2, *redMC2_2, *redData_2;
-
-  redMC = (RooDataSet*)dataMC->reduce(reduceDSMC);
-  redMC2 = (RooDataSet*)dataMC2->reduce(reduceDSMC);
-  redData = (RooDataSet*)data->reduce(reduceDS);
- 
-  redMC_2 = (RooDataSet*)dataMC->reduce(reduceDS2MC);
-  redMC2_2 = (RooDataSet*)dataMC2->reduce(reduceDS2MC);
-  redData_2 = (RooDataSet*)data->reduce(reduceDS2);
+  // Ctau error cut only scans the entries of this bin
+  redMC = selectCtErr(redMC_2, errmin, errmax);
+  redMC2 = selectCtErr(redMC2_2, errmin, errmax);
+  redData = selectCtErr(redData_2, errmin, errmax);
 
   if (inOpt.isPEE == 1) {
     cout << "reduceDS: " << reduceDS << endl;
@@ -259,6 +301,20 @@ int main (int argc, char* argv[]) {
   RooDataHist *binDataCtErrSB = new RooDataHist("binDataCtErrSB","Data ct error distribution for bkg",RooArgSet(*(ws->var("Jpsi_CtErr"))),*redDataSB);
   RooDataHist *binDataCtErrSIG = new RooDataHist("binDataCtErrSIG","Data ct error distribution for sig",RooArgSet(*(ws->var("Jpsi_CtErr"))),*redDataSIG);
 
+  // Binned copies for the fast fit mode (-k), 0 for unbinned fits
+  string ctVars = (inOpt.isPEE == 1) ? "Jpsi_Ct,Jpsi_CtErr" : "Jpsi_Ct";
+  string ctMassVars = "Jpsi_Mass," + ctVars;
+  RooDataHist *fitHistMass = makeFitHist(ws, redDataCut, "fitHistMass", "Jpsi_Mass", inOpt);
+  RooDataHist *fitHistSB = makeFitHist(ws, redDataSB, "fitHistSB", ctVars.c_str(), inOpt);
+  RooDataHist *fitHistSBL = 0, *fitHistSBR = 0, *fitHistSIGWide = 0;
+  if (inOpt.isPEE == 1 && (inOpt.ctauBackground == 1 || inOpt.ctauBackground == 2)) {
+    fitHistSBL = makeFitHist(ws, redDataSBL, "fitHistSBL", ctVars.c_str(), inOpt);
+    fitHistSBR = makeFitHist(ws, redDataSBR, "fitHistSBR", ctVars.c_str(), inOpt);
+  }
+  if (inOpt.isPEE == 1 && inOpt.ctauBackground == 1)
+    fitHistSIGWide = makeFitHist(ws, redDataSIGWide, "fitHistSIGWide", ctMassVars.c_str(), inOpt);
+  RooDataHist *fitHist2D = makeFitHist(ws, redDataCut, "fitHist2D", ctMassVars.c_str(), inOpt);
+
   // *** Define PDFs with parameters (mass and ctau)
   // J/psi mass parameterization
   defineMassBkg(ws);
@@ -272,8 +328,8 @@ int main (int argc, char* argv[]) {
   char funct[100];
 
   // Set some fitting variables to constant. It depends on the prefitting options.
-  RooFitResult *fitM;
-  RooFitResult *fit2D;
+  RooFitResult *fitM = 0;
+  RooFitResult *fit2D = 0;
   double theEDMMass, theNLLMass;
   int nFitParMass;
 
@@ -671,11 +727,11 @@ int main (int argc, char* argv[]) {
       cout << "funct: " <<  funct << endl;
       ws->factory(funct);
       if (dPhiConst) { //sigmaSig2 will be constrained too!
-        fitM = ws->pdf("sigMassPDF")->fitTo(*redDataCut,Extended(0),ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig2Con")),*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Save(1),SumW2Error(kTRUE),NumCPU(8));
+        fitM = fitStage(ws->pdf("sigMassPDF"),redDataCut,fitHistMass,"mass",inOpt,Extended(0),ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig2Con")),*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Save(1),SumW2Error(kTRUE),NumCPU(8));
       } else if (centConst && !dPhiConst) { //sigmaSig2 will be NOT constrained!
-        fitM = ws->pdf("sigMassPDF")->fitTo(*redDataCut,Extended(0),ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Save(1),SumW2Error(kTRUE),NumCPU(8));
+        fitM = fitStage(ws->pdf("sigMassPDF"),redDataCut,fitHistMass,"mass",inOpt,Extended(0),ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Save(1),SumW2Error(kTRUE),NumCPU(8));
       } else { // all free fit bin
-        fitM = ws->pdf("sigMassPDF")->fitTo(*redDataCut,Extended(0),Save(1),SumW2Error(kTRUE),NumCPU(8));
+        fitM = fitStage(ws->pdf("sigMassPDF"),redDataCut,fitHistMass,"mass",inOpt,Extended(0),Save(1),SumW2Error(kTRUE),NumCPU(8));
       }
     } else {
       if (inOpt.doWeight == 1) {
@@ -701,15 +757,15 @@ int main (int argc, char* argv[]) {
       ws->factory(funct);
     
       if (dPhiConst) { //sigmaSig2 will be constrained too!
-        fitM = ws->pdf("sigMassPDF")->fitTo(*redDataCut,ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig2Con")),*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
+        fitM = fitStage(ws->pdf("sigMassPDF"),redDataCut,fitHistMass,"mass",inOpt,ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig2Con")),*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
       } else if (centConst && !dPhiConst) { //sigmaSig2 will be NOT constrained!
-        fitM = ws->pdf("sigMassPDF")->fitTo(*redDataCut,ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
+        fitM = fitStage(ws->pdf("sigMassPDF"),redDataCut,fitHistMass,"mass",inOpt,ExternalConstraints(RooArgSet(*(ws->pdf("sigmaSig1Con")),*(ws->pdf("meanSig1Con")),*(ws->pdf("coeffGausCon")),*(ws->pdf("alphaCon")),*(ws->pdf("enneWCon")))),Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
       } else { // all free fit bin
-        fitM = ws->pdf("sigMassPDF")->fitTo(*redDataCut,Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
+        fitM = fitStage(ws->pdf("sigMassPDF"),redDataCut,fitHistMass,"mass",inOpt,Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
       }
     }
 
-    drawMassFitParsNLL(ws, redDataCut, inOpt);
+    if (inOpt.plotMode == 0) drawMassFitParsNLL(ws, redDataCut, inOpt);
 
     fitM->Print("v");
     theEDMMass = fitM->edm();
@@ -784,7 +840,7 @@ int main (int argc, char* argv[]) {
     if(inOpt.PcombinedWidthErr < 1) inOpt.PcombinedWidthErr = 1;
 
     // Draw mass plot before do ctau fit
-    if (!inOpt.doBfit) drawMassPlotsWithoutB(ws, redDataCut, fitM, inOpt);
+    if (!inOpt.doBfit && inOpt.plotMode == 0) drawMassPlotsWithoutB(ws, redDataCut, fitM, inOpt);
 
   } else {
     RooRealVar NSig("NSig","dummy total signal events",0.);
@@ -815,7 +871,7 @@ int main (int argc, char* argv[]) {
 
   // *** Get NSig, NBkg, Bfraction and their errors
   Double_t NSigPR_fin, ErrNSigPR_fin;
-  Double_t NSigNP_fin, ErrNSigNP_fin;
+  Double_t NSigNP_fin = 0, ErrNSigNP_fin = 0;
   Double_t Bfrac_fin, ErrBfrac_fin;
   int nFitPar;
   Double_t theNLL, theEDM, theProb;
@@ -914,9 +970,7 @@ int main (int argc, char* argv[]) {
     } //end of prefitmass option
 
     // *** Start prefit on the signal ctau function
-    RooFitResult *fitPR, *fitSB, *fitSBR, *fitSBL;
-    double RSS = 0;
-    unsigned int nFullBinsResid = 0;
+    RooFitResult *fitPR = 0, *fitSB = 0, *fitSBR = 0, *fitSBL = 0;
     if (inOpt.prefitSignalCTau) {
       RooPlot *tframePR;
       if (inOpt.isPEE == 1) {
@@ -980,7 +1034,7 @@ int main (int argc, char* argv[]) {
         }  // end of fix fraction & mean values to the MinBias bin
 
 
-        fitPR = ws->pdf("sigPR_PEE")->fitTo(*redMCCutPR,Range("promptfit"),SumW2Error(kTRUE),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))),Save(1),NumCPU(8));
+        fitPR = fitStage(ws->pdf("sigPR_PEE"),redMCCutPR,0,"prompt",inOpt,Range("promptfit"),SumW2Error(kTRUE),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))),Save(1),NumCPU(8));
         fitPR->Print("v");
 
         ws->var("meanResSigW")->setConstant(kTRUE);
@@ -989,7 +1043,7 @@ int main (int argc, char* argv[]) {
         if (ws->var("meanResSigN")) ws->var("meanResSigN")->setConstant(kTRUE);
 
       } else if (inOpt.isPEE == 0) {
-        fitPR = ws->pdf("sigPR")->fitTo(*redMCCutPR,SumW2Error(kTRUE),Save(1),NumCPU(8));
+        fitPR = fitStage(ws->pdf("sigPR"),redMCCutPR,0,"prompt",inOpt,SumW2Error(kTRUE),Save(1),NumCPU(8));
         fitPR->Print("v");
 
         if (ws->var("sigmaResSigO")) ws->var("sigmaResSigO")->setConstant(kTRUE);
@@ -1003,7 +1057,8 @@ int main (int argc, char* argv[]) {
       }
 
       // Plot resolution functions
-      if (inOpt.drawTimeConsumingPlots) ctauResolFitCheck(ws, true, redMCCutPR, tframePR, inOpt);
+      if (inOpt.plotMode != 0) ws->import(*fitPR,"fitPR",kTRUE);
+      else if (inOpt.drawTimeConsumingPlots) ctauResolFitCheck(ws, true, redMCCutPR, tframePR, inOpt);
     
     } else {
       cout << "Please check running option and turn on prefitSignalCTau\n";
@@ -1040,16 +1095,16 @@ int main (int argc, char* argv[]) {
 
       if (inOpt.isPEE == 1) {
         if (inOpt.ctauBackground == 0) {
-          fitSB = ws->pdf("bkgCtauTOT_PEE")->fitTo(*redDataSB,SumW2Error(kTRUE),NumCPU(8),Save(1),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
+          fitSB = fitStage(ws->pdf("bkgCtauTOT_PEE"),redDataSB,fitHistSB,"sideband",inOpt,SumW2Error(kTRUE),NumCPU(8),Save(1),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
           fitSB->Print("v");
         } else if (inOpt.ctauBackground == 1 || inOpt.ctauBackground == 2) {
-          fitSBR = ws->pdf("bkgCtauTOTR_PEE")->fitTo(*redDataSBR,SumW2Error(kTRUE),NumCPU(8),Save(1),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
+          fitSBR = fitStage(ws->pdf("bkgCtauTOTR_PEE"),redDataSBR,fitHistSBR,"sidebandR",inOpt,SumW2Error(kTRUE),NumCPU(8),Save(1),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
           fitSBR->Print("v");
-          fitSBL = ws->pdf("bkgCtauTOTL_PEE")->fitTo(*redDataSBL,SumW2Error(kTRUE),NumCPU(8),Save(1),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
+          fitSBL = fitStage(ws->pdf("bkgCtauTOTL_PEE"),redDataSBL,fitHistSBL,"sidebandL",inOpt,SumW2Error(kTRUE),NumCPU(8),Save(1),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
           fitSBL->Print("v");
         }
       } else {
-        fitSB = ws->pdf("bkgCtTot")->fitTo(*redDataSB,SumW2Error(kTRUE),Save(1),NumCPU(8));
+        fitSB = fitStage(ws->pdf("bkgCtTot"),redDataSB,fitHistSB,"sideband",inOpt,SumW2Error(kTRUE),Save(1),NumCPU(8));
         fitSB->Print("v");
       }
 
@@ -1125,7 +1180,13 @@ int main (int argc, char* argv[]) {
         }
       }
       
-      if (inOpt.drawTimeConsumingPlots) drawCtauSBPlots(ws, redDataSB, redDataSBL, redDataSBR, binDataCtErrSB, fitSB, fitSBL, fitSBR, inOpt);
+      if (inOpt.plotMode != 0) {
+        if (fitSB) ws->import(*fitSB,"fitSB",kTRUE);
+        if (fitSBL) ws->import(*fitSBL,"fitSBL",kTRUE);
+        if (fitSBR) ws->import(*fitSBR,"fitSBR",kTRUE);
+      } else if (inOpt.drawTimeConsumingPlots) {
+        drawCtauSBPlots(ws, redDataSB, redDataSBL, redDataSBR, binDataCtErrSB, fitSB, fitSBL, fitSBR, inOpt);
+      }
     }
 
     // Fix below bkg variables in any case
@@ -1143,35 +1204,21 @@ int main (int argc, char* argv[]) {
     if (inOpt.prefitMass) {
       if (inOpt.isPEE == 1) {
         if (inOpt.ctauBackground == 0 || inOpt.ctauBackground == 2) {
-          fit2D = ws->pdf("totPDF_PEE")->fitTo(*redDataCut,Save(1),SumW2Error(kTRUE),NumCPU(8),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
+          fit2D = fitStage(ws->pdf("totPDF_PEE"),redDataCut,fitHist2D,"final",inOpt,Save(1),SumW2Error(kTRUE),NumCPU(8),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
         } else if (inOpt.ctauBackground == 1) {
-          fit2D = ws->pdf("totPDF_PEE")->fitTo(*redDataSIGWide,Save(1),SumW2Error(kTRUE),NumCPU(8),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
+          fit2D = fitStage(ws->pdf("totPDF_PEE"),redDataSIGWide,fitHistSIGWide,"final",inOpt,Save(1),SumW2Error(kTRUE),NumCPU(8),ConditionalObservables(RooArgSet(*(ws->var("Jpsi_CtErr")))));
         }
       } else {
-        fit2D = ws->pdf("totPDF")->fitTo(*redDataCut,Save(1),SumW2Error(kTRUE),NumCPU(8));
+        fit2D = fitStage(ws->pdf("totPDF"),redDataCut,fitHist2D,"final",inOpt,Save(1),SumW2Error(kTRUE),NumCPU(8));
       }
       fit2D->Print("v");
       nFitPar = fit2D->floatParsFinal().getSize();
       // *** Get chi2/ndof for ctau fitting
-      RooPlot *tframe = ws->var("Jpsi_Ct")->frame();
-      RooHist *hpulltot;
-      redDataCut->plotOn(tframe,DataError(RooAbsData::SumW2),Binning(rb),MarkerSize(1));
-      ws->pdf("totPDF_PEE")->plotOn(tframe,LineColor(kBlack),LineWidth(2),ProjWData(RooArgList(*(ws->var("Jpsi_CtErr"))),*binDataCtErr,kTRUE),NumCPU(8),Normalization(1,RooAbsReal::NumEvent));
-      TH1 *hdatact = redDataCut->createHistogram("hdatact",*ws->var("Jpsi_Ct"),Binning(rb));
-      double chi2 = 0, unNormChi2 = 0;
-      int dof = 0;
-      double *ypulls = hpulltot->GetY();
-      unsigned int nBins = ws->var("Jpsi_Ct")->getBinning().numBins();
-      unsigned int nFullBins = 0;
-      for (unsigned int i = 0; i < nBins; i++) {
-        if (hdatact->GetBinContent(i+1) == 0) continue;
-        chi2 += ypulls[i]*ypulls[i];
-        nFullBins++;
-      }
-      unNormChi2 = chi2;
-      dof = nFullBins - nFitPar;
-      chi2 /= (nFullBins - nFitPar);
-      theProb = TMath::Prob(chi2,nFitPar);
+      BinnedGOF gof;
+      if (inOpt.isPEE == 1) binnedGOF(ws->pdf("totPDF_PEE"),ws->var("Jpsi_Ct"),rb2,redDataCut,binDataCtErr,redDataCut->sumEntries(),gof);
+      else binnedGOF(ws->pdf("totPDF"),ws->var("Jpsi_Ct"),rb2,redDataCut,0,redDataCut->sumEntries(),gof);
+      int dof = gof.nFullBins - nFitPar;
+      theProb = TMath::Prob(gof.chi2,dof);
       theNLL = fit2D->minNll();
       theEDM = fit2D->edm();
       Bfrac_fin = ws->var("Bfrac")->getVal();
@@ -1184,28 +1231,14 @@ int main (int argc, char* argv[]) {
       ErrNSigNP_fin = NSigNP_fin * sqrt( pow(ErrNSig_fin/NSig_fin,2)+pow(ErrBfrac_fin/Bfrac_fin,2) );
       ErrNSigPR_fin = NSigPR_fin * sqrt ( pow(ErrNSig_fin/NSig_fin,2)+pow(ErrBfrac_fin/(1.0-Bfrac_fin),2) );
     } else {
-      fit2D = ws->pdf("totPDF")->fitTo(*redDataCut,Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
+      fit2D = fitStage(ws->pdf("totPDF"),redDataCut,fitHist2D,"final",inOpt,Extended(1),Save(1),SumW2Error(kTRUE),NumCPU(8));
       nFitPar = fit2D->floatParsFinal().getSize();
       // *** Get chi2/ndof for ctau fitting
-      RooPlot *tframe = ws->var("Jpsi_Ct")->frame();
-      RooHist *hpulltot;
-      redDataCut->plotOn(tframe,DataError(RooAbsData::SumW2),Binning(rb),MarkerSize(1));
-      ws->pdf("totPDF_PEE")->plotOn(tframe,LineColor(kBlack),LineWidth(2),ProjWData(RooArgList(*(ws->var("Jpsi_CtErr"))),*binDataCtErr,kTRUE),NumCPU(8),Normalization(1,RooAbsReal::NumEvent));
-      TH1 *hdatact = redDataCut->createHistogram("hdatact",*ws->var("Jpsi_Ct"),Binning(rb));
-      double chi2 = 0, unNormChi2 = 0;
-      int dof = 0;
-      double *ypulls = hpulltot->GetY();
-      unsigned int nBins = ws->var("Jpsi_Ct")->getBinning().numBins();
-      unsigned int nFullBins = 0;
-      for (unsigned int i = 0; i < nBins; i++) {
-        if (hdatact->GetBinContent(i+1) == 0) continue;
-        chi2 += ypulls[i]*ypulls[i];
-        nFullBins++;
-      }
-      unNormChi2 = chi2;
-      dof = nFullBins - nFitPar;
-      chi2 /= (nFullBins - nFitPar);
-      theProb = TMath::Prob(chi2,nFitPar);
+      BinnedGOF gof;
+      if (inOpt.isPEE == 1) binnedGOF(ws->pdf("totPDF_PEE"),ws->var("Jpsi_Ct"),rb2,redDataCut,binDataCtErr,redDataCut->sumEntries(),gof);
+      else binnedGOF(ws->pdf("totPDF"),ws->var("Jpsi_Ct"),rb2,redDataCut,0,redDataCut->sumEntries(),gof);
+      int dof = gof.nFullBins - nFitPar;
+      theProb = TMath::Prob(gof.chi2,dof);
       theNLL = fit2D->minNll();
       theEDM = fit2D->edm();
       NSigNP_fin = ws->var("NSigNP")->getVal();
@@ -1216,6 +1249,11 @@ int main (int argc, char* argv[]) {
       ErrBfrac_fin = sqrt( pow(NSigNP_fin*ErrNSigPR_fin,2) + pow(NSigPR_fin*ErrNSigNP_fin,2) ) / pow(NSigNP_fin+NSigPR_fin,2);
     }
 
+    if (inOpt.erfcStep > 0 && inOpt.erfcValidate) {
+      RooDataSet *finalSample = (inOpt.prefitMass && inOpt.isPEE == 1 && inOpt.ctauBackground == 1) ? redDataSIGWide : redDataCut;
+      cout << "## Tabulated erfc, largest relative error on the final fit sample: " << erfcTableError(ws, finalSample) << endl;
+    }
+
     const double sigmaSig2 = ws->var("sigmaResSigN")->getVal();
     const double ErrsigmaSig2 = ws->var("sigmaResSigN")->getError();
     if (inOpt.oneGaussianResol) {
@@ -1246,8 +1284,20 @@ int main (int argc, char* argv[]) {
     cout << "Resolution : Fit : " << resol << " +/- " << Errresol << endl;
   }
 
-//  titlestr = inOpt.dirPre + "_rap" + inOpt.yrange + "_pT" + inOpt.prange + "_cent" + inOpt.crange + "_dPhi" + inOpt.phirange + "_ws.root";
-//  ws->writeToFile(titlestr.c_str());
+  // Fully configured model and data of this bin, reloadable for re-fits and plotting
+  if (inOpt.plotMode != 0)
+    addPlotBundle(ws, redDataCut, redMCCutPR, binDataCtErr, binDataCtErrSB, fitM, fit2D, NSigNP_fin, NBkg_fin, inOpt);
+  if (inOpt.simFit != 0 && fit2D) {
+    // Sample and result of the final fit, starting point of the simultaneous fit of the group
+    RooArgSet obs(*(ws->var("Jpsi_Mass")),*(ws->var("Jpsi_Ct")),*(ws->var("Jpsi_CtErr")));
+    RooDataSet *finalSample = (inOpt.prefitMass && inOpt.isPEE == 1 && inOpt.ctauBackground == 1) ? redDataSIGWide : redDataCut;
+    RooDataSet *simFitData = (RooDataSet*)finalSample->reduce(SelectVars(obs),Name("simFitData"));
+    ws->import(*simFitData);
+    delete simFitData;
+    ws->import(*fit2D,"fit2D",kTRUE);
+  }
+  titlestr = inOpt.dirPre + "_rap" + inOpt.yrange + "_pT" + inOpt.prange + "_cent" + inOpt.crange + "_dPhi" + inOpt.phirange + "_ws.root";
+  ws->writeToFile(titlestr.c_str());
 
   titlestr = inOpt.dirPre + "_rap" + inOpt.yrange + "_pT" + inOpt.prange + "_cent" + inOpt.crange + "_dPhi" + inOpt.phirange + ".txt";
 
@@ -1380,7 +1430,37 @@ int main (int argc, char* argv[]) {
 
   outputFile.close();
 
-  if (inOpt.doBfit) {  // skip ctau fit plotting
+  if (inOpt.binnedFit == 2) {
+    titlestr = inOpt.dirPre + "_rap" + inOpt.yrange + "_pT" + inOpt.prange + "_cent" + inOpt.crange + "_dPhi" + inOpt.phirange + "_binnedCheck.txt";
+    ofstream checkFile(titlestr.c_str());
+    if (!checkFile.good()) {cout << "Fail to open binned fit check file." << endl; return 1;}
+    checkFile << "# stage parameter binnedVal binnedErr unbinnedVal unbinnedErr (binned-unbinned)/unbinnedErr" << "\n"
+              << inOpt.binnedCheck;
+    checkFile.close();
+  }
+
+  if (inOpt.profilePoints > 0) {
+    titlestr = inOpt.dirPre + "_rap" + inOpt.yrange + "_pT" + inOpt.prange + "_cent" + inOpt.crange + "_dPhi" + inOpt.phirange + "_profile.txt";
+    ofstream profileFile(titlestr.c_str());
+    if (!profileFile.good()) {cout << "Fail to open profile likelihood file." << endl; return 1;}
+    profileFile << "# nllScale stage weighted factor : deltaNLL multiplied by sum(w)/sum(w^2) on weighted samples, 1 otherwise" << "\n"
+                << "# interval stage parameter best low high hesseError : deltaNLL = 0.5 crossings, scan edge if not reached" << "\n"
+                << "# point stage parameter value deltaNLL fitStatus" << "\n"
+                << inOpt.profileScan;
+    profileFile.close();
+  }
+
+  if (inOpt.nToys > 0) {
+    titlestr = inOpt.dirPre + "_rap" + inOpt.yrange + "_pT" + inOpt.prange + "_cent" + inOpt.crange + "_dPhi" + inOpt.phirange + "_toys.txt";
+    ofstream toyFile(titlestr.c_str());
+    if (!toyFile.good()) {cout << "Fail to open toy study file." << endl; return 1;}
+    toyFile << "# summary stage parameter generated nToys nConverged pullMean pullMeanErr pullWidth pullWidthErr" << "\n"
+            << "# toy stage number fitStatus parameter value error pull" << "\n"
+            << inOpt.toyStudy;
+    toyFile.close();
+  }
+
+  if (inOpt.doBfit && inOpt.plotMode == 0) {  // skip ctau fit plotting
     // Plot various fit results and data points
     drawMassPlotsWithB(ws, redDataCut, NSigNP_fin, NBkg_fin, fitM, inOpt);
 
@@ -1422,10 +1502,470 @@ int main (int argc, char* argv[]) {
     }
   } // end of skip ctau fitting
 
-  fInMC.Close();
-  fInMC2.Close();
-  fInData.Close();
+  return 0;
+}
+
+/////////////////////////////////////////////////////////
+////////// Multi-bin driver /////////////////////////////
+/////////////////////////////////////////////////////////
+// Bin list format: one bin per line, "rap pt cent dphi [lifetimeOpt]", where
+// the ranges are given as for -y -p -t -s and the optional lifetimeOpt
+// overrides the first argument of -a for that bin. Lines starting with '#'
+// are comments. An empty line closes a stage: all bins of a stage are fitted
+// in parallel, and a stage only starts once the previous one has finished,
+// so inclusive fits whose .txt outputs are read by -x (isMB, ctErrRange) can
+// be put in front of the bins that use them.
+int readBinList(InputOpt &opt, vector< vector<BinOpt> > &stages) {
+  ifstream input(opt.binList.c_str());
+  if (!input.good()) { cout << "Failed to open: " << opt.binList << endl; return -1; }
+
+  stages.clear();
+  stages.push_back(vector<BinOpt>());
+  string line;
+  while (getline(input, line)) {
+    if (line.find_first_not_of(" \t\r") == string::npos) {
+      if (!stages.back().empty()) stages.push_back(vector<BinOpt>());
+      continue;
+    }
+    if (line[line.find_first_not_of(" \t\r")] == '#') continue;
+
+    char rap[512], pt[512], cent[512], dphi[512];
+    int lifetimeOpt = -1;
+    int nread = sscanf(line.c_str(), "%511s %511s %511s %511s %d", rap, pt, cent, dphi, &lifetimeOpt);
+    if (nread < 4) { cout << "Invalid line in bin list: " << line << endl; return -1; }
+
+    BinOpt bin;
+    bin.yrange = rap; bin.prange = pt; bin.crange = cent; bin.phirange = dphi;
+    bin.lifetimeOpt = (nread == 5) ? lifetimeOpt : -1;
+    stages.back().push_back(bin);
+  }
+  if (stages.back().empty()) stages.pop_back();
+
+  return 0;
+}
+
+// Bins of one driver stage, one fit (or plotting) job per bin
+struct BinJobs : public WorkerJobs {
+  RooDataSet *data, *dataMC, *dataMC2;
+  vector<InputOpt> binOpts;
+  vector<const BinIndex*> indices;
+  vector<string> works;
+
+  int run(int i, double *rec) {
+    // Same log file as the batch jobs write, plotting workers keep their own
+    redirectLog(works[i] + (binOpts[i].plotMode == 2 ? "_plots.log" : ".log"));
+    if (binOpts[i].plotMode == 2) return plotBin(binOpts[i]);
+    return fitBin(binOpts[i], data, dataMC, dataMC2, indices[i]);
+  }
+  void started(int i, pid_t pid) {
+    cout << "## Started: " << works[i] << " (pid " << pid << ")" << endl;
+  }
+  void done(int i, const double *rec, bool ok) {
+    cout << "## " << (ok ? "Done: " : "FAILED: ") << works[i] << endl;
+  }
+};
+
+int runBinList(InputOpt &opt, RooDataSet *data, RooDataSet *dataMC, RooDataSet *dataMC2) {
+  vector< vector<BinOpt> > stages;
+  if (readBinList(opt, stages) < 0) return -1;
+
+  // All bins are assigned in one pass over each sample
+  vector<BinOpt> allBins;
+  for (unsigned int iStage=0; iStage<stages.size(); iStage++)
+    allBins.insert(allBins.end(), stages[iStage].begin(), stages[iStage].end());
+  vector<BinIndex> allIndex(allBins.size());
+  if (opt.plotMode != 2) {
+    // Workers are forked after the samples are in memory, so each of them reads
+    // the parent's copy instead of the input files; column file samples are
+    // already shared through their mapping
+    if (!sampleColumns.count(data)) data->convertToVectorStore();
+    if (!sampleColumns.count(dataMC)) dataMC->convertToVectorStore();
+    if (!sampleColumns.count(dataMC2)) dataMC2->convertToVectorStore();
+    partitionSamples(data, dataMC, dataMC2, allBins, opt, allIndex);
+  }
+  if (opt.ctErrRange == 0 && loadCtauErrTable(opt.ctErrFile, ctErrTable) >= 0) {
+    // Parsed once here instead of once per bin
+    ctErrTableFile = opt.ctErrFile;
+  }
+
+  int nFailed = 0;
+  unsigned int binOffset = 0;
+  for (unsigned int iStage=0; iStage<stages.size(); iStage++) {
+    const vector<BinOpt> &bins = stages[iStage];
+    const BinIndex *stageIndex = &allIndex[binOffset];
+    binOffset += bins.size();
+    if (opt.ctErrRange == 3 && opt.plotMode != 2) {
+      int nMissing = fillCtauErrTable(opt, data, bins, stageIndex);
+      if (nMissing > 0) cout << "## " << nMissing << " bins of stage " << iStage << " without ctau error range in the table" << endl;
+    }
+    cout << "## Stage " << iStage << ": " << bins.size() << " bins with " << opt.nWorkers << " workers" << endl;
+
+    BinJobs jobs;
+    jobs.data = data;
+    jobs.dataMC = dataMC;
+    jobs.dataMC2 = dataMC2;
+    for (unsigned int iBin=0; iBin<bins.size(); iBin++) {
+      InputOpt binOpt = opt;
+      binOpt.yrange = bins[iBin].yrange;
+      binOpt.prange = bins[iBin].prange;
+      binOpt.crange = bins[iBin].crange;
+      binOpt.phirange = bins[iBin].phirange;
+      if (bins[iBin].lifetimeOpt >= 0) setLifetimeOpt(binOpt, bins[iBin].lifetimeOpt);
+      if (binOpt.useWeightedNP != opt.useWeightedNP) {
+        cout << "## SKIPPED: lifetime option " << bins[iBin].lifetimeOpt << " needs the other NP MC sample than -a" << endl;
+        nFailed++;
+        continue;
+      }
+
+      jobs.binOpts.push_back(binOpt);
+      jobs.indices.push_back(&stageIndex[iBin]);
+      jobs.works.push_back(binOpt.dirPre + "_rap" + binOpt.yrange + "_pT" + binOpt.prange + "_cent" + binOpt.crange + "_dPhi" + binOpt.phirange);
+    }
+    nFailed += runWorkers(jobs, jobs.works.size(), opt.nWorkers, 0);
+    if (opt.simFit != 0 && opt.plotMode != 2) nFailed += runSimFits(opt, bins);
+  }
+
+  cout << "## Multi-bin driver finished, failed bins: " << nFailed << endl;
+  return (nFailed == 0) ? 0 : 1;
+}
+
+/////////////////////////////////////////////////////////
+////////// Simultaneous fit of bin groups ///////////////
+/////////////////////////////////////////////////////////
+// With -h 1 (2) the bins of a driver stage that differ only in centrality (dPhi)
+// form a group, the inclusive 0.0-100.0 (0.000-1.571) bin left out. Once the
+// bins of the stage have been fitted one by one, the final models of a group
+// are fitted together: RooSimultaneous over a bin category, the ctau resolution
+// and b-lifetime parameters shared, yields, Bfrac and background shapes per bin.
+// Shared resolution parameters that the single bin fits take from the min-bias
+// .txt file are free here, unless -u fixes the resolution to MC. Each group is
+// fitted in a forked process, with its NLL components spread over the workers
+// of -n. Results are written to <bin>_simFit.txt for every bin of the group.
+// A group only holds disjoint bins, otherwise events would enter the joint NLL
+// more than once: when a stage mixes binnings (centfiner and centcoarser3 of
+// runLocal_raa.sh), a bin overlapping one already in its group is left out, so
+// the first bins of the list win.
+const char *simSharedPars = "fracRes,fracRes2,fracRes3,meanResSigN,meanResSigW,sigmaResSigN,sigmaResSigW,bTau,bTau1,bTau2,cutx";
+
+// Bin groups of one driver stage, one simultaneous fit job per group
+struct SimFitJobs : public WorkerJobs {
+  InputOpt *opt;
+  vector< vector<BinOpt> > groups;
+  vector<string> groupNames;
+
+  int run(int i, double *rec) {
+    redirectLog(groupNames[i] + ".log");
+    return simFitGroup(*opt, groups[i], groupNames[i]);
+  }
+  void started(int i, pid_t pid) {
+    cout << "## Started: " << groupNames[i] << " (" << groups[i].size() << " bins, pid " << pid << ")" << endl;
+  }
+  void done(int i, const double *rec, bool ok) {
+    cout << "## " << (ok ? "Done: " : "FAILED: ") << groupNames[i] << endl;
+  }
+};
+
+int runSimFits(InputOpt &opt, const vector<BinOpt> &bins) {
+  map< string, vector<BinOpt> > groups;
+  for (unsigned int iBin=0; iBin<bins.size(); iBin++) {
+    InputOpt binOpt = opt;
+    if (bins[iBin].lifetimeOpt >= 0) setLifetimeOpt(binOpt, bins[iBin].lifetimeOpt);
+    if (!binOpt.doBfit) continue;  // no final fit
+    string key;
+    if (opt.simFit == 1) {
+      if (!bins[iBin].crange.compare("0.0-100.0")) continue;
+      key = "_rap" + bins[iBin].yrange + "_pT" + bins[iBin].prange + "_dPhi" + bins[iBin].phirange + "_simCent";
+    } else {
+      if (!bins[iBin].phirange.compare("0.000-1.571")) continue;
+      key = "_rap" + bins[iBin].yrange + "_pT" + bins[iBin].prange + "_cent" + bins[iBin].crange + "_simDPhi";
+    }
+    vector<BinOpt> &group = groups[key];
+    string range = (opt.simFit == 1) ? bins[iBin].crange : bins[iBin].phirange;
+    double lo = 0, hi = 0;
+    getOptRange(range, &lo, &hi);
+    bool found = false, overlap = false;
+    for (unsigned int j=0; j<group.size() && !found && !overlap; j++) {
+      string other = (opt.simFit == 1) ? group[j].crange : group[j].phirange;
+      double otherLo = 0, otherHi = 0;
+      getOptRange(other, &otherLo, &otherHi);
+      if (lo == otherLo && hi == otherHi) found = true;
+      else if (lo < otherHi && otherLo < hi) {
+        overlap = true;
+        cout << "## Simultaneous fit " << opt.dirPre << key << ": " << range << " left out, overlaps " << other << endl;
+      }
+    }
+    if (!found && !overlap) group.push_back(bins[iBin]);
+  }
+
+  // One group at a time, its fit spreads the NLL over the workers of -n
+  SimFitJobs jobs;
+  jobs.opt = &opt;
+  for (map< string, vector<BinOpt> >::iterator it=groups.begin(); it!=groups.end(); ++it) {
+    if (it->second.size() < 2) continue;
+    jobs.groups.push_back(it->second);
+    jobs.groupNames.push_back(opt.dirPre + it->first);
+    cout << "## Simultaneous fit group " << opt.dirPre + it->first << ":";
+    for (unsigned int j=0; j<it->second.size(); j++)
+      cout << " " << ((opt.simFit == 1) ? it->second[j].crange : it->second[j].phirange);
+    cout << endl;
+  }
+  return runWorkers(jobs, jobs.groups.size(), 1, 0);
+}
+
+int simFitGroup(InputOpt &opt, const vector<BinOpt> &group, const string &groupName) {
+  RooWorkspace *sim = new RooWorkspace("simWorkspace");
+  RooCategory binCat("binCat","Bins of the group");
+  map<string,RooDataSet*> dataMap;
+  vector<string> labels, works;
+  vector<RooFitResult*> binFits;
+  // Model of the final fit of fitBin
+  bool isPEE = (opt.prefitMass && opt.isPEE == 1);
+  const char *pdfName = isPEE ? "totPDF_PEE" : "totPDF";
+  string keepNames = string("Jpsi_Mass,Jpsi_Ct,Jpsi_CtErr,") + simSharedPars;
+
+  for (unsigned int i=0; i<group.size(); i++) {
+    string work = opt.dirPre + "_rap" + group[i].yrange + "_pT" + group[i].prange + "_cent" + group[i].crange + "_dPhi" + group[i].phirange;
+    TFile fIn((work + "_ws.root").c_str());
+    RooWorkspace *ws = fIn.IsZombie() ? 0 : (RooWorkspace*)fIn.Get("workspace");
+    if (ws == 0 || ws->pdf(pdfName) == 0 || ws->data("simFitData") == 0 || ws->obj("fit2D") == 0) {
+      cout << "simFitGroup:: No final fit inputs in " << work << "_ws.root" << endl;
+      return 1;
+    }
+    char label[32];
+    sprintf(label,"bin%d",i);
+    binCat.defineType(label);
+
+    // Shared parameters and observables keep their names, the first bin sets their starting values
+    sim->import(*(ws->pdf(pdfName)), RenameAllNodes(label), RenameAllVariablesExcept(label, keepNames.c_str()), Silence());
+    dataMap[label] = (RooDataSet*)ws->data("simFitData")->Clone();
+    binFits.push_back((RooFitResult*)ws->obj("fit2D")->Clone());
+    labels.push_back(label);
+    works.push_back(work);
+    delete ws;
+    fIn.Close();
+  }
+
+  RooSimultaneous simPdf("simPdf","Simultaneous fit of the bin group",binCat);
+  for (unsigned int i=0; i<labels.size(); i++) {
+    simPdf.addPdf(*(sim->pdf((string(pdfName) + "_" + labels[i]).c_str())), labels[i].c_str());
+  }
+
+  // Rows of every bin tagged with its label, weights carried over as in selectEntries
+  RooDataSet *first = dataMap[labels[0]];
+  RooArgSet dataVars(*(first->get()), binCat);
+  RooRealVar simWeight("simWeight","Event weight",1.0);
+  RooDataSet *simData;
+  if (first->isWeighted()) {
+    dataVars.add(simWeight);
+    simData = new RooDataSet("simData","Samples of the bin group",dataVars,WeightVar(simWeight));
+  } else {
+    simData = new RooDataSet("simData","Samples of the bin group",dataVars);
+  }
+  // One row object of simData is filled for every entry: bin label once per bin, values per entry
+  RooArgSet *simRow = (RooArgSet*)simData->get();
+  RooCategory *rowCat = (RooCategory*)simRow->find(binCat.GetName());
+  for (unsigned int i=0; i<labels.size(); i++) {
+    RooDataSet *ds = dataMap[labels[i]];
+    rowCat->setLabel(labels[i].c_str());
+    for (Int_t iEntry=0; iEntry<ds->numEntries(); iEntry++) {
+      *simRow = *(ds->get(iEntry));
+      simData->add(*simRow, ds->weight());
+    }
+  }
+
+  // Floating parameters as in the final fit of each bin, shared ones as in the first bin
+  RooArgSet *pars = simPdf.getParameters(*simData);
+  TIterator *itPar = pars->createIterator();
+  RooAbsArg *arg;
+  while ((arg = (RooAbsArg*)itPar->Next())) {
+    RooRealVar *var = dynamic_cast<RooRealVar*>(arg);
+    if (var) var->setConstant(kTRUE);
+  }
+  delete itPar;
+  string shared = string(",") + simSharedPars + ",";
+  for (unsigned int i=0; i<binFits.size(); i++) {
+    const RooArgList &fin = binFits[i]->floatParsFinal();
+    for (Int_t j=0; j<fin.getSize(); j++) {
+      string name = fin.at(j)->GetName();
+      bool isShared = (shared.find("," + name + ",") != string::npos);
+      if (isShared && i != 0) continue;
+      RooRealVar *var = (RooRealVar*)pars->find(isShared ? name.c_str() : (name + "_" + labels[i]).c_str());
+      if (var) var->setConstant(kFALSE);
+    }
+  }
+  if (!opt.oneGaussianResol && !opt.fixResol2MC) {
+    const char *handoff[] = {"fracRes","meanResSigW","sigmaResSigW"};
+    for (unsigned int j=0; j<sizeof(handoff)/sizeof(handoff[0]); j++) {
+      RooRealVar *var = (RooRealVar*)pars->find(handoff[j]);
+      if (var) var->setConstant(kFALSE);
+    }
+  }
+
+  TStopwatch timer;
+  timer.Start(kTRUE);
+  RooFitResult *simRes;
+  if (isPEE) {
+    simRes = simPdf.fitTo(*simData,Save(1),SumW2Error(kTRUE),Extended(!opt.prefitMass),NumCPU(opt.nWorkers,2),ConditionalObservables(RooArgSet(*(sim->var("Jpsi_CtErr")))));
+  } else {
+    simRes = simPdf.fitTo(*simData,Save(1),SumW2Error(kTRUE),Extended(!opt.prefitMass),NumCPU(opt.nWorkers,2));
+  }
+  timer.Stop();
+  if (simRes == 0) { cout << "simFitGroup:: fit failed" << endl; return 1; }
+  simRes->Print("v");
+  cout << "simFitGroup:: " << groupName << " : " << labels.size() << " bins, " << simRes->floatParsFinal().getSize()
+       << " parameters, real time " << timer.RealTime() << " s" << endl;
+
+  for (unsigned int i=0; i<labels.size(); i++) {
+    string suffix = "_" + labels[i];
+    double NSig_fin = sim->var(("NSig" + suffix).c_str()) ? sim->var(("NSig" + suffix).c_str())->getVal() : 0;
+    double ErrNSig_fin = sim->var(("NSig" + suffix).c_str()) ? sim->var(("NSig" + suffix).c_str())->getError() : 0;
+    double Bfrac_fin, ErrBfrac_fin, NSigPR_fin, ErrNSigPR_fin, NSigNP_fin, ErrNSigNP_fin;
+    if (opt.prefitMass) {
+      // Same propagation as the single bin fit
+      Bfrac_fin = sim->var(("Bfrac" + suffix).c_str())->getVal();
+      ErrBfrac_fin = sim->var(("Bfrac" + suffix).c_str())->getError();
+      if (opt.doWeight == 2) {
+        NSig_fin *= dataMap[labels[i]]->sumEntries();
+        ErrNSig_fin *= dataMap[labels[i]]->sumEntries();
+      }
+      NSigNP_fin = NSig_fin * Bfrac_fin;
+      NSigPR_fin = NSig_fin * (1-Bfrac_fin);
+      ErrNSigNP_fin = NSigNP_fin * sqrt( pow(ErrNSig_fin/NSig_fin,2)+pow(ErrBfrac_fin/Bfrac_fin,2) );
+      ErrNSigPR_fin = NSigPR_fin * sqrt ( pow(ErrNSig_fin/NSig_fin,2)+pow(ErrBfrac_fin/(1.0-Bfrac_fin),2) );
+    } else {
+      NSigNP_fin = sim->var(("NSigNP" + suffix).c_str())->getVal();
+      NSigPR_fin = sim->var(("NSigPR" + suffix).c_str())->getVal();
+      ErrNSigNP_fin = sim->var(("NSigNP" + suffix).c_str())->getError();
+      ErrNSigPR_fin = sim->var(("NSigPR" + suffix).c_str())->getError();
+      Bfrac_fin = NSigNP_fin/(NSigNP_fin+NSigPR_fin);
+      ErrBfrac_fin = sqrt( pow(NSigNP_fin*ErrNSigPR_fin,2) + pow(NSigPR_fin*ErrNSigNP_fin,2) ) / pow(NSigNP_fin+NSigPR_fin,2);
+    }
+
+    string titlestr = works[i] + "_simFit.txt";
+    ofstream outputFile(titlestr.c_str());
+    if (!outputFile.good()) { cout << "Fail to open result file: " << titlestr << endl; return 1; }
+    outputFile
+    << "Group "        << groupName                         << " " << labels.size() << "\n"
+    << "NSig "         << NSig_fin                          << " " << ErrNSig_fin << "\n"
+    << "PROMPT "       << NSigPR_fin                        << " " << ErrNSigPR_fin << "\n"
+    << "NON-PROMPT "   << NSigNP_fin                        << " " << ErrNSigNP_fin << "\n"
+    << "Bfraction "    << Bfrac_fin                         << " " << ErrBfrac_fin << "\n";
+    const RooArgList &fin = simRes->floatParsFinal();
+    for (Int_t j=0; j<fin.getSize(); j++) {
+      RooRealVar *var = (RooRealVar*)fin.at(j);
+      if (shared.find(string(",") + var->GetName() + ",") == string::npos) continue;
+      outputFile << var->GetName() << " " << var->getVal() << " " << var->getError() << "\n";
+    }
+    outputFile
+    << "NLL "          << simRes->minNll()                  << "\n"
+    << "nFitPar "      << fin.getSize()                     << "\n"
+    << "EDM "          << simRes->edm()                     << "\n"
+    << "Status "       << simRes->status()                  << endl;
+    outputFile.close();
+  }
+
+  int status = simRes->status();
+  for (unsigned int i=0; i<labels.size(); i++) { delete dataMap[labels[i]]; delete binFits[i]; }
+  delete simRes;
+  delete pars;
+  delete simData;
+  delete sim;
+  return (status == 0) ? 0 : 1;
+}
+
+/////////////////////////////////////////////////////////
+////////// Plotting stage ///////////////////////////////
+/////////////////////////////////////////////////////////
+// With -q 1 the fit skips all PDF projections and stores in the workspace of
+// the bin what the drawing functions need: the data columns that are plotted,
+// the ctau error distributions used as ProjWData, the result of every fit
+// stage and the numbers printed on the plots. -q 2 draws the same plots from
+// that workspace without fitting, one bin or all bins of -n in parallel.
+void addPlotBundle(RooWorkspace *ws, RooDataSet *redDataCut, RooDataSet *redMCCutPR, RooDataHist *binDataCtErr, RooDataHist *binDataCtErrSB, RooFitResult *fitM, RooFitResult *fit2D, double NSigNP_fin, double NBkg_fin, InputOpt &opt) {
+  RooArgSet obs(*(ws->var("Jpsi_Mass")),*(ws->var("Jpsi_Ct")),*(ws->var("Jpsi_CtErr")));
+  RooDataSet *plotData = (RooDataSet*)redDataCut->reduce(SelectVars(obs),Name("plotData"));
+  RooDataSet *plotMCPR = (RooDataSet*)redMCCutPR->reduce(SelectVars(obs),Name("plotMCPR"));
+  ws->import(*plotData);
+  ws->import(*plotMCPR);
+  ws->import(*binDataCtErr);
+  ws->import(*binDataCtErrSB);
+  delete plotData;
+  delete plotMCPR;
+
+  // Stage results, fitPR and fitSB(L/R) are added right after their fits
+  if (fitM) ws->import(*fitM,"fitM",kTRUE);
+  if (fit2D) ws->import(*fit2D,"fit2D",kTRUE);
+
+  RooRealVar plotNSigNP("plotNSigNP","non-prompt yield on the plots",NSigNP_fin);
+  RooRealVar plotNBkg("plotNBkg","background yield on the plots",NBkg_fin);
+  RooRealVar plotWidth("plotWidth","combined mass width on the plots (MeV)",opt.PcombinedWidth);
+  plotWidth.setError(opt.PcombinedWidthErr);
+  ws->import(RooArgSet(plotNSigNP,plotNBkg,plotWidth));
+}
+
+int plotBin(InputOpt &inOpt) {
+  setBinOpt(inOpt);
+
+  string titlestr = inOpt.dirPre + "_rap" + inOpt.yrange + "_pT" + inOpt.prange + "_cent" + inOpt.crange + "_dPhi" + inOpt.phirange + "_ws.root";
+  TFile fIn(titlestr.c_str());
+  if (fIn.IsZombie()) { cout << "CANNOT open fit result file: " << titlestr << endl; return 1; }
+  RooWorkspace *ws = (RooWorkspace*)fIn.Get("workspace");
+  if (ws == 0 || ws->data("plotData") == 0) {
+    cout << titlestr << " has no plot bundle, fit with -q 1 first" << endl;
+    return 1;
+  }
+
+  RooDataSet *redDataCut = (RooDataSet*)ws->data("plotData");
+  RooDataSet *redMCCutPR = (RooDataSet*)ws->data("plotMCPR");
+  RooDataHist *binDataCtErr = (RooDataHist*)ws->data("binDataCtErr");
+  RooDataHist *binDataCtErrSB = (RooDataHist*)ws->data("binDataCtErrSB");
+  RooFitResult *fitM = (RooFitResult*)ws->obj("fitM");
+  RooFitResult *fit2D = (RooFitResult*)ws->obj("fit2D");
+  RooFitResult *fitPR = (RooFitResult*)ws->obj("fitPR");
+  RooFitResult *fitSB = (RooFitResult*)ws->obj("fitSB");
+  RooFitResult *fitSBL = (RooFitResult*)ws->obj("fitSBL");
+  RooFitResult *fitSBR = (RooFitResult*)ws->obj("fitSBR");
+  double NSigNP_fin = ws->var("plotNSigNP")->getVal();
+  double NBkg_fin = ws->var("plotNBkg")->getVal();
+  inOpt.PcombinedWidth = ws->var("plotWidth")->getVal();
+  inOpt.PcombinedWidthErr = ws->var("plotWidth")->getError();
+
+  RooDataSet *redDataSB;
+  if (inOpt.narrowSideband) redDataSB = (RooDataSet*) redDataCut->reduce("Jpsi_Mass<2.8 || Jpsi_Mass>3.4");
+  else redDataSB = (RooDataSet*) redDataCut->reduce("Jpsi_Mass<2.9 || Jpsi_Mass>3.3");
+  RooDataSet *redDataSBL = (RooDataSet*) redDataCut->reduce("Jpsi_Mass<2.9");
+  RooDataSet *redDataSBR = (RooDataSet*) redDataCut->reduce("Jpsi_Mass>3.3");
+
+  // The workspace holds the parameters of the last fit: final plots first,
+  // then each earlier stage with its own result restored, latest stage first
+  RooArgSet pars(ws->allVars());
+  if (inOpt.doBfit) {
+    drawMassPlotsWithB(ws, redDataCut, NSigNP_fin, NBkg_fin, fitM, inOpt);
+    if (inOpt.drawTimeConsumingPlots) {
+      drawCtauFitPlots(ws, redDataCut, binDataCtErr, NSigNP_fin, NBkg_fin, fit2D, inOpt);
+      drawMassCtau2DPlots(ws, inOpt) ;
+    }
+  } else if (fitM) {
+    drawMassPlotsWithoutB(ws, redDataCut, fitM, inOpt);
+  }
+
+  if (inOpt.drawTimeConsumingPlots && (fitSB || fitSBL || fitSBR)) {
+    if (fitSB) restoreFitResult(&pars, fitSB);
+    if (fitSBR) restoreFitResult(&pars, fitSBR);
+    if (fitSBL) restoreFitResult(&pars, fitSBL);
+    drawCtauSBPlots(ws, redDataSB, redDataSBL, redDataSBR, binDataCtErrSB, fitSB, fitSBL, fitSBR, inOpt);
+  }
+  if (inOpt.drawTimeConsumingPlots && fitPR) {
+    restoreFitResult(&pars, fitPR);
+    RooPlot *tframePR = 0;
+    ctauResolFitCheck(ws, true, redMCCutPR, tframePR, inOpt);
+  }
+  if (fitM) {
+    restoreFitResult(&pars, fitM);
+    drawMassFitParsNLL(ws, redDataCut, inOpt);
+  }
 
+  fIn.Close();
   return 0;
 }
 
@@ -1456,7 +1996,36 @@ void parseInputArg(int argc, char* argv[], InputOpt &opt) {
   opt.is2Widths = 1;
   opt.ctauBackground = 0;
 
-  opt.ctErrRange = 1; //0: ctau error range will be inserted from other file
+  opt.binList = "";   // empty: fit the single bin given by -p -y -t -s
+  opt.nWorkers = 1;
+  opt.binnedFit = 0;  // unbinned fits
+  opt.nMassBins = 45;
+  opt.nCtBins = 200;
+  opt.nCtErrBins = 25;
+  opt.binnedCheck = "";
+  opt.fitCacheDir = "";  // no fit result cache
+  opt.warmStart = false;
+  opt.templateCacheDir = "";  // no NP MC template cache
+  opt.gradMass = false;  // mass fits with numerical gradients only
+  opt.plotMode = 0;  // plots drawn right after the fits
+  opt.profilePoints = 0;  // Hesse errors only
+  opt.profileWorkers = 1;
+  opt.profileScan = "";
+  opt.nToys = 0;  // no toy study
+  opt.toyWorkers = 1;
+  opt.toySeed = 1;
+  opt.toyStudy = "";
+  opt.simFit = 0;  // bins fitted one by one
+  opt.useColumns = 1;  // column files are used when the dataset makers wrote them
+  opt.erfcStep = 0;  // TMath::Erfc in the template convolution
+  opt.erfcValidate = false;
+  opt.gridNU = 0;  // no convolution grid
+  opt.gridNS = 0;
+  opt.gridSMin = 0;
+  opt.gridSMax = 0;
+  opt.fftKeys = true;  // FFT version of the MLAR keys template
+
+  opt.ctErrRange = 1; //0: ctau error range will be inserted from other file, 3: indexed table filled by the driver
   opt.ctErrFile = "/afs/cern.ch/work/m/miheejo/private/cms442_Jpsi/src/JpsiRaaRegIt/RegIt/";
 
   for (int i=1; i<argc; i++) {
@@ -1547,37 +2116,7 @@ void parseInputArg(int argc, char* argv[], InputOpt &opt) {
             cout << "dPhi(J/psi) range: " << opt.phirange << " rad" << endl;
             break;
           case 'a':
-            if (atoi(argv[i+1]) == 0) {
-              opt.analyticBlifetime = false;
-              opt.doBfit = true;
-              opt.drawTimeConsumingPlots = true;
-              opt.useWeightedNP = false;
-              cout << "Turn Off: RooHistPdf from MC template of J/psi Ctau lifetime will be used" << endl;
-            } else if (atoi(argv[i+1]) == 1) {
-              opt.analyticBlifetime = true;
-              opt.doBfit = true;
-              opt.drawTimeConsumingPlots = true;
-              opt.useWeightedNP = false;
-              cout << "Turn On: Analytical MC J/psi Ctau lifetime PDF will be used" << endl;
-            } else if (atoi(argv[i+1]) == 2) {
-              opt.analyticBlifetime = false;
-              opt.doBfit = false;
-              opt.drawTimeConsumingPlots = false;
-              opt.useWeightedNP = false;
-              cout << "Turn Off: Only inclusive fitting will be performed" << endl;
-            } else if (atoi(argv[i+1]) == 3) {
-              opt.analyticBlifetime = true;
-              opt.doBfit = true;
-              opt.drawTimeConsumingPlots = false;
-              opt.useWeightedNP = false;
-              cout << "Turn On: Analytical MC J/psi Ctau lifetime PDF will be used & no time-consuming plots" << endl;
-            } else if (atoi(argv[i+1]) == 4) {
-              opt.analyticBlifetime = false;
-              opt.doBfit = true;
-              opt.drawTimeConsumingPlots = true;
-              opt.useWeightedNP = true;
-              cout << "Turn Off: RooKeysPdf from MC (weighted reco) of J/psi Ctau lifetime will be used" << endl;
-            }
+            setLifetimeOpt(opt, atoi(argv[i+1]));
             if (atoi(argv[i+2]) == 0) {
               opt.ctauBackground = 0;
               cout << "1 Lifetime background function is fitted over all sideband events" << endl;
@@ -1598,6 +2137,7 @@ void parseInputArg(int argc, char* argv[], InputOpt &opt) {
             cout << "CTau error range option: " << opt.ctErrRange << endl;
             opt.ctErrFile = argv[i+3];
             cout << "CTau error range input file: " << opt.ctErrFile << endl;
+            if (opt.ctErrRange == 3) cout << "         Bins missing in this indexed table are determined once and added to it" << endl;
             break;
           case 'b':
             opt.isPbPb = atoi(argv[i+1]);
@@ -1616,6 +2156,104 @@ void parseInputArg(int argc, char* argv[], InputOpt &opt) {
               cout << "Fix frac2,3 AFTER ctau bkg fitting" << endl;
             }
             break;
+          case 'n':
+            opt.binList = argv[i+1];
+            cout << "Bin list for the multi-bin driver: " << opt.binList << endl;
+            opt.nWorkers = atoi(argv[i+2]);
+            if (opt.nWorkers < 1) opt.nWorkers = 1;
+            cout << "Number of parallel bin fits: " << opt.nWorkers << endl;
+            break;
+          case 'k':
+            opt.binnedFit = atoi(argv[i+1]);
+            opt.nMassBins = atoi(argv[i+2]);
+            opt.nCtBins = atoi(argv[i+3]);
+            opt.nCtErrBins = atoi(argv[i+4]);
+            if (opt.binnedFit == 1) {
+              cout << "Turn On: binned likelihood for mass, sideband and final fits" << endl;
+            } else if (opt.binnedFit == 2) {
+              cout << "Turn On: binned likelihood for mass, sideband and final fits, compared to unbinned fits" << endl;
+            }
+            cout << "         Mass/ctau/ctau error bins: " << opt.nMassBins << " " << opt.nCtBins << " " << opt.nCtErrBins << endl;
+            break;
+          case 'c':
+            opt.fitCacheDir = argv[i+1];
+            cout << "Fit result cache: " << opt.fitCacheDir << endl;
+            opt.warmStart = atoi(argv[i+2]);
+            cout << "Start fits from the nearest cached bin: " << opt.warmStart << endl;
+            break;
+          case 'w':
+            opt.templateCacheDir = argv[i+1];
+            cout << "Non-prompt MC template cache: " << opt.templateCacheDir << endl;
+            break;
+          case 'g':
+            opt.gradMass = atoi(argv[i+1]);
+            cout << "Mass fits pre-minimized with analytic gradients: " << opt.gradMass << endl;
+            break;
+          case 'i':
+            opt.profilePoints = atoi(argv[i+1]);
+            opt.profileWorkers = atoi(argv[i+2]);
+            if (opt.profileWorkers < 1) opt.profileWorkers = 1;
+            if (opt.profilePoints > 0) {
+              cout << "Turn On: profile likelihood scan of Bfrac, NSig, NBkg in the mass and final fits" << endl;
+              cout << "         Points per parameter/parallel workers: " << opt.profilePoints << " " << opt.profileWorkers << endl;
+            }
+            break;
+          case 'j':
+            opt.nToys = atoi(argv[i+1]);
+            opt.toyWorkers = atoi(argv[i+2]);
+            if (opt.toyWorkers < 1) opt.toyWorkers = 1;
+            opt.toySeed = atoi(argv[i+3]);
+            if (opt.nToys > 0) {
+              cout << "Turn On: toy MC pull study of the mass and final fits" << endl;
+              cout << "         Toys per fit/parallel workers/seed: " << opt.nToys << " " << opt.toyWorkers << " " << opt.toySeed << endl;
+            }
+            break;
+          case 'E':
+            opt.erfcStep = atof(argv[i+1]);
+            opt.erfcValidate = atoi(argv[i+2]);
+            if (opt.erfcStep > 0) {
+              cout << "Turn On: tabulated erfc in the non-prompt template convolution, step " << opt.erfcStep << endl;
+              if (opt.erfcValidate) cout << "         Largest deviation from TMath::Erfc printed after the final fit" << endl;
+            }
+            break;
+          case 'G':
+            opt.gridNU = atoi(argv[i+1]);
+            opt.gridNS = atoi(argv[i+2]);
+            opt.gridSMin = atof(argv[i+3]);
+            opt.gridSMax = atof(argv[i+4]);
+            if (opt.gridNU > 1) {
+              cout << "Turn On: interpolation grid of the non-prompt template convolution" << endl;
+              cout << "         Shift/width points, width range: " << opt.gridNU << " " << opt.gridNS << " " << opt.gridSMin << " " << opt.gridSMax << endl;
+            }
+            break;
+          case 'K':
+            opt.fftKeys = atoi(argv[i+1]);
+            cout << "MLAR non-prompt template with RooFFTKeysPdf (1) or RooKeysPdf (0): " << opt.fftKeys << endl;
+            break;
+          case 'o':
+            opt.useColumns = atoi(argv[i+1]);
+            if (opt.useColumns == 2) {
+              cout << "Check: bins selected from the column files against the RooDataSets, no fit" << endl;
+            } else {
+              cout << "Read input samples from column files when present: " << opt.useColumns << endl;
+            }
+            break;
+          case 'h':
+            opt.simFit = atoi(argv[i+1]);
+            if (opt.simFit == 1) {
+              cout << "Turn On: simultaneous fit of the centrality bins of each rap/pT/dPhi bin (-n driver)" << endl;
+            } else if (opt.simFit == 2) {
+              cout << "Turn On: simultaneous fit of the dPhi bins of each rap/pT/centrality bin (-n driver)" << endl;
+            }
+            break;
+          case 'q':
+            opt.plotMode = atoi(argv[i+1]);
+            if (opt.plotMode == 1) {
+              cout << "Fit only: plot inputs are written to the _ws.root file of each bin" << endl;
+            } else if (opt.plotMode == 2) {
+              cout << "Plot only: plots are drawn from the _ws.root file of each bin, no fit" << endl;
+            }
+            break;
         }
       }
     }
@@ -1623,6 +2261,40 @@ void parseInputArg(int argc, char* argv[], InputOpt &opt) {
 
 } 
 
+void setLifetimeOpt(InputOpt &opt, int mode) {
+  if (mode == 0) {
+    opt.analyticBlifetime = false;
+    opt.doBfit = true;
+    opt.drawTimeConsumingPlots = true;
+    opt.useWeightedNP = false;
+    cout << "Turn Off: RooHistPdf from MC template of J/psi Ctau lifetime will be used" << endl;
+  } else if (mode == 1) {
+    opt.analyticBlifetime = true;
+    opt.doBfit = true;
+    opt.drawTimeConsumingPlots = true;
+    opt.useWeightedNP = false;
+    cout << "Turn On: Analytical MC J/psi Ctau lifetime PDF will be used" << endl;
+  } else if (mode == 2) {
+    opt.analyticBlifetime = false;
+    opt.doBfit = false;
+    opt.drawTimeConsumingPlots = false;
+    opt.useWeightedNP = false;
+    cout << "Turn Off: Only inclusive fitting will be performed" << endl;
+  } else if (mode == 3) {
+    opt.analyticBlifetime = true;
+    opt.doBfit = true;
+    opt.drawTimeConsumingPlots = false;
+    opt.useWeightedNP = false;
+    cout << "Turn On: Analytical MC J/psi Ctau lifetime PDF will be used & no time-consuming plots" << endl;
+  } else if (mode == 4) {
+    opt.analyticBlifetime = false;
+    opt.doBfit = true;
+    opt.drawTimeConsumingPlots = true;
+    opt.useWeightedNP = true;
+    cout << "Turn Off: RooKeysPdf from MC (weighted reco) of J/psi Ctau lifetime will be used" << endl;
+  }
+}
+
 void getOptRange(string &ran, double *min, double *max) {
   if (sscanf(ran.c_str(), "%lf-%lf", min, max) == 0) {
     cout << ran.c_str() << ": not valid!" << endl;
@@ -1631,6 +2303,23 @@ void getOptRange(string &ran, double *min, double *max) {
   return ;
 }
 
+void setBinOpt(InputOpt &opt) {
+  double pmin=0, pmax=0, ymin=0, ymax=0, lmin=0, lmax=0, cmin=0, cmax=0, psmax=0, psmin=0, errmin=0, errmax=0;
+  getOptRange(opt.prange,&pmin,&pmax);
+  getOptRange(opt.lrange,&lmin,&lmax);
+  getOptRange(opt.errrange,&errmin,&errmax);
+  getOptRange(opt.crange,&cmin,&cmax);
+  getOptRange(opt.yrange,&ymin,&ymax);
+  getOptRange(opt.phirange,&psmin,&psmax);
+  opt.pmin=pmin; opt.pmax=pmax; opt.ymin=ymin; opt.ymax=ymax; opt.lmin=lmin; opt.lmax=lmax; opt.cmin=cmin; opt.cmax=cmax; opt.psmax=psmax; opt.psmin=psmin; opt.errmin=errmin; opt.errmax=errmax;
+
+  // *** Strings for plot formatting
+  formTitle(opt, cmin, cmax);
+  formRapidity(opt, ymin, ymax);
+  formPt(opt, pmin, pmax);
+  formPhi(opt, psmin, psmax);
+}
+
 void formTitle(InputOpt &opt, double cmin, double cmax) {
   if (opt.isPbPb == 1) {
     // Use for pbpb data set
@@ -1742,33 +2431,182 @@ void formPhi(InputOpt &opt, double psmin, double psmax) {
 
 
 int readCtauErrRange(InputOpt &opt, double *errmin, double *errmax) {
-  ifstream errinput;
-  errinput.open(opt.ctErrFile.c_str(),ifstream::in);
-  if (!errinput.good()) {
-    cout << "readCtauErrRange:: CANNOT read ctau error list file. Exit." << endl;
-    return -1;
-  }
-  string headers;
-  getline(errinput, headers); // prefix
-  getline(errinput, headers); // column names
-
-  string rap, pt, cent, dphi, emin, emax;
-  while (!errinput.eof()) {
-    errinput >> rap >> pt >> cent >> dphi >> emin >> emax;
-    if (!rap.compare(opt.yrange) && !pt.compare(opt.prange) && !cent.compare(opt.crange) && !dphi.compare(opt.phirange)) {
-      *errmin = atof(emin.c_str());
-      *errmax = atof(emax.c_str());
-      return 0;
-    } else continue;
-  }
-
-  cout << "readCtauErrRange:: CANNOT read ctau error range from a file. Exit." << endl;
-  return -2;
+  // The table is read once per process, workers of the driver inherit the parent's copy
+  if (ctErrTableFile.compare(opt.ctErrFile)) {
+    ctErrTable.clear();
+    if (loadCtauErrTable(opt.ctErrFile, ctErrTable) < 0) {
+      cout << "readCtauErrRange:: CANNOT read ctau error list file: " << opt.ctErrFile << endl;
+      return -1;
+    }
+    ctErrTableFile = opt.ctErrFile;
+  }
+
+  CtErrTable::const_iterator it = ctErrTable.find(ctErrKey(opt));
+  if (it == ctErrTable.end()) {
+    cout << "readCtauErrRange:: No ctau error range for " << ctErrKey(opt) << " in " << opt.ctErrFile << endl;
+    return -2;
+  }
+  *errmin = it->second.first;
+  *errmax = it->second.second;
+  return 0;
+}
+
+string ctErrKey(const InputOpt &opt) {
+  return opt.yrange + " " + opt.prange + " " + opt.crange + " " + opt.phirange;
+}
+
+// Indexed table: "CTERRTB1", number of entries (Int_t), then for each bin the key
+// padded with '\0' to 64 chars and errmin, errmax as doubles, sorted by key.
+// Text tables (prefix and column names, then "rap pT cent dPhi errmin errmax")
+// are read too, the first line of a bin is kept as in the former linear scan.
+// Returns 0: indexed table, 1: text table, -1: no file, -2: broken table
+const char ctErrTableMagic[9] = "CTERRTB1";
+const int ctErrKeyLen = 64;
+
+int loadCtauErrTable(const string &fileName, CtErrTable &table) {
+  ifstream input(fileName.c_str(), ifstream::in|ifstream::binary);
+  if (!input.good()) return -1;
+
+  char magic[8];
+  input.read(magic, 8);
+  if (input.gcount() == 8 && !memcmp(magic, ctErrTableMagic, 8)) {
+    Int_t nEntries = 0;
+    input.read((char*)&nEntries, sizeof(nEntries));
+    char key[ctErrKeyLen];
+    double range[2];
+    for (Int_t i=0; i<nEntries; i++) {
+      input.read(key, ctErrKeyLen);
+      input.read((char*)range, sizeof(range));
+      if (!input.good()) {
+        cout << "loadCtauErrTable:: " << fileName << " is truncated after " << i << " entries" << endl;
+        return -2;
+      }
+      key[ctErrKeyLen-1] = '\0';
+      table[key] = make_pair(range[0], range[1]);
+    }
+    return 0;
+  }
+
+  input.clear();
+  input.seekg(0);
+  string line;
+  getline(input, line); // prefix
+  getline(input, line); // column names
+  while (getline(input, line)) {
+    char rap[512], pt[512], cent[512], dphi[512];
+    double emin, emax;
+    if (sscanf(line.c_str(), "%511s %511s %511s %511s %lf %lf", rap, pt, cent, dphi, &emin, &emax) != 6) continue;
+    string key = string(rap) + " " + pt + " " + cent + " " + dphi;
+    table.insert(make_pair(key, make_pair(emin, emax)));
+  }
+  return 1;
+}
+
+int writeCtauErrTable(const string &fileName, const CtErrTable &table) {
+  // Written under a temporary name, so that parallel drivers never read a partial table
+  char tmpName[4096];
+  sprintf(tmpName,"%s.%d.tmp",fileName.c_str(),(int)getpid());
+  ofstream output(tmpName, ofstream::out|ofstream::binary|ofstream::trunc);
+  if (!output.good()) { cout << "writeCtauErrTable:: Fail to open " << tmpName << endl; return -1; }
+
+  Int_t nEntries = table.size();
+  output.write(ctErrTableMagic, 8);
+  output.write((const char*)&nEntries, sizeof(nEntries));
+  for (CtErrTable::const_iterator it=table.begin(); it!=table.end(); ++it) {
+    char key[ctErrKeyLen];
+    memset(key, 0, ctErrKeyLen);
+    strncpy(key, it->first.c_str(), ctErrKeyLen-1);
+    double range[2] = {it->second.first, it->second.second};
+    output.write(key, ctErrKeyLen);
+    output.write((const char*)range, sizeof(range));
+  }
+  output.close();
+  if (output.fail()) { cout << "writeCtauErrTable:: Fail to write " << tmpName << endl; return -1; }
+  gSystem->Rename(tmpName,fileName.c_str());
+  return 0;
+}
+
+// Bins missing in the indexed ctau error table, one job per bin sending back errmin, errmax
+struct CtErrJobs : public WorkerJobs {
+  RooDataSet *data;
+  vector<InputOpt> binOpts;
+  vector<const BinIndex*> indices;
+  vector<string> works;
+  CtErrTable *table;
+
+  int run(int i, double *rec) {
+    redirectLog(works[i] + "_ctErrRange.log");
+    // getCtauErrRange also reads the bin ranges of the global options
+    InputOpt binOpt = binOpts[i];
+    setBinOpt(binOpt);
+    inOpt = binOpt;
+    RooDataSet *binData = selectEntries(data, indices[i]->data);
+    getCtauErrRange(binData, binOpt, works[i].c_str(), binOpt.lmin, binOpt.lmax, &rec[0], &rec[1]);
+    delete binData;
+    return (rec[1] > rec[0]) ? 0 : 1;
+  }
+  void done(int i, const double *rec, bool ok) {
+    string key = ctErrKey(binOpts[i]);
+    if (ok) {
+      (*table)[key] = make_pair(rec[0], rec[1]);
+      cout << "## Ctau error range: " << key << " " << rec[0] << " " << rec[1] << endl;
+    } else {
+      cout << "## FAILED ctau error range: " << key << endl;
+    }
+  }
+};
+
+// -x isMB 3 file: bins of a driver stage that are not in the indexed table yet
+// get their range as with ctErrRange 1, one forked worker per bin, and are added
+// to it. This runs in front of the fits of the stage, so the inclusive fit
+// results read by getCtauErrRange are there. Returns the number of failed bins.
+int fillCtauErrTable(InputOpt &opt, RooDataSet *data, const vector<BinOpt> &bins, const BinIndex *index) {
+  CtErrTable table;
+  int ret = loadCtauErrTable(opt.ctErrFile, table);
+  if (ret == 1) {
+    cout << "fillCtauErrTable:: " << opt.ctErrFile << " is a text table, give a new file for the indexed table" << endl;
+    return bins.size();
+  } else if (ret == -2) {
+    return bins.size();
+  }
+
+  CtErrJobs jobs;
+  jobs.data = data;
+  jobs.table = &table;
+  map<string,bool> queued;
+  for (unsigned int iBin=0; iBin<bins.size(); iBin++) {
+    InputOpt binOpt = opt;
+    binOpt.yrange = bins[iBin].yrange;
+    binOpt.prange = bins[iBin].prange;
+    binOpt.crange = bins[iBin].crange;
+    binOpt.phirange = bins[iBin].phirange;
+    string key = ctErrKey(binOpt);
+    if (table.find(key) != table.end() || queued.find(key) != queued.end()) continue;
+    queued[key] = true;
+    jobs.binOpts.push_back(binOpt);
+    jobs.indices.push_back(&index[iBin]);
+    jobs.works.push_back(binOpt.dirPre + "_rap" + binOpt.yrange + "_pT" + binOpt.prange + "_cent" + binOpt.crange + "_dPhi" + binOpt.phirange);
+  }
+
+  int nFailed = 0;
+  if (!jobs.works.empty()) {
+    cout << "## Ctau error ranges: " << jobs.works.size() << " bins with " << opt.nWorkers << " workers" << endl;
+    nFailed += runWorkers(jobs, jobs.works.size(), opt.nWorkers, 2);
+
+    // Entries written meanwhile by other drivers sharing the table are kept
+    CtErrTable onDisk;
+    if (loadCtauErrTable(opt.ctErrFile, onDisk) == 0) table.insert(onDisk.begin(), onDisk.end());
+    if (writeCtauErrTable(opt.ctErrFile, table) < 0) nFailed++;
+  }
+
+  // Fit workers forked after this look the ranges up in memory
+  ctErrTable = table;
+  ctErrTableFile = opt.ctErrFile;
+  return nFailed;
 }
 
-void getCtauErrRange(RooDataSet *data, InputOpt &opt, const char *reduceDSOrig, double lmin, double lmax, double *errmin, double *errmax) {
+void getCtauErrRange(RooDataSet *redDataCut, InputOpt &opt, const char *reduceDSOrig, double lmin, double lmax, double *errmin, double *errmax) {
   RooWorkspace *ws = new RooWorkspace("ctauerrorcheckWS");
-  RooDataSet *redDataCut = (RooDataSet*)data->reduce(reduceDSOrig);
   ws->import(*redDataCut);
   
   ws->var("Jpsi_Mass")->setRange(2.6,3.5);
@@ -2072,7 +2910,6 @@ void getCtauErrRange(RooDataSet *data, InputOpt &opt, const char *reduceDSOrig,
   cout << "getCtauErrRange:: " << reduceDSOrig << " " << lmin << " " << lmax << " " << *errmin << " " << *errmax << endl;
   
   delete ws;
-  delete redDataCut;
   delete redDataTmp;
   delete binData;
   delete binDataCtErr;
@@ -2291,22 +3128,13 @@ void drawMassPlotsWithoutB(RooWorkspace *ws, RooDataSet* redDataCut, RooFitResul
   ws->pdf("sigMassPDF")->plotOn(mframe_wob,LineColor(kBlack),LineWidth(2),Normalization(redDataCut->sumEntries(),RooAbsReal::NumEvent));
   redDataCut->plotOn(mframe_wob,DataError(RooAbsData::SumW2),XErrorSize(0),MarkerSize(1),Binning(rb));
 
-  TH1 *hdata = redDataCut->createHistogram("hdata",*ws->var("Jpsi_Mass"),Binning(rb));
   // *** Calculate chi2/nDof for mass fitting
-  int nBins = hdata->GetNbinsX();
-  RooHist *hpullm; hpullm = mframe_wob->pullHist(); hpullm->SetName("hpullM");
-  double Chi2 = 0;
-  int nFullBinsPull = 0;
-  double *ypull = hpullm->GetY();
-  for (unsigned int i=0; i < nBins; i++) {
-    if (hdata->GetBinContent(i+1) == 0) continue;
-    nFullBinsPull++;
-    Chi2 = Chi2 + pow(ypull[i],2);
-  }
-  double UnNormChi2 = Chi2;
+  BinnedGOF gof;
+  binnedGOF(ws->pdf("sigMassPDF"),ws->var("Jpsi_Mass"),rb,redDataCut,0,redDataCut->sumEntries(),gof);
+  RooHist *hpullm = gofHist(gof); hpullm->SetName("hpullM");
+  double UnNormChi2 = gof.chi2;
   int nFitParam = fitM->floatParsFinal().getSize();
-  int Dof = nFullBinsPull - nFitParam;
-  Chi2 /= (nFullBinsPull - nFitParam);
+  int Dof = gof.nFullBins - nFitParam;
 
   // *** Check in narrower signal region NSig
 /*    ws->var("Jpsi_Mass")->setRange("sigpeak",2.9,3.3);
@@ -2529,6 +3357,7 @@ void ctauResolFitCheck(RooWorkspace *ws, bool fitMC, RooDataSet *redMCCutPR, Roo
     return ;
   }
 
+  BinnedGOF gofPR;
   if (fitMC) { // Only the first step requires creating pdfs
     if (opt.isPEE==1) {
       // Check prompt fit is fine with per event error fit. CtWeighted means l/err l
@@ -2557,11 +3386,13 @@ void ctauResolFitCheck(RooWorkspace *ws, bool fitMC, RooDataSet *redMCCutPR, Roo
       tframePR = ws->var("CtWeighted")->frame();
       tempJpsi->plotOn(tframePR,DataError(RooAbsData::SumW2));
       ws->pdf("tempsigPR")->plotOn(tframePR,NumCPU(8),LineColor(kBlue),Normalization(tempJpsi->sumEntries(),RooAbsReal::NumEvent));
+      binnedGOF(ws->pdf("tempsigPR"),ws->var("CtWeighted"),ws->var("CtWeighted")->getBinning(),tempJpsi,0,tempJpsi->sumEntries(),gofPR);
     } else {
       tframePR = ws->var("Jpsi_Ct")->frame();
       tframePR->GetXaxis()->SetTitle("#font[12]{l}_{J/#psi} (mm)");
       redMCCutPR->plotOn(tframePR,DataError(RooAbsData::SumW2));
       ws->pdf("sigPR")->plotOn(tframePR,LineColor(kBlue),Normalization(redMCCutPR->sumEntries(),RooAbsReal::NumEvent));
+      binnedGOF(ws->pdf("sigPR"),ws->var("Jpsi_Ct"),ws->var("Jpsi_Ct")->getBinning(),redMCCutPR,0,redMCCutPR->sumEntries(),gofPR);
     }
   }
 
@@ -2621,55 +3452,12 @@ void ctauResolFitCheck(RooWorkspace *ws, bool fitMC, RooDataSet *redMCCutPR, Roo
   tframePR->Write();
   out.Close();
 
-  // Get sum of squared residual to fisher's F-test
-/*    RooHist *hresid;
-    hresid = tframePR->residHist();
-    hresid->SetName("residual");
-    double *yresid = hresid->GetY();
-    unsigned int nBins = ws->var("Jpsi_Ct")->getBinning().numBins();
-    for (unsigned int i=0; i < nBins; i++) {
-      RSS = RSS + pow(yresid[i],2);
-      if (fabs(yresid[i]) > 0.0001) nFullBinsResid++;
-    }
-
-    RooPlot* tframeres =  ws->var("Jpsi_Ct")->frame(Title("Residual Distribution")) ;
-    tframeres->SetLabelSize(0.08,"XYZ");
-    tframeres->SetTitleSize(0.1,"XYZ");
-    tframeres->SetTitleOffset(0.55,"Y");
-    tframeres->addPlotable(hresid,"P") ;
-    tframeres->SetMaximum(-(tframeres->GetMinimum())); 
-    tframeres->GetXaxis()->SetTitle("#font[12]{l}_{J/#psi}/#font[12]{#sigma({l}_{J/#psi})} (mm)");
-    tframeres->GetXaxis()->CenterTitle(1);
-
-    c00.cd();
-    TPad padpr1("padpr1","This is pad1",0.05,0.35,0.95,0.97);
-    padpr1.SetBottomMargin(0);
-    padpr1.Draw();
-    TPad padpr2("padpr2","This is pad2",0.05,0.03,0.95,0.35);
-    padpr2.SetTopMargin(0);
-    padpr2.SetBottomMargin(0.24);
-    padpr2.Draw();
-
-    padpr1.cd(); tframePR->Draw();
-    padpr2.cd();
-    tframeres->SetMinimum(0.5); 
-    tframeres->Draw();
-
-    TLatex tpr;
-    tpr.SetNDC(); tpr.SetTextAlign(22);
-    tpr.SetTextSize(0.07);
-    sprintf(reduceDS,"RSS = %.0f, nFullBinsResid = %d",RSS,nFullBinsResid);
-    tpr.DrawLatex(0.7,0.90,reduceDS);
-
-    titlestr = dirPre + "_rap" + yrange + "_pT" + prange + "_cent" + crange + "_dPhi" + phirange + "_2D_" + partFile + "resolfit_Lin.pdf";
-    c00.SaveAs(titlestr.c_str());
-    
-    padpr1.cd(); padpr1.SetLogy(1); tframePR->Draw();
-    padpr2.cd(); padpr2.SetLogy(1); tframeres->Draw();
-    tpr.DrawLatex(0.7,0.90,reduceDS);
-    titlestr = dirPre + "_rap" + yrange + "_pT" + prange + "_cent" + crange + "_dPhi" + phirange + "_2D_" + partFile + "resolfit_Log.pdf";
-    c00.SaveAs(titlestr.c_str());
-*/
+  // Sum of squared residuals, for Fisher's F-test between resolution models
+  if (fitMC) {
+    double RSS = 0;
+    for (unsigned int i=0; i<gofPR.resid.size(); i++) RSS += gofPR.resid[i]*gofPR.resid[i];
+    cout << "ctauResolFitCheck:: RSS = " << RSS << ", nFullBinsResid = " << gofPR.nFullBins << endl;
+  }
 }
 
 void drawCtauSBPlots(RooWorkspace *ws, RooDataSet *redDataSB, RooDataSet *redDataSBL, RooDataSet *redDataSBR, RooDataHist *binDataCtErrSB, RooFitResult *fitSB, RooFitResult *fitSBL, RooFitResult *fitSBR, InputOpt &opt) {
@@ -2727,22 +3515,13 @@ void drawCtauSBPlots(RooWorkspace *ws, RooDataSet *redDataSB, RooDataSet *redDat
 
     leg11.Draw("same");
 
-    TH1 *hdatasb = redDataSB->createHistogram("hdatasb",*ws->var("Jpsi_Ct"),Binning(rb));
-    RooHist *hpullsb = tframe1->pullHist(); hpullsb->SetName("hpullSB");
+    BinnedGOF gof;
+    if (opt.isPEE == 1) binnedGOF(ws->pdf("bkgCtauTOT_PEE"),ws->var("Jpsi_Ct"),rb,redDataSB,binDataCtErrSB,redDataSB->sumEntries(),gof);
+    else binnedGOF(ws->pdf("bkgCtTot"),ws->var("Jpsi_Ct"),rb,redDataSB,0,redDataSB->sumEntries(),gof);
+    RooHist *hpullsb = gofHist(gof); hpullsb->SetName("hpullSB");
     int nFitPar = fitSB->floatParsFinal().getSize();
-    double chi2 = 0;
-    double *ypullssb = hpullsb->GetY();
-    unsigned int nBins = ws->var("Jpsi_Ct")->getBinning().numBins();
-    unsigned int nFullBins = 0;
-    for (unsigned int i = 0; i < nBins; i++) {
-      if (hdatasb->GetBinContent(i+1) == 0) continue;
-      chi2 += ypullssb[i]*ypullssb[i];
-      nFullBins++;
-    }
-    unNormChi2 = chi2;
-    dof = nFullBins - nFitPar;
-    chi2 /= (nFullBins - nFitPar);
-    int nDOF = ws->var("Jpsi_Ct")->getBinning().numBins() - nFitPar;
+    unNormChi2 = gof.chi2;
+    dof = gof.nFullBins - nFitPar;
 
     RooPlot* tframepull =  ws->var("Jpsi_Ct")->frame(Title("Pull")) ;
     tframepull->GetYaxis()->SetTitle("Pull");
@@ -2868,22 +3647,12 @@ void drawCtauSBPlots(RooWorkspace *ws, RooDataSet *redDataSB, RooDataSet *redDat
     leg11.AddEntry(&hfake11,"background","l");
     leg11.Draw("same");
 
-    TH1 *hdatasb = redDataSBL->createHistogram("hdatasb",*ws->var("Jpsi_Ct"),Binning(rb));
-    RooHist *hpullsb = tframe1->pullHist(); hpullsb->SetName("hpullSB");
+    BinnedGOF gof;
+    binnedGOF(ws->pdf("bkgCtauTOTL_PEE"),ws->var("Jpsi_Ct"),rb,redDataSBL,binDataCtErrSB,redDataSBL->sumEntries(),gof);
+    RooHist *hpullsb = gofHist(gof); hpullsb->SetName("hpullSB");
     int nFitPar = fitSBL->floatParsFinal().getSize();
-    double chi2 = 0;
-    double *ypullssb = hpullsb->GetY();
-    unsigned int nBins = ws->var("Jpsi_Ct")->getBinning().numBins();
-    unsigned int nFullBins = 0;
-    for (unsigned int i = 0; i < nBins; i++) {
-      if (hdatasb->GetBinContent(i+1) == 0) continue;
-      chi2 += ypullssb[i]*ypullssb[i];
-      nFullBins++;
-    }
-    unNormChi2 = chi2;
-    dof = nFullBins - nFitPar;
-    chi2 /= (nFullBins - nFitPar);
-    int nDOF = ws->var("Jpsi_Ct")->getBinning().numBins() - nFitPar;
+    unNormChi2 = gof.chi2;
+    dof = gof.nFullBins - nFitPar;
 
     RooPlot* tframepull = ws->var("Jpsi_Ct")->frame(Title("Pull")) ;
     tframepull->GetYaxis()->SetTitle("Pull");
@@ -2965,7 +3734,6 @@ void drawCtauSBPlots(RooWorkspace *ws, RooDataSet *redDataSB, RooDataSet *redDat
     delete pad1a;
     delete pad2a;
     delete c3a;
-    delete hdatasb;
     delete hpullsb;
     delete tframe1;
 
@@ -3002,22 +3770,11 @@ void drawCtauSBPlots(RooWorkspace *ws, RooDataSet *redDataSB, RooDataSet *redDat
     leg11.SetY2NDC(0.49);
     leg11.Draw("same");
 
-    hdatasb = redDataSBR->createHistogram("hdatasb",*ws->var("Jpsi_Ct"),Binning(rb));
-    hpullsb = tframe1->pullHist(); hpullsb->SetName("hpullSB");
+    binnedGOF(ws->pdf("bkgCtauTOTR_PEE"),ws->var("Jpsi_Ct"),rb,redDataSBR,binDataCtErrSB,redDataSBR->sumEntries(),gof);
+    hpullsb = gofHist(gof); hpullsb->SetName("hpullSB");
     nFitPar = fitSBR->floatParsFinal().getSize();
-    chi2 = 0;
-    ypullssb = hpullsb->GetY();
-    nBins = ws->var("Jpsi_Ct")->getBinning().numBins();
-    nFullBins = 0;
-    for (unsigned int i = 0; i < nBins; i++) {
-      if (hdatasb->GetBinContent(i+1) == 0) continue;
-      chi2 += ypullssb[i]*ypullssb[i];
-      nFullBins++;
-    }
-    unNormChi2 = chi2;
-    dof = nFullBins - nFitPar;
-    chi2 /= (nFullBins - nFitPar);
-    nDOF = ws->var("Jpsi_Ct")->getBinning().numBins() - nFitPar;
+    unNormChi2 = gof.chi2;
+    dof = gof.nFullBins - nFitPar;
 
     tframepull =  ws->var("Jpsi_Ct")->frame(Title("Pull")) ;
     tframepull->GetYaxis()->SetTitle("Pull");
@@ -3096,7 +3853,6 @@ void drawCtauSBPlots(RooWorkspace *ws, RooDataSet *redDataSB, RooDataSet *redDat
     delete pad1a;
     delete pad2a;
     delete c3a;
-    delete hdatasb;
     delete hpullsb;
     delete tframe1;
   } // end of sideband ctau plot drawing
@@ -3162,22 +3918,13 @@ void drawMassPlotsWithB(RooWorkspace *ws, RooDataSet* redDataCut, double NSigNP_
   }
   redDataCut->plotOn(mframe,DataError(RooAbsData::SumW2),XErrorSize(0),MarkerSize(1),Binning(rb));
 
-  TH1 *hdata = redDataCut->createHistogram("hdata",*ws->var("Jpsi_Mass"),Binning(rb));
   // *** Calculate chi2/nDof for mass fitting
-  int nBins = hdata->GetNbinsX();
-  RooHist *hpullm; hpullm = mframe->pullHist(); hpullm->SetName("hpullM");
-  double Chi2 = 0;
-  int nFullBinsPull = 0;
-  double *ypull = hpullm->GetY();
-  for (unsigned int i=0; i < nBins; i++) {
-    if (hdata->GetBinContent(i+1) == 0) continue;
-    nFullBinsPull++;
-    Chi2 = Chi2 + pow(ypull[i],2);
-  }
-  double UnNormChi2 = Chi2;
+  BinnedGOF gof;
+  binnedGOF(ws->pdf(opt.isPEE == 1 ? "totPDF_PEE" : "totPDF"),ws->var("Jpsi_Mass"),rb,redDataCut,0,redDataCut->sumEntries(),gof);
+  RooHist *hpullm = gofHist(gof); hpullm->SetName("hpullM");
+  double UnNormChi2 = gof.chi2;
   int nFitParam = fitM->floatParsFinal().getSize();
-  int Dof = nFullBinsPull - nFitParam;
-  Chi2 /= (nFullBinsPull - nFitParam);
+  int Dof = gof.nFullBins - nFitParam;
 
   TCanvas c1wop; c1wop.Draw();
   mframe->Draw();
@@ -3320,7 +4067,6 @@ void drawCtauFitPlots(RooWorkspace *ws, RooDataSet *redDataCut, RooDataHist* bin
   tframe->GetXaxis()->CenterTitle(1);
 
   // Ctau total distributions
-  RooHist *hpulltot;
   redDataCut->plotOn(tframe,DataError(RooAbsData::SumW2),Binning(rb),MarkerSize(1));
 
   if (opt.isPEE == 1) {
@@ -3332,7 +4078,6 @@ void drawCtauFitPlots(RooWorkspace *ws, RooDataSet *redDataCut, RooDataHist* bin
     ws->pdf("totPDF_PEE")->plotOn(tframe,LineColor(kBlack),LineWidth(2),NumCPU(8),Normalization(redDataCut->sumEntries(),RooAbsReal::NumEvent));
 */
     ws->pdf("totPDF_PEE")->plotOn(tframe,LineColor(kBlack),LineWidth(2),ProjWData(RooArgList(*(ws->var("Jpsi_CtErr"))),*binDataCtErr,kTRUE),NumCPU(8),Normalization(1,RooAbsReal::NumEvent));
-    hpulltot = tframe->pullHist(); hpulltot->SetName("hpulltot");
     ws->pdf("totPDF_PEE")->plotOn(tframe,Components("totBKG"),LineColor(kBlue),LineWidth(5),ProjWData(RooArgList(*(ws->var("Jpsi_CtErr"))),*binDataCtErr,kTRUE),NumCPU(8),Normalization(1,RooAbsReal::NumEvent),LineStyle(7));
     ws->pdf("totPDF_PEE")->plotOn(tframe,Components("totSIGNP"),LineColor(kRed),ProjWData(RooArgList(*(ws->var("Jpsi_CtErr"))),*binDataCtErr,kTRUE),NumCPU(8),Normalization(1,RooAbsReal::NumEvent),LineStyle(kDashed));
     ws->pdf("totPDF_PEE")->plotOn(tframe,Components("totSIGPR"),LineColor(kGreen),ProjWData(RooArgList(*(ws->var("Jpsi_CtErr"))),*binDataCtErr,kTRUE),NumCPU(8),Normalization(1,RooAbsReal::NumEvent),LineStyle(kDashDotted));
@@ -3347,28 +4092,19 @@ void drawCtauFitPlots(RooWorkspace *ws, RooDataSet *redDataCut, RooDataHist* bin
 */
   } else {  //not pee
     ws->pdf("totPDF")->plotOn(tframe,LineColor(kBlack),LineWidth(2),Normalization(redDataCut->sumEntries(),RooAbsReal::NumEvent));
-    hpulltot = tframe->pullHist(); hpulltot->SetName("hpulltot");
     ws->pdf("totPDF")->plotOn(tframe,Components("bkgCtTot"),LineColor(kBlue),LineWidth(5),Normalization(redDataCut->sumEntries(),RooAbsReal::NumEvent),LineStyle(7));
     ws->pdf("totPDF")->plotOn(tframe,Components("sigNP"),LineColor(kRed),Normalization(redDataCut->sumEntries(),RooAbsReal::NumEvent),LineStyle(kDashed));
     ws->pdf("totPDF")->plotOn(tframe,Components("sigPR"),LineColor(kGreen),Normalization(redDataCut->sumEntries(),RooAbsReal::NumEvent),LineStyle(kDashDotted));
     ws->pdf("totPDF")->plotOn(tframe,LineColor(kBlack),LineWidth(2),Normalization(redDataCut->sumEntries(),RooAbsReal::NumEvent));
   }
 
-  TH1 *hdatact = redDataCut->createHistogram("hdatact",*ws->var("Jpsi_Ct"),Binning(rb));
-  double chi2 = 0, unNormChi2 = 0;
-  int dof = 0;
-  double *ypulls = hpulltot->GetY();
-  unsigned int nBins = ws->var("Jpsi_Ct")->getBinning().numBins();
-  unsigned int nFullBins = 0;
-  for (unsigned int i = 0; i < nBins; i++) {
-    if (hdatact->GetBinContent(i+1) == 0) continue;
-    chi2 += ypulls[i]*ypulls[i];
-    nFullBins++;
-  }
-  unNormChi2 = chi2;
+  BinnedGOF gof;
+  if (opt.isPEE == 1) binnedGOF(ws->pdf("totPDF_PEE"),ws->var("Jpsi_Ct"),rb,redDataCut,binDataCtErr,redDataCut->sumEntries(),gof);
+  else binnedGOF(ws->pdf("totPDF"),ws->var("Jpsi_Ct"),rb,redDataCut,0,redDataCut->sumEntries(),gof);
+  RooHist *hpulltot = gofHist(gof); hpulltot->SetName("hpulltot");
+  double unNormChi2 = gof.chi2;
   int nFitPar = fit2D->floatParsFinal().getSize();
-  dof = nFullBins - nFitPar;
-  chi2 /= (nFullBins - nFitPar);
+  int dof = gof.nFullBins - nFitPar;
 
   // WITH RESIDUALS
   TCanvas* c2 = new TCanvas("c2","The Canvas",200,10,600,880);
@@ -3426,8 +4162,6 @@ void drawCtauFitPlots(RooWorkspace *ws, RooDataSet *redDataCut, RooDataHist* bin
 
   pad2->cd(); tframepull->Draw();
 
-  int nDOF = ws->var("Jpsi_Ct")->getBinning().numBins() - nFitPar;
-
   TLatex *t2 = new TLatex();
   t2->SetNDC(); t2->SetTextAlign(22); t2->SetTextSize(0.07);
   sprintf(reduceDS,"#chi^{2}/dof = %.2f/%d",unNormChi2,dof);
@@ -3791,11 +4525,9 @@ void drawCtauFitPlotsSignals(RooWorkspace *ws, RooDataSet *redDataCut, RooDataSe
   ws->factory("GaussModel::resGN2(Jpsi_Ct,meanResSigW2,sigmaResSigN2[0.04,0.01,0.3])");
   ws->factory("AddModel::sigPR2({resGW2,resGN2},{fracRes22[0.2,0.01,0.9]})");*/
   
-  RooHistPdfConv sigNPW("sigNPW2","Non-prompt signal with wide gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW2")),*(ws->var("sigmaResSigW2")),*binMCCutNP ); ws->import(sigNPW);
-  RooHistPdfConv sigNPO("sigNPO2","Non-prompt signal with outstanding gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW2")),*(ws->var("sigmaResSigO2")),*binMCCutNP ); ws->import(sigNPO);
-  RooHistPdfConv sigNPM("sigNPM2","Non-prompt signal with mastodontic gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW2")),*(ws->var("sigmaResSigM2")),*binMCCutNP ); ws->import(sigNPM);
-  RooHistPdfConv sigNPN("sigNPN2","Non-prompt signal with narrow gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW2")),*(ws->var("sigmaResSigN2")),*binMCCutNP ); ws->import(sigNPN);
-  RooAddPdf sigNP("sigNP2","Non-prompt signal",RooArgSet(*(ws->pdf("sigNPW2")),*(ws->pdf("sigNPO2")),*(ws->pdf("sigNPM2")),*(ws->pdf("sigNPN2"))),RooArgSet(*(ws->var("fracRes12")),*(ws->var("fracRes22")),*(ws->var("fracRes32")))); ws->import(sigNP);
+  RooHistPdfConv sigNP("sigNP2","Non-prompt signal",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW2")),
+      RooArgList(*(ws->var("sigmaResSigW2")),*(ws->var("sigmaResSigO2")),*(ws->var("sigmaResSigM2")),*(ws->var("sigmaResSigN2"))),
+      RooArgList(*(ws->var("fracRes12")),*(ws->var("fracRes22")),*(ws->var("fracRes32"))),*binMCCutNP); ws->import(sigNP);
   
 /*  RooHistPdfConv sigNPN("sigNPN2","Non-prompt signal with narrow gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW2")),*(ws->var("sigmaResSigN2")),*binMCCutNP ); ws->import(sigNPN);
   RooHistPdfConv sigNPW("sigNPW2","Non-prompt signal with wide gaussian",*(ws->var("Jpsi_Ct")),*(ws->var("meanResSigW2")),*(ws->var("sigmaResSigW2")),*binMCCutNP ); ws->import(sigNPW);
@@ -100,7 +100,7 @@ function program {
       echo "Processing: "$work
       printf "#!/bin/bash\n" > $scripts/$work.sh
       printf "source /afs/cern.ch/sw/lcg/external/gcc/4.9/x86_64-slc6-gcc49-opt/setup.sh; source /afs/cern.ch/sw/lcg/app/releases/ROOT/6.04.14/x86_64-slc6-gcc49-opt/root/bin/thisroot.sh\n" >> $scripts/$work.sh
-      printf "cp %s/%s.sh %s/Makefile %s/RooHistPdfConv* %s/fit2DData.h %s/fit2DData_pbpb.cpp .\n" $scripts $work $(pwd) $(pwd) $(pwd) $(pwd) >> $scripts/$work.sh
+      printf "cp %s/%s.sh %s/Makefile %s/RooHistPdfConv* %s/RooFFTKeysPdf* %s/RooCBGaussPdf* %s/DimuonColumns.h %s/fit2DData.h %s/fit2DData_pbpb.cpp .\n" $scripts $work $(pwd) $(pwd) $(pwd) $(pwd) $(pwd) $(pwd) $(pwd) >> $scripts/$work.sh
       printf "make; make Fit2DDataPbPb \n" $scripts $work $(pwd) $(pwd) >> $scripts/$work.sh
 
       if [ "$cent" == "0.0-100.0" ]; then
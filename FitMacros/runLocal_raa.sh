@@ -0,0 +1,158 @@
+#!/bin/bash
+if [ $# -ne 4 ]; then
+  echo "Usage: $0 [Executable] [Input directory] [Prefix] [Number of workers]"
+  exit;
+fi
+
+executable=./$1
+datasets=$2
+prefix=$3
+nworkers=$4
+
+################################################################ 
+########## Script parameter setting
+################################################################ 
+# All bins are fitted by one process: input files are read once and
+# bins are distributed over $nworkers forked workers
+binlist=$(pwd)/$prefix"_binList.txt"
+stageMB=$binlist".mb"
+stagePHI=$binlist".phi"
+stageBin=$binlist".bin"
+# Fit results of every stage are kept here and reused by reruns and by
+# other prefixes (systematic variations) running the same stage
+fitcache=$(pwd)/FitCache
+warmstart=1 # 1: start new bins from the nearest bin already in the cache
+templatecache=$(pwd)/TemplateCache # non-prompt MC lifetime templates, shared by all prefixes
+deferplots=1 # 1: fit workers only write plot inputs (-q 1), plots are drawn by a second pass (-q 2)
+profile="0 1" # profile likelihood scan of Bfrac/NSig/NBkg: points per parameter (0: off), parallel workers per bin
+toys="0 1 1" # toy MC pull study of Bfrac/NSig/NBkg: toys per fit (0: off), parallel workers per bin, seed
+simfit=0 # simultaneous fit with shared resolution/b-lifetime: 0: off, 1: centrality bins of each rap/pT/dPhi, 2: dPhi bins of each rap/pT/cent
+rm -f $stageMB $stagePHI $stageBin
+
+ctaurange=1.5-2.0
+fracfree=0
+ispbpb=1
+is2Widths=1
+isPEE=1
+usedPhi=0 # 0: RAA, 1: v2 (this determines whether dphi angles will be presented on the plots or not)
+
+# Non-prompt MC
+mc1=/afs/cern.ch/work/m/miheejo/private/2014JpsiAna/PbPb/datasets_mc/root604/nonPrompt/nonPrompt.root
+# Prompt MC
+mc2=/afs/cern.ch/work/m/miheejo/private/2014JpsiAna/PbPb/datasets_mc/root604/prompt/prompt.root
+
+mSigF="sigCB2WNG1" # Mass signal function name (options: sigCB2WNG1 (default), signalCB3WN)
+mBkgF="expFunct" # Mass background function name (options: expFunct (default), polFunct)
+
+weight=0  #0: Do NOT weight, 1: Do weight + extended ML fit, 2: Do weight + normalized ML fit
+eventplane="etHF" # Name of eventplane (etHFp, etHFm, etHF(default))
+runOpt=4 # Inclusive mass fit (options: 4(default), 3(Constrained fit), 5(_mb in 2010 analysis))
+ctauErrOpt=0 # 2: Not apply ctau error range, 1: get ctau error range on the fly, 0: read ctau error range from a file (fit_ctauErrorRange)
+             # 3: indexed table at ctauErrFile, bins missing in it are determined once (as 1) by the driver and added
+ctauErrFile=/afs/cern.ch/user/m/miheejo/public/HIN-14-005/FitScripts/PbPb_noWeighted_fit_ctauErrorRange_Lxyz # Location of ctau error range file
+anaBct=1 #0: do b-fit(not-analytic fit for b-lifetime), 1: do b-fit(analytic fit for b-lifetime), 2: do NOT b-fit
+#0: 2 Resolution functions & fit on data, 1: 1 Resolution function & fit on data,
+#2: 2 Resolution functions & fit on PRMC, 3: 1 Resolution function & fit on PRMC
+resOpt=0
+ctauBkg=0 #0: 1 ctau bkg, 1: 2 ctau bkg with signal region fitting, 2: 2 ctau bkg with step function
+
+########## Except dphibins, rap, pt, centrality bins doesn't need "integrated range" bins in the array.
+########## Ex ) DO NOT USE rapbins=(0.0-2.4) or ptbins=(6.5-30.0) or centbins=(0.0-100.0)
+########## dphibins always needs "0.000-1.571" both for Raa and v2. Add other dphibins if you need
+dphibins=(0.000-1.571)
+rapfiner=(0.0-0.4 0.4-0.8 0.8-1.2 1.2-1.6 1.6-2.0 2.0-2.4)
+rapcoarser2=(0.0-1.2 1.2-1.6 1.6-2.4)
+rapcoarser4=(1.6-2.4)
+centfiner=(0.0-5.0 5.0-10.0 10.0-15.0 15.0-20.0 20.0-25.0 25.0-30.0 30.0-35.0 35.0-40.0 40.0-45.0 45.0-50.0 50.0-55.0 55.0-60.0 60.0-100.0 60.0-70.0 70.0-100.0)
+centcoarser2=(50.0-60.0 60.0-100.0)
+centcoarser3=(0.0-10.0 10.0-20.0 20.0-30.0 30.0-40.0 40.0-50.0 50.0-100.0)
+centcoarser4=(60.0-100.0)
+centcoarser5=(10.0-30.0 30.0-60.0)
+centcoarser6=(0.0-20.0 20.0-40.0 40.0-100.0)
+ptfiner=(6.5-8.5 6.5-7.5 7.5-8.5 8.5-9.5 9.5-11.0 11.0-13.0 13.0-16.0 16.0-30.0)
+ptcoarser2=(6.5-8.0 8.0-10.0 10.0-13.0 13.0-30.0)
+ptcoarser3=(6.5-8.0 8.0-10.0 10.0-30.0 10.0-13.0 13.0-30.0)
+ptcoarser4=(3.0-6.5 6.5-30.0)
+
+
+################################################################ 
+########## Function for bin list filling
+################################################################ 
+# Inclusive fits (-a 3) are needed before the bins reading their results (-x),
+# so they go to earlier stages of the bin list
+function program {
+  ### Arguments
+  rap=$1
+  pt=$2
+  shift; shift;
+  centarr=(${@})
+
+  for cent in ${centarr[@]}; do
+    for dphi in ${dphibins[@]}; do
+      if [ "$cent" != "0.0-100.0" ]; then
+        echo "$rap $pt 0.0-100.0 0.000-1.571 3" >> $stageMB
+        if [ "$dphi" != "0.000-1.571" ]; then
+          echo "$rap $pt $cent 0.000-1.571 3" >> $stagePHI
+        fi
+      elif [ "$dphi" != "0.000-1.571" ]; then
+        echo "$rap $pt $cent 0.000-1.571 3" >> $stagePHI
+      fi
+      echo "$rap $pt $cent $dphi $anaBct" >> $stageBin
+    done
+  done
+}
+
+################################################################ 
+########## Filling bin list with pre-defined binnings
+################################################################ 
+program 0.0-2.4 6.5-30.0 0.0-100.0
+program 0.0-2.4 6.5-30.0 ${centfiner[@]}
+program 0.0-2.4 6.5-30.0 ${centcoarser2[@]}
+program 0.0-2.4 6.5-30.0 ${centcoarser3[@]}
+
+for rap in ${rapfiner[@]}; do
+  program $rap 6.5-30.0 0.0-100.0
+done
+for pt in ${ptfiner[@]}; do
+  program 0.0-2.4 $pt 0.0-100.0
+done
+
+program 1.6-2.4 3.0-30.0 0.0-100.0
+program 1.6-2.4 3.0-4.5 0.0-100.0
+program 1.6-2.4 4.5-5.5 0.0-100.0
+program 1.6-2.4 3.0-5.5 0.0-100.0
+program 1.6-2.4 5.5-6.5 0.0-100.0
+program 1.6-2.4 3.0-6.5 ${centcoarser3[@]}
+program 1.6-2.4 3.0-6.5 ${centcoarser6[@]}
+program 1.6-2.4 3.0-6.5 0.0-100.0
+for rap in ${rapcoarser2[@]}; do
+  program $rap 6.5-30.0 ${centcoarser3[@]}
+  program $rap 6.5-30.0 0.0-100.0
+done
+
+for pt in ${ptcoarser3[@]}; do
+  program 0.0-2.4 $pt 0.0-100.0
+done
+
+################################################################ 
+########## Run all bins in one process
+################################################################ 
+# Stages are separated by an empty line, fits already done with the
+# same lifetime option in an earlier stage are not repeated
+printf "# rap pT cent dPhi lifetimeOpt\n" > $binlist
+for stage in $stageMB $stagePHI $stageBin; do
+  if [ -f $stage ]; then
+    awk '!seen[$0]++' $stage | while read line; do
+      if ! grep -qx "$line" $binlist; then echo $line >> $binlist; fi
+    done
+    printf "\n" >> $binlist
+  fi
+done
+rm -f $stageMB $stagePHI $stageBin
+
+fitargs="-f $datasets $weight -m $mc1 $mc2 -v $mSigF $mBkgF -d $prefix -r $eventplane $usedPhi -u $resOpt -a $anaBct $ctauBkg -b $ispbpb $isPEE $is2Widths -p 6.5-30.0 -y 0.0-2.4 -t 0.0-100.0 -s 0.000-1.571 -l $ctaurange -x $runOpt $ctauErrOpt $ctauErrFile -z $fracfree -n $binlist $nworkers -c $fitcache $warmstart -w $templatecache -i $profile -j $toys -h $simfit"
+$executable $fitargs -q $deferplots >& $prefix"_driver.log"
+# Fit numbers are final at this point, plots are rendered from the _ws.root files
+if [ $deferplots -eq 1 ]; then
+  $executable $fitargs -q 2 >& $prefix"_plots.log"
+fi